@@ -11,6 +11,15 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <time.h>
 #include <math.h>
 
 /* Constant definitions */
@@ -27,107 +36,573 @@
  * simplicity and uniformity, the output layer ignores element 0 of its array 
  * and indexes from 1 to OPSIZE.
 
- * The number of training and testing patterns are given by the predefined
- * size of the lowmemorykiller database. The global arrays "patterns" and
- * "desired" are used to hold the training patterns/responses and also the
- * test patterns/responses. The idea is that the network is first completely
- * trained, then these arrays are overwritten with test data/responses and the
- * network is then tested on these previously unseen patterns.
-
- * Since there are more training patterns than test patterns, the
- * arrays are dimensioned with the number of training patterns.
+ * The training patterns/responses and the test patterns/responses are held in
+ * two pattern sets, "training_set" and "testing_set", sized by the files they
+ * are loaded from. The idea is that the network is first completely trained
+ * on the former and then tested on the latter, previously unseen, patterns.
+ * With -V, part of the training patterns are moved to a third set,
+ * "validation_set", which decides when the training stops (see "validate").
+
+ * A pattern set keeps each input and each desired output in a column of its
+ * own, PATTERN_ALIGN aligned, so the same input of consecutive patterns is
+ * contiguous in memory.  The columns are read either from a text file, one
+ * pattern per line with its INSIZE inputs and OPSIZE desired outputs
+ * separated by commas, or from a binary pattern file, which is mapped into
+ * memory as it is (see "map_patterns").
 */
 
-#define TRAINING_PATTERNS  2400      /* Number of training patterns      */
-#define TESTING_PATTERNS   2400      /* Number of testing patterns       */
+#define PATTERN_MAGIC      "LMKPAT2"  /* Magic of binary pattern files   */
+#define PATTERN_ALIGN      64         /* Alignment of the columns        */
+
+#define CHECKPOINT_MAGIC   "LMKNET1"  /* Magic of checkpoint files       */
+#define CHECKPOINT_EPOCHS  1000       /* Epochs between checkpoints      */
+
+#define BENCH_EPOCHS       1000       /* Epochs of a training benchmark  */
+#define BENCH_REPEATS      5          /* Runs of it, the fastest counts  */
+#define BENCH_CALLS        100000     /* Inferences of a run             */
+#define BENCH_SAMPLE_CALLS 100        /* Inferences timed together       */
+#define BENCH_TOLERANCE    0.10       /* Least slowdown against a        */
+                                      /* baseline taken as a regression  */
+#define BENCH_SPREADS      3          /* Tolerance in run-to-run spreads */
+#define BENCH_BASELINES    64         /* Runs of a benchmark read by -C  */
+
+#define FIXED_Q            16         /* Fraction bits of the weights    */
+#define FIXED_ONE          (1 << FIXED_Q)  /* exported to the kernel     */
 
 #define TARGET_ERROR       1e-3      /* Average squared output error     */
                                      /* allowed in trained network.      */
 
 #define MAX_EPOCHS         20000     /* This is the training limit       */
 
+#define WEIGHTS            ((INSIZE+1) * (HDSIZE+1) + (HDSIZE+1) * (OPSIZE+1))
+#define MIN_THREAD_WORK    10000     /* Least patterns x weights of an   */
+                                     /* epoch for each thread of -p      */
+
+#define PATIENCE           1000      /* Epochs without a better error on */
+                                     /* the validation set before the    */
+                                     /* training stops                   */
+
 #define DELTA			0.2f			/* Tolerance on outputs, to be      */
 										/* considered as 0, output has to   */
 					/* be <= DELTA, to be considered as */
 					/* 1, output >= 1.0 - DELTA.        */
 
+#define MOMENTUM           0         /* Optimizers, see "update_weights" */
+#define RMSPROP            1
+#define ADAM               2
+
+#define RMSPROP_RHO        0.9       /* Decay of the squared gradients   */
+#define ADAM_BETA1         0.9       /* Decay of the gradients           */
+#define ADAM_BETA2         0.999     /* Decay of the squared gradients   */
+#define OPT_EPSILON        1e-8      /* Keeps the steps finite           */
+
+#define CONSTANT           0         /* Learning rate schedules, see     */
+#define STEP               1         /* "learning_rate"                  */
+#define COSINE             2
+
 #define CLASS              1         /* Codes for routine          */
 #define MISCLASS           2         /* "report_outputs"                 */
 #define INDEF              3
 
+/* A set of patterns and their desired responses.  input[0] is the bias "unit",
+   always 1, and target[0] is unused.  Every column holds "stride" doubles, "count"
+   of them in use, and the columns follow each other in one block, so input[0] is
+   also a row-major [INSIZE+1][stride] matrix, as the batch buffers are.
+*/
+
+struct pattern_set {
+    int     count,                        /* Number of patterns */
+            stride;                       /* Doubles per column, a multiple of PATTERN_ALIGN */
+    double *input[INSIZE+1],              /* input[i][p], input i of pattern p */
+           *target[OPSIZE+1],             /* target[k][p], desired output k of pattern p */
+           *columns;                      /* The allocated block, unless mapped */
+    void   *map;                          /* Mapping of a binary pattern file, or NULL */
+    size_t  map_size;
+};
+
+/* Header of a binary pattern file.  It is followed, at "columns_offset", by the block
+   of columns of a pattern set, input[0] to input[INSIZE] and then target[1] to
+   target[OPSIZE], in the byte order of the machine that wrote them.
+*/
+
+struct pattern_header {
+    char     magic[8];                    /* PATTERN_MAGIC */
+    uint32_t byte_order,                  /* 0x01020304, as written */
+             count,                       /* Number of patterns */
+             insize,                      /* INSIZE of the writer */
+             opsize;                      /* OPSIZE of the writer */
+    uint64_t stride,                      /* Doubles per column */
+             columns_offset;              /* Offset of input[0][0] in the file */
+};
+
+/* Header of a checkpoint file, see "save_checkpoint".  It is followed by the weight
+   matrices of the network and the state of its optimizer and of its validation, in
+   the order of "checkpoint_arrays", and then by "order_size" ints of its shuffled
+   order of the training patterns.
+*/
+
+struct checkpoint_header {
+    char     magic[8];                    /* CHECKPOINT_MAGIC */
+    uint32_t byte_order,                  /* 0x01020304, as written */
+             insize,                      /* INSIZE, */
+             hdsize,                      /* HDSIZE */
+             opsize,                      /* and OPSIZE of the writer */
+             optimizer,                   /* Rule of the weight updates */
+             seed,                        /* State of the random number generator */
+             epochs,                      /* Epochs trained */
+             best_epoch,                  /* Epoch of the best weights on validation, or 0 */
+             order_size,                  /* Patterns in the order, 0 without mini-batches */
+             order_pos;                   /* Next pattern to take from the order */
+    uint64_t steps;                       /* Weight updates done */
+    double   eta,                         /* Training parameters */
+             alpha,
+             c;
+    float    epoch_error,                 /* Error of the last epoch */
+             best_error;                  /* Lowest error on the validation set */
+};
+
+/* The state of one network: its weights, the outputs and deltas of its last
+   presentation, its training parameters and the random number generator that
+   picks its initial weights and training patterns.  Networks share nothing but
+   the (read-only) pattern sets, so several of them can be trained at once.
+
+   In data-parallel training every thread trains a replica of the network (see
+   "train_epoch_parallel"), which takes its batches from a shard of the training set
+   and keeps a pointer to the network it trains in "parent".
+
+   The mini-batch buffers are row-major matrices with one row per unit, numbered
+   as in "input", "hidden" and "output" (row 0 is the bias "unit" or unused),
+   and one column per pattern of the batch.  The loops over the patterns of a
+   batch are then the innermost ones and run over contiguous memory.
+*/
+
+struct network {
+    double  hidden[HDSIZE+1],             /* Hidden layer outputs */
+            output[OPSIZE+1],             /* Output layer outputs */
+            w_ih[INSIZE+1][HDSIZE+1],     /* Weight matrix from input to hidden layers */
+            w_ho[HDSIZE+1][OPSIZE+1],     /* Weight matrix from hidden to output layers */
+            dw_ih[INSIZE+1][HDSIZE+1],    /* Changes in w(i,j) matrix */
+            dw_ho[HDSIZE+1][OPSIZE+1],    /* Changes in w(j,k) matrix */
+            m_ih[INSIZE+1][HDSIZE+1],     /* Running mean of the gradient on w(i,j) */
+            m_ho[HDSIZE+1][OPSIZE+1],     /* Running mean of the gradient on w(j,k) */
+            v_ih[INSIZE+1][HDSIZE+1],     /* Running mean of its square on w(i,j) */
+            v_ho[HDSIZE+1][OPSIZE+1],     /* Running mean of its square on w(j,k) */
+            delta_p_output[OPSIZE+1],     /* Delta(k) values on presentation p */
+            delta_p_hidden[HDSIZE+1],     /* Delta(j) values on presentation p */
+            eta,                          /* Learning rate parameter */
+            alpha,                        /* Momentum parameter */
+            c,                            /* Flatspot elimination parameter */
+            rate;                         /* Learning rate of the current epoch */
+    long    steps;                        /* Weight updates done */
+    unsigned int seed;                    /* State of the random number generator */
+    int     verbose;                      /* Report the progress of the training */
+
+    int    *order,                        /* Shuffled order of the training patterns */
+            order_pos,                    /* Next pattern to take from "order" */
+            shard_start,                  /* The shard of the training set that */
+            shard_stride,                 /* "order" holds, "shard_size" patterns */
+            shard_size,                   /* from shard_start, shard_stride apart */
+            batch_count;                  /* Patterns of the last batch of a replica */
+    double *batch_in,                     /* Inputs of the batch,  [INSIZE+1][batch] */
+           *batch_target,                 /* Desired outputs,      [OPSIZE+1][batch] */
+           *batch_hidden,                 /* Hidden layer outputs, [HDSIZE+1][batch] */
+           *batch_output,                 /* Output layer outputs, [OPSIZE+1][batch] */
+           *batch_delta_o,                /* Delta(k) values,      [OPSIZE+1][batch] */
+           *batch_delta_h;                /* Delta(j) values,      [HDSIZE+1][batch] */
+    double  g_ih[INSIZE+1][HDSIZE+1],     /* Gradient of the last presentation or */
+            g_ho[HDSIZE+1][OPSIZE+1];     /* batch on w_ih and w_ho */
+
+    int     epochs,                       /* Epochs run by train_network */
+            correct;                      /* Correct classifications of the test set */
+    float   epoch_error;                  /* Error of the last epoch */
+
+    double  best_w_ih[INSIZE+1][HDSIZE+1],  /* Weights with the lowest error on */
+            best_w_ho[HDSIZE+1][OPSIZE+1];  /* the validation set so far */
+    float   validation_error,             /* Error on the validation set, last epoch */
+            best_error;                   /* and lowest, */
+    int     best_epoch;                   /* reached in this epoch */
+
+    struct workers *workers;              /* Threads of data-parallel training, or NULL */
+    struct network *parent;               /* Network trained by this replica, or NULL */
+    int     worker;                       /* Number of the thread of this replica */
+};
+
+/* The threads of the data-parallel training of one network.  Worker 0 is the thread
+   that calls train_network, the others wait at "start" for each epoch.
+*/
+
+struct workers {
+    int              count;               /* Threads, worker 0 included */
+    struct network **replicas;            /* The replica trained by each thread */
+    pthread_t       *threads;             /* Threads of workers 1 to count - 1 */
+    pthread_barrier_t start,              /* An epoch, or the end, begins */
+                     done,                /* An epoch is over */
+                     gradients,           /* The gradients of a batch are computed */
+                     weights;             /* The network has been updated with them */
+    int              stop;                /* Leave at the next "start" */
+};
+
 /* Global variable storage */
 
-double  hidden[HDSIZE+1],             /* Hidden layer outputs */
-       output[OPSIZE+1],             /* Output layer outputs */
-       w_ih[INSIZE+1][HDSIZE+1],     /* Weight matrix from input to hidden layers */
-       w_ho[HDSIZE+1][OPSIZE+1],     /* Weight matrix from hidden to output layers */
-       dw_ih[INSIZE+1][HDSIZE+1],    /* Changes in w(i,j) matrix */
-       dw_ho[HDSIZE+1][OPSIZE+1],    /* Changes in w(j,k) matrix */
-       delta_p_output[OPSIZE+1],     /* Delta(k) values on presentation p */
-       delta_p_hidden[HDSIZE+1],     /* Delta(j) values on presentation p */
-       pattern[TRAINING_PATTERNS][INSIZE+1],  /* Set of training/testing patterns to be applied to the network */
-       desired[TRAINING_PATTERNS][OPSIZE+1],  /* Set of desired responses to the training/testing patterns */
-       eta,                          /* Learning rate parameter */
-       alpha,                        /* Momentum parameter */
-       c;                            /* Flatspot elimination parameter */
+struct pattern_set training_set,      /* Patterns the network is trained on */
+        testing_set,                  /* Patterns the network is tested on */
+        validation_set;               /* Training patterns held out to stop it */
+
+char   *training_file = "lowmemorykiller.tra",
+       *testing_file = "lowmemorykiller.tes",
+       *binary_file,                  /* Only write the patterns to this file */
+       *export_file,                  /* Export the trained network to this header */
+       *checkpoint_file,              /* Save the state of the network to this file */
+       *resume_file,                  /* Resume training from this checkpoint */
+       *load_file,                    /* Only test the network of this checkpoint */
+       *baseline_file;                /* Compare the benchmarks with this output of -B */
+
+int     benchmark;                    /* Run the benchmarks instead of training */
+
+int     batch_size = 0,               /* 0 trains pattern by pattern */
+        jobs,                         /* Networks trained at once by a sweep */
+        train_threads = 1,            /* Threads training each network */
+        hogwild = 0,                  /* Lock-free updates by the training threads */
+        patience = PATIENCE,          /* Epochs without improvement on validation_set */
+        optimizer = MOMENTUM,         /* Rule of the weight updates */
+        schedule = CONSTANT,          /* Change of the learning rate over the epochs */
+        schedule_epochs;              /* Epochs of a step, or of the cosine */
+float   schedule_factor;              /* Learning rate factor of each step */
+float   validation_fraction;          /* Part of the training set held out, or 0 */
+char   *optimizer_names[] = { "momentum", "rmsprop", "adam" };
+
+float  *eta_values,                   /* Values of eta, alpha and c given on the */
+       *alpha_values,                 /* command line, one of each unless this   */
+       *c_values;                     /* is a sweep                              */
+int     eta_count,
+        alpha_count,
+        c_count;
+
+struct network **sweep_nets;          /* Networks of the sweep */
+int     sweep_total,                  /* Number of networks of the sweep */
+        sweep_next;                   /* Next network to be trained */
+pthread_mutex_t sweep_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /* Function prototypes */
 
-void  load_patterns(int total, char *filename);
-void  load_pattern(int index, char *linebuffer);
-void  load_initial_weights(void);
-void  train_network(void);
-float train_epoch(void);
-float forwardprop(int p);
-void  backprop(int p);
-float random_val(void);
+void  load_patterns(struct pattern_set *set, char *filename);
+void  load_pattern(struct pattern_set *set, int index, char *linebuffer);
+void  alloc_patterns(struct pattern_set *set, int count);
+void  split_patterns(struct pattern_set *set, struct pattern_set *held_out, float fraction);
+void  free_patterns(struct pattern_set *set);
+void  set_columns(struct pattern_set *set, double *columns);
+int   map_patterns(struct pattern_set *set, char *filename);
+void  write_patterns(struct pattern_set *set, char *filename);
+struct network *new_network(float eta, float alpha, float c);
+int   checkpoint_arrays(struct network *net, double *arrays[], size_t sizes[]);
+void  save_checkpoint(struct network *net, char *filename);
+void  load_checkpoint(struct network *net, char *filename);
+void  load_initial_weights(struct network *net);
+void  train_network(struct network *net);
+float train_epoch(struct network *net);
+int   validate(struct network *net, int epoch);
+float forwardprop(struct network *net, struct pattern_set *set, int p);
+void  backprop(struct network *net, struct pattern_set *set, int p);
+void  update_weights(struct network *net);
+void  update_layer(struct network *net, double *restrict w, const double *restrict g,
+                   double *restrict dw, double *restrict m, double *restrict v, int n,
+                   double correction1, double correction2);
+float learning_rate(struct network *net, int epoch);
+void  init_batches(struct network *net);
+void  shuffle_order(struct network *net);
+float train_epoch_batch(struct network *net);
+float train_batch(struct network *net, int *rows, int n);
+float batch_gradient(struct network *net, int *rows, int n);
+void  start_workers(struct network *net);
+void  stop_workers(struct network *net);
+int   worker_count(int threads);
+void *worker_main(void *arg);
+float train_epoch_parallel(struct network *net);
+float train_share(struct network *replica);
+void  reduce_gradients(struct network *net);
+void  mat_mul(const double *restrict a, const double *restrict b, double *restrict r,
+              int m, int p, int n, int ld);
+void  mat_mul_tn(const double *restrict a, const double *restrict b, double *restrict r,
+                 int p, int m, int n, int ld);
+void  mat_mul_nt(const double *restrict a, const double *restrict b, double *restrict r,
+                 int m, int q, int n, int ld);
+float random_val(struct network *net);
 void  read_parameters(int argc, char *argv[]);
+void  read_schedule(char *argument_string);
 float read_argument(char *error_message, char *argument_string);
-
-void  report_operation(void);
-void  report_outputs(int p, int errortype);
-void  dump_weights(void);
-int   mismatch(int p);
-int   match(int p);
+int   read_range(char *error_message, char *argument_string, float **values);
+void  usage(char *name);
+
+void  sweep(void);
+void *sweep_worker(void *arg);
+int   compare_results(const void *a, const void *b);
+
+void  report_operation(struct network *net, struct pattern_set *set);
+int   test_network(struct network *net, struct pattern_set *set, int *misclassifications,
+                   int report);
+void  report_outputs(struct network *net, struct pattern_set *set, int p, int errortype);
+void  dump_weights(struct network *net);
+void  quantize_network(struct network *net, int32_t q_ih[INSIZE+1][HDSIZE+1],
+                       int32_t q_ho[HDSIZE+1][OPSIZE+1]);
+void  forwardprop_fixed(int32_t q_ih[INSIZE+1][HDSIZE+1], int32_t q_ho[HDSIZE+1][OPSIZE+1],
+                        int32_t in[INSIZE+1], int32_t out[OPSIZE+1]);
+int32_t fixed_round(int64_t x);
+void  report_fixed(struct network *net, struct pattern_set *set);
+void  export_network(struct network *net, char *filename);
+int   mismatch(struct network *net, struct pattern_set *set, int p);
+int   match(struct network *net, struct pattern_set *set, int p);
+
+int   run_benchmarks(void);
+void  bench_training(int batch, int threads);
+void  bench_inference(int fixed);
+int64_t clock_ns(void);
+int   compare_times(const void *a, const void *b);
+size_t network_bytes(int batch, int threads);
+double json_number(char *line, char *key);
+int   json_same(char *a, char *b, char *key);
+double bench_spread(int64_t *runs);
+void  compare_benchmark(char *line);
 
 
 
 /* The "main" function sets up the initial weights of the network and the training patterns.  It
    also reads (from the command line) values of eta (learning rate) and alpha (momentum) appropriate 
    to this training run.  The training is all performed by "train_network".
+
+   When more than one value is given for any of the parameters, every combination of them is
+   trained instead, see "sweep".
 */
 
 int main(int argc, char *argv[])
 {
+    struct network *net;
+
     read_parameters(argc, argv);
-    load_patterns(TRAINING_PATTERNS, "lowmemorykiller.tra");
-    load_initial_weights();
+    load_patterns(&training_set, training_file);
+    if ( binary_file )  {
+        write_patterns(&training_set, binary_file);
+        printf("%d patterns of %s written to %s\n", training_set.count, training_file,
+               binary_file);
+        return 0;
+    }
+    load_patterns(&testing_set, testing_file);
+    if ( benchmark )
+        return run_benchmarks();
+    if ( validation_fraction > 0.0f )
+        split_patterns(&training_set, &validation_set, validation_fraction);
+    if ( worker_count(train_threads) < train_threads )  {
+        fprintf(stderr, "-p %d: an epoch of %d patterns keeps only %d threads busy, using %d\n",
+                train_threads, training_set.count / 4, worker_count(train_threads),
+                worker_count(train_threads));
+        train_threads = worker_count(train_threads);
+        if ( train_threads == 1 )
+            hogwild = 0;
+    }
+    if ( train_threads > 1 && batch_size == 0 )
+        batch_size = 1;
     printf("Network parameters:  Input layer size  = %3d\n", INSIZE);
     printf("                     Hidden layer size = %3d\n", HDSIZE);
     printf("                     Output layer size = %3d\n", OPSIZE);
-    printf("Training network\n\n");
-    train_network();
-    printf("Training done\nTesting network\n\n");
-    load_patterns(TESTING_PATTERNS, "lowmemorykiller.tes");
-    report_operation();
-    dump_weights();
+    if ( batch_size > 0 )
+        printf("                     Batch size        = %3d\n", batch_size);
+    if ( train_threads > 1 )
+        printf("                     Threads           = %3d (%s)\n", train_threads,
+               hogwild ? "hogwild" : "all-reduce");
+    printf("                     Optimizer         = %s\n", optimizer_names[optimizer]);
+    if ( schedule == STEP )
+        printf("                     Learning rate     = x%g every %d epochs\n",
+               schedule_factor, schedule_epochs);
+    else if ( schedule == COSINE )
+        printf("                     Learning rate     = cosine over %d epochs\n",
+               schedule_epochs);
+    if ( validation_set.count > 0 )
+        printf("                     Validation set    = %d of %d patterns, patience %d\n",
+               validation_set.count, validation_set.count + training_set.count, patience);
+    if ( eta_count * alpha_count * c_count > 1 )  {
+        sweep();
+        return 0;
+    }
+    net = new_network(eta_count ? eta_values[0] : 0.0f, alpha_count ? alpha_values[0] : 0.0f,
+                      c_count ? c_values[0] : 0.0f);
+    if ( load_file )  {
+        load_checkpoint(net, load_file);
+        printf("Network of %s, trained for %d epochs\n\n", load_file, net->epochs);
+    }
+    else  {
+        if ( resume_file )  {
+            load_checkpoint(net, resume_file);
+            if ( eta_count )  {
+                net->eta = eta_values[0];
+                net->alpha = alpha_values[0];
+                net->c = c_values[0];
+            }
+            printf("Resuming the training of %s after epoch %d\n", resume_file, net->epochs);
+        }
+        net->verbose = 1;
+        printf("Training network\n\n");
+        train_network(net);
+        printf("Training done\n");
+        if ( checkpoint_file )
+            save_checkpoint(net, checkpoint_file);
+    }
+    printf("Testing network\n\n");
+    report_operation(net, &testing_set);
+    dump_weights(net);
+    if ( export_file )  {
+        report_fixed(net, &testing_set);
+        export_network(net, export_file);
+    }
     return 0;
 }
 
 
 
-/* Routines to read the network parameters, eta, alpha and c, from the command line */
+/* Routines to read the network parameters, eta, alpha and c, from the command line.
+   Each of them is either a single value, a list of values "v1,v2,..." or a range
+   "from:to:n" of n evenly spaced values.  They can be preceded by options:
+
+   -b <size>   train in mini-batches of <size> patterns (see train_epoch_batch)
+   -j <jobs>   networks trained at once by a sweep (default, one per processor)
+   -t <file>   training patterns (default, lowmemorykiller.tra)
+   -T <file>   test patterns (default, lowmemorykiller.tes)
+   -w <file>   write the training patterns to <file> as a binary pattern file and
+               exit, without training; eta, alpha and c are then not needed
+   -e <file>   export the trained network, or the best one of a sweep, to <file> as
+               a C header for the kernel (see export_network)
+   -p <threads> train each network with up to <threads> threads (see worker_count)
+   -H          with -p, apply the changes of every thread without locks (hogwild)
+   -V <part>   hold out this fraction of the training patterns as a validation set,
+               stop after -P epochs without a better error on it and keep the best
+               weights (see validate)
+   -P <epochs> patience of -V (default, PATIENCE)
+   -c <file>   save a checkpoint of the network to <file> every CHECKPOINT_EPOCHS
+               epochs and after training, or of the best network of a sweep
+   -r <file>   resume training from the checkpoint <file>; eta, alpha and c are
+               those of the checkpoint unless they are given
+   -l <file>   load the network of the checkpoint <file> and only test it, without
+               training; eta, alpha and c are then not needed
+   -B          run the benchmarks (see run_benchmarks) instead of training, with
+               up to -j threads
+   -C <file>   with -B, compare with the benchmarks of a previous run saved in <file>
+   -o <rule>   optimizer, momentum (default), rmsprop or adam (see update_weights)
+   -s <sched>  learning rate schedule, step:<epochs>:<factor> or cosine[:<epochs>]
+               (default, eta all along; see learning_rate)
+*/
 
 void read_parameters(int argc, char *argv[]) 
 {
-    if ( argc != 4 )  {
+    int opt;
+
+    jobs = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    while ( (opt = getopt(argc, argv, "b:j:p:Ht:T:V:P:w:e:c:r:l:BC:o:s:")) != -1 )  {
+        switch ( opt )  {
+        case 'b':
+            batch_size = (int) read_argument("-b, (batch size)", optarg);
+            if ( batch_size < 1 )  {
+                fprintf(stderr, "Batch size must be at least 1\n");
+                exit(1);
+            }
+            break;
+        case 'j':
+            jobs = (int) read_argument("-j, (jobs)", optarg);
+            break;
+        case 'p':
+            train_threads = (int) read_argument("-p, (threads)", optarg);
+            if ( train_threads < 1 )  {
+                fprintf(stderr, "Threads must be at least 1\n");
+                exit(1);
+            }
+            break;
+        case 'H':
+            hogwild = 1;
+            break;
+        case 't':
+            training_file = optarg;
+            break;
+        case 'T':
+            testing_file = optarg;
+            break;
+        case 'V':
+            validation_fraction = read_argument("-V, (validation part)", optarg);
+            if ( validation_fraction <= 0.0f || validation_fraction >= 1.0f )  {
+                fprintf(stderr, "Validation part must be between 0 and 1\n");
+                exit(1);
+            }
+            break;
+        case 'P':
+            patience = (int) read_argument("-P, (patience)", optarg);
+            if ( patience < 1 )  {
+                fprintf(stderr, "Patience must be at least 1 epoch\n");
+                exit(1);
+            }
+            break;
+        case 'w':
+            binary_file = optarg;
+            break;
+        case 'e':
+            export_file = optarg;
+            break;
+        case 'c':
+            checkpoint_file = optarg;
+            break;
+        case 'r':
+            resume_file = optarg;
+            break;
+        case 'l':
+            load_file = optarg;
+            break;
+        case 'B':
+            benchmark = 1;
+            break;
+        case 'C':
+            baseline_file = optarg;
+            break;
+        case 'o':
+            for ( optimizer = ADAM; optimizer >= MOMENTUM; optimizer-- )
+                if ( !strcmp(optarg, optimizer_names[optimizer]) )
+                    break;
+            if ( optimizer < MOMENTUM )  {
+                fprintf(stderr, "Unknown optimizer \"%s\"\n", optarg);
+                exit(1);
+            }
+            break;
+        case 's':
+            read_schedule(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if ( jobs < 1 )
+        jobs = 1;
+    if ( binary_file || (load_file && argc == optind) || (resume_file && argc == optind) )
+        return;
+    if ( argc - optind != 3 || load_file )  {
         fprintf(stderr, "%s, three command line arguments expected.\n", argv[0]);
-        fprintf(stderr, "    <eta> <alpha> <c>\n");
-	exit(1);
+        usage(argv[0]);
+    }
+    eta_count   = read_range("1, (eta)",   argv[optind],     &eta_values);
+    alpha_count = read_range("2, (alpha)", argv[optind + 1], &alpha_values);
+    c_count     = read_range("3, (c)",     argv[optind + 2], &c_values);
+    if ( (resume_file || benchmark) && eta_count * alpha_count * c_count > 1 )  {
+        fprintf(stderr, "%s, a sweep can't resume a checkpoint or be benchmarked.\n", argv[0]);
+        exit(1);
     }
-    eta   = read_argument("1, (eta)",   argv[1]);
-    alpha = read_argument("2, (alpha)", argv[2]);
-    c     = read_argument("3, (c)",     argv[3]);
+}
+
+void usage(char *name)
+{
+    fprintf(stderr, "usage: %s [-b <batch size>] [-j <jobs>] [-p <threads> [-H]] [-t <training file>] "
+                    "[-T <test file>] [-e <header>]\n"
+                    "       [-V <validation part> [-P <patience>]] [-c <checkpoint>] [-r <checkpoint>]\n"
+                    "       [-o momentum|rmsprop|adam] [-s step:<epochs>:<factor>|cosine[:<epochs>]]\n"
+                    "       <eta> <alpha> <c>\n"
+                    "       each parameter is a value, a list v1,v2,... or a range from:to:n\n"
+                    "       %s [-t <training file>] -w <binary pattern file>\n"
+                    "       %s [-T <test file>] [-e <header>] -l <checkpoint>\n"
+                    "       %s [-j <threads>] [-H] [-o <rule>] -B [-C <baseline>] <eta> <alpha> <c>\n",
+                    name, name, name, name);
+    exit(1);
 }
 
 float read_argument(char *error_message, char *argument_string)
@@ -142,24 +617,194 @@ float read_argument(char *error_message, char *argument_string)
     return parameter;
 }
 
+void read_schedule(char *argument_string)
+{
+    char end;
+
+    schedule_epochs = MAX_EPOCHS;
+    if ( 2 == sscanf(argument_string, "step:%d:%f%c", &schedule_epochs, &schedule_factor, &end) )
+        schedule = STEP;
+    else if ( !strcmp(argument_string, "cosine") ||
+              1 == sscanf(argument_string, "cosine:%d%c", &schedule_epochs, &end) )
+        schedule = COSINE;
+    else  {
+        fprintf(stderr, "Argument -s, (schedule) is not step:<epochs>:<factor> or "
+                        "cosine[:<epochs>] \"%s\"\n", argument_string);
+        exit(1);
+    }
+    if ( schedule_epochs < 1 )  {
+        fprintf(stderr, "Argument -s, (schedule) needs at least 1 epoch \"%s\"\n",
+                argument_string);
+        exit(1);
+    }
+}
+
+/* Reads the values of one parameter into a new array and returns how many there are. */
+
+int read_range(char *error_message, char *argument_string, float **values)
+{
+    float from, to;
+    int i, n, count;
+    char *p, end;
+
+    if ( 3 == sscanf(argument_string, "%f:%f:%d%c", &from, &to, &n, &end) )  {
+        if ( n < 1 )  {
+            fprintf(stderr, "Argument %s, range \"%s\" has no values\n",
+                    error_message, argument_string);
+            exit(1);
+        }
+        *values = malloc(n * sizeof(**values));
+        if ( !*values )  {
+            fprintf(stderr, "Fatal Error: in read_range, out of memory, halting\n");
+            exit(1);
+        }
+        for ( i = 0; i < n; i++ )
+            (*values)[i] = n == 1 ? from : from + (to - from) * i / (n - 1);
+        return n;
+    }
+
+    for ( count = 1, p = argument_string; *p; p++ )
+        if ( *p == ',' )
+            count++;
+    *values = malloc(count * sizeof(**values));
+    if ( !*values )  {
+        fprintf(stderr, "Fatal Error: in read_range, out of memory, halting\n");
+        exit(1);
+    }
+    for ( i = 0, p = strtok(argument_string, ","); i < count; i++, p = strtok(NULL, ",") )
+        (*values)[i] = read_argument(error_message, p ? p : "");
+    return count;
+}
+
+
+/* A sweep trains one network for every combination of the values of eta, alpha and c, with
+   "jobs" threads taking the next untrained network until there are none left.  All the
+   networks start from the same random weights, so they differ only in their parameters.
+   They are then tested on the test set and listed from the best classification rate to the
+   worst, and by their final epoch error when the rates are equal.
+*/
+
+void sweep(void)
+{
+    pthread_t *threads;
+    int i, a, e, k, threads_count;
+    struct network *net;
+
+    sweep_total = eta_count * alpha_count * c_count;
+    sweep_nets = malloc(sweep_total * sizeof(*sweep_nets));
+    threads_count = jobs < sweep_total ? jobs : sweep_total;
+    threads = malloc(threads_count * sizeof(*threads));
+    if ( !sweep_nets || !threads )  {
+        fprintf(stderr, "Fatal Error: in sweep, out of memory, halting\n");
+        exit(1);
+    }
+    i = 0;
+    for ( e = 0; e < eta_count; e++ )
+        for ( a = 0; a < alpha_count; a++ )
+            for ( k = 0; k < c_count; k++ )
+                sweep_nets[i++] = new_network(eta_values[e], alpha_values[a], c_values[k]);
+
+    printf("Training %d networks, %d at once\n\n", sweep_total, threads_count);
+    for ( i = 0; i < threads_count; i++ )
+        if ( pthread_create(&threads[i], NULL, sweep_worker, NULL) )  {
+            fprintf(stderr, "Fatal Error: in sweep, can't create thread, halting\n");
+            exit(1);
+        }
+    for ( i = 0; i < threads_count; i++ )
+        pthread_join(threads[i], NULL);
+    free(threads);
+
+    printf("Training done\nTesting networks\n\n");
+    for ( i = 0; i < sweep_total; i++ )
+        sweep_nets[i]->correct = test_network(sweep_nets[i], &testing_set, &k, 0);
+    qsort(sweep_nets, sweep_total, sizeof(*sweep_nets), compare_results);
+
+    printf("rank       eta     alpha         c  epochs  epoch_error  correct\n");
+    for ( i = 0; i < sweep_total; i++ )  {
+        net = sweep_nets[i];
+        printf("%4d  %8.5f  %8.5f  %8.5f  %6d  %11.6f  %6.2f%%\n", i + 1,
+               net->eta, net->alpha, net->c, net->epochs, net->epoch_error,
+               100.0 * ((double)(net->correct)) / ((double) testing_set.count));
+    }
+    if ( export_file )  {
+        printf("\nBest network:\n");
+        report_fixed(sweep_nets[0], &testing_set);
+        export_network(sweep_nets[0], export_file);
+    }
+    if ( checkpoint_file )
+        save_checkpoint(sweep_nets[0], checkpoint_file);
+}
+
+void *sweep_worker(void *arg)
+{
+    int i;
+
+    (void) arg;
+    for ( ;; )  {
+        pthread_mutex_lock(&sweep_lock);
+        i = sweep_next++;
+        pthread_mutex_unlock(&sweep_lock);
+        if ( i >= sweep_total )
+            return NULL;
+        train_network(sweep_nets[i]);
+    }
+}
+
+/* A diverged network has a NaN error, and is ranked after all the others. */
+
+int compare_results(const void *a, const void *b)
+{
+    const struct network *x = *(struct network * const *) a;
+    const struct network *y = *(struct network * const *) b;
+
+    if ( x->correct != y->correct )
+        return y->correct - x->correct;
+    if ( isnan(x->epoch_error) || isnan(y->epoch_error) )
+        return isnan(x->epoch_error) - isnan(y->epoch_error);
+    return (x->epoch_error > y->epoch_error) - (x->epoch_error < y->epoch_error);
+}
+
 
 /* This routine trains the network by performing multiple backpropagation passes until the error
    is within the desired limits or the network training has gone on too long without any progress
    being made (MAX_EPOCHS limit exceeded).  Note that the network starts with a hugh initial
    value of "epoch_error" to force at least one backpropagation training cycle to occur.
 
-   Note that training aborts if the epoch error starts to rise.
+   With a validation set, training also stops once "validate" has seen "patience"
+   epochs go by without a better validation error, and the network is left with
+   the weights of its best epoch.  A network loaded from a checkpoint goes on from
+   the epoch it was saved at.
 */
 
-void train_network(void)
+void train_network(struct network *net)
 {
-	int epoch = 0;
+	int epoch = net->epochs, stopped = 0;
 	float epoch_error = 1e12f, old_epoch_error = 1e13f;
 
+	/* A network from a checkpoint keeps its error if it has no epochs left */
+	if ( net->epochs > 0 )
+		epoch_error = net->epoch_error;
+	if ( train_threads > 1 )
+		start_workers(net);
 	while ( epoch_error > TARGET_ERROR && epoch < MAX_EPOCHS )  {
 		epoch++;
-		epoch_error = train_epoch();
-		if ( epoch % 100 == 0 ) {
+		net->rate = learning_rate(net, epoch);
+		if ( net->workers )
+			epoch_error = train_epoch_parallel(net);
+		else
+			epoch_error = batch_size > 0 ? train_epoch_batch(net) : train_epoch(net);
+		net->epochs = epoch;
+		net->epoch_error = epoch_error;
+		if ( validation_set.count > 0 && validate(net, epoch) )  {
+			stopped = epoch_error > TARGET_ERROR;
+			break;
+		}
+		if ( checkpoint_file && sweep_total == 0 && epoch % CHECKPOINT_EPOCHS == 0 )
+			save_checkpoint(net, checkpoint_file);
+		if ( epoch % 100 == 0 && net->verbose && validation_set.count > 0 )
+			printf("epoch %6d, epoch_error %f, validation_error %f\n", epoch, epoch_error,
+			       net->validation_error);
+		else if ( epoch % 100 == 0 && net->verbose ) {
 			printf("epoch %6d, epoch_error %f\n", epoch, epoch_error);
 			/*if ( epoch_error - old_epoch_error > 0.0f ) {
 				printf("Epoch error is INCREASING, aborting training\n");
@@ -169,20 +814,60 @@ void train_network(void)
       */
 		}
 	}
-	if ( epoch >= MAX_EPOCHS && epoch_error > TARGET_ERROR )
+	if ( net->workers )
+		stop_workers(net);
+	if ( validation_set.count > 0 && net->best_epoch > 0 )  {
+		memcpy(net->w_ih, net->best_w_ih, sizeof(net->w_ih));
+		memcpy(net->w_ho, net->best_w_ho, sizeof(net->w_ho));
+	}
+	net->epochs = epoch;
+	net->epoch_error = epoch_error;
+	if ( !net->verbose )
+		return;
+	if ( validation_set.count > 0 )
+		printf("Lowest validation error %f in epoch %d of %d, weights of that epoch kept\n",
+		       net->best_error, net->best_epoch, epoch);
+	if ( stopped )
+		printf("Training stopped early at epoch %d (best validation error %f at epoch %d), "
+		       "error remains at %f\n\n", epoch, net->best_error, net->best_epoch, epoch_error);
+	else if ( epoch >= MAX_EPOCHS && epoch_error > TARGET_ERROR )
 		printf("%d training epochs failed to train network, error remains at %f\n\n",
 			epoch, epoch_error);
 	else {
 		printf("Network trained in %d epochs\n", epoch);
 		printf("Mean squared error on training data = %f (target %f)\n", 
 		       epoch_error, TARGET_ERROR);
-		printf("Learning rate parameter (eta)       = %f\n", eta);
-		printf("Momentum parameter (alpha)          = %f\n", alpha);
-		printf("Flatspot elimination parameter (c)  = %f\n\n", c);
+		printf("Learning rate parameter (eta)       = %f\n", net->eta);
+		printf("Momentum parameter (alpha)          = %f\n", net->alpha);
+		printf("Flatspot elimination parameter (c)  = %f\n\n", net->c);
 	}
 }
 
 
+/* Measures the mean error of the network on the validation set after an epoch, and keeps
+   a copy of its weights whenever the error is the lowest so far.  Returns 1 when
+   "patience" epochs have gone by since then, so the training should stop.  A diverged
+   network, with a NaN error, never improves, and stops as well.
+*/
+
+int validate(struct network *net, int epoch)
+{
+	int p;
+	float error = 0.0f;
+
+	for ( p = 0; p < validation_set.count; p++ )
+		error += forwardprop(net, &validation_set, p);
+	net->validation_error = error / (float) validation_set.count;
+	if ( net->validation_error < net->best_error )  {
+		net->best_error = net->validation_error;
+		net->best_epoch = epoch;
+		memcpy(net->best_w_ih, net->w_ih, sizeof(net->w_ih));
+		memcpy(net->best_w_ho, net->w_ho, sizeof(net->w_ho));
+	}
+	return epoch - net->best_epoch >= patience;
+}
+
+
 /* This routine performs one "epoch's" worth of training by performing backpropagation 
    passes over the network for various training patterns.  
 
@@ -199,15 +884,15 @@ void train_network(void)
 
 */
 
-float train_epoch(void)
+float train_epoch(struct network *net)
 {
-    int p, n = TRAINING_PATTERNS / 4;
+    int p, n = training_set.count / 4;
     float error = 0.0f;
 
     for ( p = 0; p < n; p++ )
-    	backprop( rand() % TRAINING_PATTERNS );
+    	backprop( net, &training_set, rand_r(&net->seed) % training_set.count );
     for ( p = 0; p < n; p++ )  
-        error += forwardprop( rand() % TRAINING_PATTERNS );
+        error += forwardprop( net, &training_set, rand_r(&net->seed) % training_set.count );
     return error / (float) n;
 }
 
@@ -218,28 +903,28 @@ float train_epoch(void)
    (0.5 * sigma(t(p,k) - o(p,k))**2)).  This error value is returned to the caller.
 */
 
-float forwardprop(int p)
+float forwardprop(struct network *net, struct pattern_set *set, int p)
 {
     int i, j, k;
     float temp, error;
 
     /* This is the input to hidden layer forward propagation.  Note how the current
-       input layer is picked up from the 2-d array of training patterns. */
+       input layer is picked up from the columns of the pattern set. */
     for ( j = 1; j <= HDSIZE; j++ )
-    	hidden[j] = 0.0f;
+    	net->hidden[j] = 0.0f;
     for ( i = 0; i <= INSIZE; i++ )  {
-      temp = pattern[p][i];
+      temp = set->input[i][p];
 			for ( j = 1; j <= HDSIZE; j++ )
-				hidden[j] += w_ih[i][j] * temp;
+				net->hidden[j] += net->w_ih[i][j] * temp;
     }
     
     /* This is the hidden to output layer forward propagation. */
     for ( k = 1; k <= OPSIZE; k++ )
-    	output[k] = 0.0f;
+    	net->output[k] = 0.0f;
     for ( j = 0; j <= HDSIZE; j++ )  {
-      temp = hidden[j];
+      temp = net->hidden[j];
 			for ( k = 1; k <= OPSIZE; k++ )
-				output[k] += w_ho[j][k] * temp;
+				net->output[k] += net->w_ho[j][k] * temp;
     }
 
 
@@ -247,7 +932,7 @@ float forwardprop(int p)
     and report this back to the caller. */
     error = 0.0f;
     for ( k = 1; k <= OPSIZE; k++ )  {
-      temp = (desired[p][k] - output[k]) / desired[p][k];
+      temp = (set->target[k][p] - net->output[k]) / set->target[k][p];
 			error += temp * temp;
     }
     error *= 0.5f;
@@ -257,8 +942,7 @@ float forwardprop(int p)
 /* This is the function which actually performs the backpropagation training passes.
    For a given pattern vector, indexed by "p", it will calculate the changes to the
    weights of the hidden and output layers for each weight in the network.  The weight
-   changes are held in the arrays "dw_ih" and "dw_ho", thus the weight change in the
-   previous training cycle is always available to act as a momentum term.
+   gradients are held in the arrays "g_ih" and "g_ho" and applied by "update_weights".
 
    Note the operation of the flatspot elimination parameter "c".  This is added to
    the derivatives of the activation function and has the effect of tending to move the
@@ -278,19 +962,19 @@ float forwardprop(int p)
    
 */
 
-void backprop(int p)
+void backprop(struct network *net, struct pattern_set *set, int p)
 {
     int i, j, k;
     float temp;
 
-    forwardprop(p);  /* Needed to set the output values on the hidden and output layer
-                        neurons for the training input indexed by "p". */
+    forwardprop(net, set, p);  /* Needed to set the output values on the hidden and output layer
+                                  neurons for the training input indexed by "p". */
 
     /* Calcualte the Delta(p,k) values (deltas for output layer neurons) for this
        presentation, "p". */
     for ( k = 1; k <= OPSIZE; k++ )  {
-      temp = output[k];
-			delta_p_output[k] = (desired[p][k] - temp) * (1.0f + c);
+      temp = net->output[k];
+			net->delta_p_output[k] = (set->target[k][p] - temp) * (1.0f + net->c);
     }
 
     /* Now use these Delta(p,k) values to calculate the Delta(p,j) values.  Note that
@@ -298,74 +982,603 @@ void backprop(int p)
        hidden to output layer weights. */
     for ( j = 1; j <= HDSIZE; j++ )  {
         for ( temp = 0.0f, k = 1; k <= OPSIZE; k++ )  
-        	temp += w_ho[j][k] * delta_p_output[k];
-			delta_p_hidden[j] = temp * (1.0f + c);
+        	temp += net->w_ho[j][k] * net->delta_p_output[k];
+			net->delta_p_hidden[j] = temp * (1.0f + net->c);
     }
 
-    /* Only now may we perform weight updates on the hidden to output layer weights. */
+    /* The gradients on the hidden to output layer weights. */
     for ( j = 0; j <= HDSIZE; j++ )
-  		for ( k = 1; k <= OPSIZE; k++ )  {
-  		    dw_ho[j][k] = eta * hidden[j] * delta_p_output[k] + alpha * dw_ho[j][k - 1];
-  		    w_ho[j][k] += dw_ho[j][k];
-  	}
+  		for ( k = 1; k <= OPSIZE; k++ )
+  		    net->g_ho[j][k] = net->hidden[j] * net->delta_p_output[k];
 
     /* And on the input to hidden layer weights. */
     for ( i = 0; i <= INSIZE; i++ )
-  		for ( j = 1; j <= HDSIZE; j++ )  {
-  		    dw_ih[i][j] = eta * pattern[p][i] * delta_p_hidden[j] + alpha * dw_ih[i][j - 1];
-  		    w_ih[i][j] += dw_ih[i][j];
+  		for ( j = 1; j <= HDSIZE; j++ )
+  		    net->g_ih[i][j] = set->input[i][p] * net->delta_p_hidden[j];
+
+    /* Only now may we perform the weight updates. */
+    update_weights(net);
+}
+
+
+/* This routine changes every weight w along its gradient g, held in "g_ih" and
+   "g_ho", with the learning rate "rate" of the epoch:
+
+   momentum:  dw = rate g + alpha dw                      (the rule of the logs in
+                                                           "Resultados AAD")
+   rmsprop:   v = rho v + (1 - rho) g^2,                  dw = rate g / (sqrt(v) + e)
+   adam:      m = b1 m + (1 - b1) g,  v = b2 v + (1 - b2) g^2,
+              dw = rate (m / (1 - b1^t)) / (sqrt(v / (1 - b2^t)) + e)
+
+   where t is the number of updates so far.  The momentum term of each weight is its
+   own last change; the version of the logs took that of its neighbour, dw(j,k-1),
+   instead.  rmsprop and adam scale the step of each weight by the size of its recent
+   gradients, so the weights of the large inputs (in hundreds of MB) and of the small
+   ones move at comparable speeds.  alpha is only used by momentum.
+
+   Each layer is updated as one flat array, element 0 of the units included: its
+   gradient is always zero, and so is its change.
+*/
+
+void update_weights(struct network *net)
+{
+    double correction1 = 1.0, correction2 = 1.0;
+
+    net->steps++;
+    if ( optimizer == ADAM )  {
+        correction1 = 1.0 - pow(ADAM_BETA1, (double) net->steps);
+        correction2 = 1.0 - pow(ADAM_BETA2, (double) net->steps);
+    }
+    update_layer(net, &net->w_ho[0][0], &net->g_ho[0][0], &net->dw_ho[0][0], &net->m_ho[0][0],
+                 &net->v_ho[0][0], (HDSIZE+1) * (OPSIZE+1), correction1, correction2);
+    update_layer(net, &net->w_ih[0][0], &net->g_ih[0][0], &net->dw_ih[0][0], &net->m_ih[0][0],
+                 &net->v_ih[0][0], (INSIZE+1) * (HDSIZE+1), correction1, correction2);
+}
+
+void update_layer(struct network *net, double *restrict w, const double *restrict g,
+                  double *restrict dw, double *restrict m, double *restrict v, int n,
+                  double correction1, double correction2)
+{
+    int i;
+    double rate = net->rate, alpha = net->alpha;
+
+    switch ( optimizer )  {
+    case RMSPROP:
+        for ( i = 0; i < n; i++ )  {
+            v[i] = RMSPROP_RHO * v[i] + (1.0 - RMSPROP_RHO) * g[i] * g[i];
+            dw[i] = rate * g[i] / (sqrt(v[i]) + OPT_EPSILON);
+            w[i] += dw[i];
+        }
+        break;
+    case ADAM:
+        for ( i = 0; i < n; i++ )  {
+            m[i] = ADAM_BETA1 * m[i] + (1.0 - ADAM_BETA1) * g[i];
+            v[i] = ADAM_BETA2 * v[i] + (1.0 - ADAM_BETA2) * g[i] * g[i];
+            dw[i] = rate * (m[i] / correction1) / (sqrt(v[i] / correction2) + OPT_EPSILON);
+            w[i] += dw[i];
+        }
+        break;
+    default:
+        for ( i = 0; i < n; i++ )  {
+            dw[i] = rate * g[i] + alpha * dw[i];
+            w[i] += dw[i];
+        }
+    }
+}
+
+/* The learning rate of an epoch, counted from 1.  It is eta unless a schedule was given:
+   "step" multiplies it by "schedule_factor" every "schedule_epochs" epochs, and
+   "cosine" takes it from eta down to zero along half a cosine wave over
+   "schedule_epochs" epochs, and keeps it at zero after them.
+*/
+
+float learning_rate(struct network *net, int epoch)
+{
+    int e = epoch - 1;
+
+    switch ( schedule )  {
+    case STEP:
+        return net->eta * powf(schedule_factor, (float) (e / schedule_epochs));
+    case COSINE:
+        if ( e >= schedule_epochs )
+            return 0.0f;
+        return net->eta * 0.5f * (1.0f + cosf((float) M_PI * e / schedule_epochs));
+    default:
+        return net->eta;
+    }
+}
+
+
+/* Mini-batch training.  An epoch presents the same number of patterns as
+   "train_epoch", but they are taken without replacement from a shuffled order of
+   the training set, which is shuffled again each time it is used up, and they are
+   presented "batch_size" at a time.  The forward and backward passes of a batch
+   are small dense matrix products over the row-major batch buffers, and the
+   weights are updated once per batch with the mean gradient of its patterns.
+
+   The epoch error is the error of the forward passes of the batches, before each
+   update, so no separate "testing" pass is needed.
+*/
+
+void init_batches(struct network *net)
+{
+	int p;
+
+	net->order = malloc(net->shard_size * sizeof(*net->order));
+	net->batch_in = malloc(batch_size * (INSIZE+1) * sizeof(double));
+	net->batch_target = malloc(batch_size * (OPSIZE+1) * sizeof(double));
+	net->batch_hidden = malloc(batch_size * (HDSIZE+1) * sizeof(double));
+	net->batch_output = malloc(batch_size * (OPSIZE+1) * sizeof(double));
+	net->batch_delta_o = malloc(batch_size * (OPSIZE+1) * sizeof(double));
+	net->batch_delta_h = malloc(batch_size * (HDSIZE+1) * sizeof(double));
+	if ( !net->order || !net->batch_in || !net->batch_target || !net->batch_hidden ||
+	     !net->batch_output || !net->batch_delta_o || !net->batch_delta_h )  {
+		fprintf(stderr, "Fatal Error: in init_batches, out of memory, halting\n");
+		exit(1);
+	}
+	for ( p = 0; p < net->shard_size; p++ )
+		net->order[p] = net->shard_start + p * net->shard_stride;
+	shuffle_order(net);
+}
+
+void shuffle_order(struct network *net)
+{
+	int p, q, temp;
+
+	for ( p = net->shard_size - 1; p > 0; p-- )  {
+		q = rand_r(&net->seed) % (p + 1);
+		temp = net->order[p];
+		net->order[p] = net->order[q];
+		net->order[q] = temp;
+	}
+	net->order_pos = 0;
+}
+
+float train_epoch_batch(struct network *net)
+{
+    int p, size, total = net->shard_size, n = training_set.count / 4;
+    float error = 0.0f;
+
+    for ( p = 0; p < n; p += size )  {
+        if ( net->order_pos == total )
+            shuffle_order(net);
+        size = batch_size;
+        if ( size > n - p )
+            size = n - p;
+        if ( size > total - net->order_pos )
+            size = total - net->order_pos;
+        error += train_batch(net, net->order + net->order_pos, size);
+        net->order_pos += size;
+    }
+    return error / (float) n;
+}
+
+/* One forward and backward pass over the "n" patterns listed in "rows", followed by
+   the weight update.  In matrix form, with X the inputs and T the desired outputs of
+   the batch, one column per pattern, and the bias rows kept at one:
+
+   H = W_ih^T X,  O = W_ho^T H,  D_o = (T - O)(1 + c),  D_h = (1 + c) W_ho D_o
+
+   G_ho = H D_o^T / n,  G_ih = X D_h^T / n
+
+   and the mean gradients G_ho and G_ih are applied by "update_weights".
+
+   Row 0 of the deltas is kept at zero, so the bias "units" and the unused element 0
+   of the output layer are never changed.  Returns the summed error of the batch.
+*/
+
+float train_batch(struct network *net, int *rows, int n)
+{
+    float error;
+
+    error = batch_gradient(net, rows, n);
+    update_weights(net);
+    return error;
+}
+
+/* The forward and backward passes of "train_batch", leaving the mean gradients of the
+   batch in "g_ih" and "g_ho". */
+
+float batch_gradient(struct network *net, int *rows, int n)
+{
+    int b, i, j, k, s = batch_size;
+    double *target, *out, *delta, *column, temp, scale, error = 0.0;
+
+    /* Gather the batch column by column */
+    for ( i = 0; i <= INSIZE; i++ )
+        for ( b = 0, column = training_set.input[i]; b < n; b++ )
+            net->batch_in[i * s + b] = column[rows[b]];
+    for ( k = 1; k <= OPSIZE; k++ )
+        for ( b = 0, column = training_set.target[k]; b < n; b++ )
+            net->batch_target[k * s + b] = column[rows[b]];
+
+    /* Forward pass */
+    mat_mul_tn(&net->w_ih[0][0], net->batch_in, net->batch_hidden, INSIZE+1, HDSIZE+1, n, s);
+    for ( b = 0; b < n; b++ )
+        net->batch_hidden[b] = 1.0;
+    mat_mul_tn(&net->w_ho[0][0], net->batch_hidden, net->batch_output, HDSIZE+1, OPSIZE+1, n, s);
+
+    /* Error and Delta(p,k) values of every pattern */
+    for ( b = 0; b < n; b++ )
+        net->batch_delta_o[b] = 0.0;
+    for ( k = 1; k <= OPSIZE; k++ )  {
+        target = net->batch_target + k * s;
+        out = net->batch_output + k * s;
+        delta = net->batch_delta_o + k * s;
+        for ( b = 0; b < n; b++ )  {
+            temp = (target[b] - out[b]) / target[b];
+            error += temp * temp;
+            delta[b] = (target[b] - out[b]) * (1.0 + net->c);
+        }
+    }
+
+    /* Delta(p,j) values, with the hidden to output weights not yet changed */
+    mat_mul(&net->w_ho[0][0], net->batch_delta_o, net->batch_delta_h, HDSIZE+1, OPSIZE+1, n, s);
+    for ( b = 0; b < n; b++ )
+        net->batch_delta_h[b] = 0.0;
+    for ( j = 1; j <= HDSIZE; j++ )
+        for ( b = 0; b < n; b++ )
+            net->batch_delta_h[j * s + b] *= 1.0 + net->c;
+
+    /* Gradients and weight updates */
+    mat_mul_nt(net->batch_hidden, net->batch_delta_o, &net->g_ho[0][0], HDSIZE+1, OPSIZE+1, n, s);
+    mat_mul_nt(net->batch_in, net->batch_delta_h, &net->g_ih[0][0], INSIZE+1, HDSIZE+1, n, s);
+
+    scale = 1.0 / n;
+    for ( j = 0; j <= HDSIZE; j++ )
+        for ( k = 1; k <= OPSIZE; k++ )
+            net->g_ho[j][k] *= scale;
+    for ( i = 0; i <= INSIZE; i++ )
+        for ( j = 1; j <= HDSIZE; j++ )
+            net->g_ih[i][j] *= scale;
+
+    return 0.5f * (float) error;
+}
+
+
+/* Data-parallel training, with "-p <threads>".  The training set is dealt out into
+   one shard per thread, every "threads"-th pattern, as the pattern files are sorted
+   by device and a contiguous block would hold only some of them.  Each thread trains a replica of the network, with
+   its own random number generator, shuffled order and batch buffers, on the patterns
+   of its shard.  An epoch still presents training_set.count / 4 patterns, shared out
+   between the threads.  The replicas take the weights of the network before each
+   batch and give back what they learn from it in one of two ways:
+
+   all-reduce  (default) the threads wait for each other after each batch, one of
+               them applies the mean gradient of all their batches to the network
+               with "update_weights", and the others wait for it.  This is mini-batch
+               training with batches "threads" times bigger, and its result does not
+               depend on the timing of the threads.
+   hogwild     (-H) each thread applies the changes of its own optimizer to the
+               weights of the network as soon as it has them, without any locks,
+               racing with the others.  The threads only wait for each other at the
+               end of the epoch.
+
+   Without -b the batches have one pattern, which suits hogwild; all-reduce wants
+   bigger batches to make up for its waits.  The order of a shard is shuffled again
+   when the next batch does not fit in what is left of it.
+*/
+
+void start_workers(struct network *net)
+{
+	struct workers *w;
+	struct network *r;
+	int t, count = worker_count(train_threads);
+
+	w = calloc(1, sizeof(*w));
+	if ( w )  {
+		w->replicas = calloc(count, sizeof(*w->replicas));
+		w->threads = calloc(count, sizeof(*w->threads));
+	}
+	if ( !w || !w->replicas || !w->threads )  {
+		fprintf(stderr, "Fatal Error: in start_workers, out of memory, halting\n");
+		exit(1);
+	}
+	w->count = count;
+	pthread_barrier_init(&w->start, NULL, count);
+	pthread_barrier_init(&w->done, NULL, count);
+	pthread_barrier_init(&w->gradients, NULL, count);
+	pthread_barrier_init(&w->weights, NULL, count);
+	net->workers = w;
+
+	for ( t = 0; t < count; t++ )  {
+		r = malloc(sizeof(*r));
+		if ( !r )  {
+			fprintf(stderr, "Fatal Error: in start_workers, out of memory, halting\n");
+			exit(1);
+		}
+		*r = *net;
+		r->workers = NULL;
+		r->parent = net;
+		r->worker = t;
+		r->seed = rand_r(&net->seed);
+		r->shard_start = t;
+		r->shard_stride = count;
+		r->shard_size = (training_set.count - t + count - 1) / count;
+		init_batches(r);
+		w->replicas[t] = r;
+	}
+	for ( t = 1; t < count; t++ )
+		if ( pthread_create(&w->threads[t], NULL, worker_main, w->replicas[t]) )  {
+			fprintf(stderr, "Fatal Error: in start_workers, can't create thread, halting\n");
+			exit(1);
 		}
 }
 
+/* The number of threads, up to "threads", that an epoch keeps busy: each of them
+   needs a whole batch of the epoch, and MIN_THREAD_WORK patterns x weights of it
+   to make up for the waits that start and end the epoch.  At least 1.
+*/
+
+int worker_count(int threads)
+{
+	int n = training_set.count / 4, batch = batch_size > 0 ? batch_size : 1;
+
+	if ( threads > n / batch )
+		threads = n / batch;
+	if ( threads > n * WEIGHTS / MIN_THREAD_WORK )
+		threads = n * WEIGHTS / MIN_THREAD_WORK;
+	return threads > 1 ? threads : 1;
+}
+
+void stop_workers(struct network *net)
+{
+	struct workers *w = net->workers;
+	struct network *r;
+	int t;
+
+	w->stop = 1;
+	pthread_barrier_wait(&w->start);
+	for ( t = 1; t < w->count; t++ )
+		pthread_join(w->threads[t], NULL);
+	for ( t = 0; t < w->count; t++ )  {
+		r = w->replicas[t];
+		free(r->order);
+		free(r->batch_in);
+		free(r->batch_target);
+		free(r->batch_hidden);
+		free(r->batch_output);
+		free(r->batch_delta_o);
+		free(r->batch_delta_h);
+		free(r);
+	}
+	pthread_barrier_destroy(&w->start);
+	pthread_barrier_destroy(&w->done);
+	pthread_barrier_destroy(&w->gradients);
+	pthread_barrier_destroy(&w->weights);
+	free(w->replicas);
+	free(w->threads);
+	free(w);
+	net->workers = NULL;
+}
+
+void *worker_main(void *arg)
+{
+	struct network *r = arg;
+	struct workers *w = r->parent->workers;
+
+	for ( ;; )  {
+		pthread_barrier_wait(&w->start);
+		if ( w->stop )
+			return NULL;
+		r->epoch_error = train_share(r);
+		pthread_barrier_wait(&w->done);
+	}
+}
+
+float train_epoch_parallel(struct network *net)
+{
+	struct workers *w = net->workers;
+	float error = 0.0f;
+	int t;
+
+	pthread_barrier_wait(&w->start);
+	w->replicas[0]->epoch_error = train_share(w->replicas[0]);
+	pthread_barrier_wait(&w->done);
+	for ( t = 0; t < w->count; t++ )
+		error += w->replicas[t]->epoch_error;
+	return error / (float) (training_set.count / 4);
+}
+
+/* The part of an epoch done by one thread, "share" patterns in batches of at most
+   "batch_size".  With all-reduce every thread goes through the same number of steps,
+   with empty batches once its share is done, so that they all meet at each wait.
+   Returns the summed error of its batches.
+*/
+
+float train_share(struct network *r)
+{
+	struct network *net = r->parent;
+	struct workers *w = net->workers;
+	int n = training_set.count / 4, count = w->count;
+	int share = n / count + (r->worker < n % count),
+	    steps = (n / count + (n % count > 0) + batch_size - 1) / batch_size;
+	int i, done, step, size;
+	double *dw, *weights;
+	float error = 0.0f;
+
+	r->rate = net->rate;
+	for ( done = 0, step = 0; hogwild ? done < share : step < steps; step++ )  {
+		size = share - done < batch_size ? share - done : batch_size;
+		if ( size > 0 )  {
+			if ( r->order_pos + size > r->shard_size )
+				shuffle_order(r);
+			memcpy(r->w_ih, net->w_ih, sizeof(r->w_ih));
+			memcpy(r->w_ho, net->w_ho, sizeof(r->w_ho));
+			error += batch_gradient(r, r->order + r->order_pos, size);
+			r->order_pos += size;
+			done += size;
+		}
+		r->batch_count = size;
+
+		if ( hogwild )  {
+			update_weights(r);
+			for ( i = 0, dw = &r->dw_ih[0][0], weights = &net->w_ih[0][0];
+			      i < (INSIZE+1) * (HDSIZE+1); i++ )
+				weights[i] += dw[i];
+			for ( i = 0, dw = &r->dw_ho[0][0], weights = &net->w_ho[0][0];
+			      i < (HDSIZE+1) * (OPSIZE+1); i++ )
+				weights[i] += dw[i];
+			continue;
+		}
+		if ( pthread_barrier_wait(&w->gradients) == PTHREAD_BARRIER_SERIAL_THREAD )
+			reduce_gradients(net);
+		pthread_barrier_wait(&w->weights);
+	}
+	return error;
+}
+
+/* Applies to the network the mean gradient of the last batches of all the replicas,
+   each weighted by its number of patterns, adding them up in the order of the
+   threads. */
+
+void reduce_gradients(struct network *net)
+{
+	struct workers *w = net->workers;
+	struct network *r;
+	int i, t, total = 0;
+	double *g, *sum;
+
+	memset(net->g_ih, 0, sizeof(net->g_ih));
+	memset(net->g_ho, 0, sizeof(net->g_ho));
+	for ( t = 0; t < w->count; t++ )  {
+		r = w->replicas[t];
+		if ( r->batch_count == 0 )
+			continue;
+		total += r->batch_count;
+		for ( i = 0, g = &r->g_ih[0][0], sum = &net->g_ih[0][0];
+		      i < (INSIZE+1) * (HDSIZE+1); i++ )
+			sum[i] += r->batch_count * g[i];
+		for ( i = 0, g = &r->g_ho[0][0], sum = &net->g_ho[0][0];
+		      i < (HDSIZE+1) * (OPSIZE+1); i++ )
+			sum[i] += r->batch_count * g[i];
+	}
+	for ( i = 0, sum = &net->g_ih[0][0]; i < (INSIZE+1) * (HDSIZE+1); i++ )
+		sum[i] /= total;
+	for ( i = 0, sum = &net->g_ho[0][0]; i < (HDSIZE+1) * (OPSIZE+1); i++ )
+		sum[i] /= total;
+	update_weights(net);
+}
+
+/* Dense products of row-major matrices.  "a" is a weight matrix, or a batch buffer
+   in mat_mul_nt, and the batch buffers have "n" columns in use out of "ld".
+
+   mat_mul:     r[m][n] = a[m][p] b[p][n]
+*/
+
+void mat_mul(const double *restrict a, const double *restrict b, double *restrict r,
+             int m, int p, int n, int ld)
+{
+    int i, j, k;
+    double temp;
+
+    for ( i = 0; i < m; i++, r += ld )  {
+        for ( k = 0; k < n; k++ )
+            r[k] = 0.0;
+        for ( j = 0; j < p; j++ )  {
+            temp = a[i * p + j];
+            for ( k = 0; k < n; k++ )
+                r[k] += temp * b[j * ld + k];
+        }
+    }
+}
+
+/* mat_mul_tn:  r[m][n] = a[p][m]^T b[p][n] */
+
+void mat_mul_tn(const double *restrict a, const double *restrict b, double *restrict r,
+                int p, int m, int n, int ld)
+{
+    int i, j, k;
+    double temp;
+
+    for ( i = 0; i < m; i++, r += ld )  {
+        for ( k = 0; k < n; k++ )
+            r[k] = 0.0;
+        for ( j = 0; j < p; j++ )  {
+            temp = a[j * m + i];
+            for ( k = 0; k < n; k++ )
+                r[k] += temp * b[j * ld + k];
+        }
+    }
+}
+
+/* mat_mul_nt:  r[m][q] = a[m][n] b[q][n]^T, accumulated one column at a time */
+
+void mat_mul_nt(const double *restrict a, const double *restrict b, double *restrict r,
+                int m, int q, int n, int ld)
+{
+    int i, j, k;
+    double temp;
+
+    memset(r, 0, m * q * sizeof(*r));
+    for ( k = 0; k < n; k++ )
+        for ( i = 0; i < m; i++ )  {
+            temp = a[i * ld + k];
+            for ( j = 0; j < q; j++ )
+                r[i * q + j] += temp * b[j * ld + k];
+        }
+}
+
 
 /* Here is where the network training/test patterns and desired responses are loaded
-   into an internal array for access.
+   into a pattern set for access.  Binary pattern files are mapped; text files are read
+   twice, once to count their patterns and size the set, and once to load them, so any
+   number of patterns may be loaded.
 */
 
-void load_patterns(int total, char *filename)
+void load_patterns(struct pattern_set *set, char *filename)
 {
 	FILE *pattern_file;
 	char linebuffer[1024];
-	int i, j;
+	int count;
 
+	if ( map_patterns(set, filename) )
+		return;
 	if ( NULL == ( pattern_file = fopen(filename, "r") ) )  {
 		fprintf(stderr, "Fatal Error: in load_patterns, can't open %s for input, halting\n", filename);
 		exit(1);
 	}
-	else {
-		for ( i = 0; i < total; i++ ) {
-			if ( NULL == fgets(linebuffer, 1024, pattern_file) )  {
-    			fprintf(stderr, "Fatal Error: in load_patterns, can't read pattern %d, expected %d, halting\n", 
-        	        i, total);
-                exit(1);
-			}
-			else load_pattern(i, linebuffer);
-		}
+	for ( count = 0; NULL != fgets(linebuffer, 1024, pattern_file); )
+		if ( linebuffer[0] != '\n' )
+			count++;
+	if ( count == 0 )  {
+		fprintf(stderr, "Fatal Error: in load_patterns, no patterns in %s, halting\n", filename);
+		exit(1);
+	}
+	alloc_patterns(set, count);
+	rewind(pattern_file);
+	for ( count = 0; count < set->count && NULL != fgets(linebuffer, 1024, pattern_file); )
+		if ( linebuffer[0] != '\n' )
+			load_pattern(set, count++, linebuffer);
+	fclose(pattern_file);
+	if ( count < set->count )  {
+		fprintf(stderr, "Fatal Error: in load_patterns, can't read pattern %d, expected %d, halting\n",
+		        count, set->count);
+		exit(1);
 	}
 }
 
-/* Load a single training/test pattern from a character buffer into pattern[index]
-   and desired[index].
+/* Load a single training/test pattern from a character buffer into pattern "index"
+   of "set".
 
-   These are loaded into indices 1..INSIZE of the pattern indexed by parameter
-   "index".
+   These are loaded into input[1..INSIZE] and target[1..OPSIZE] of the set.
 */
 
-void load_pattern(int index, char *linebuffer)
+void load_pattern(struct pattern_set *set, int index, char *linebuffer)
 {
 	int i;
 	char *p;
 
 	p = linebuffer;
 	for ( i = 1; i <= INSIZE; i++ )  {
-		pattern[index][i] = atof(p);
+		set->input[i][index] = atof(p);
 		while ( *p != ',' && *p != '\n' && *p != '\0' )
 			p++;
 		if ( *p == ',' )
 			p++;
 	}
     for ( i = 1; i <= OPSIZE; i++ )  {
-        desired[index][i] = atof(p);
+        set->target[i][index] = atof(p);
         while ( *p != ',' && *p != '\n' && *p != '\0' )
             p++;
         if ( *p == ',' )
@@ -373,41 +1586,375 @@ void load_pattern(int index, char *linebuffer)
     }
 }
 
-/* Here the initial weight vectors are established.  Note especially how the bias "units" in
-   each layer (array index 0 in the input and hidden layers) are set up with an output value
-   of 1.  Since biases and weights are being treated uniformly as weights, it is important to 
-   remember that the bias "units" need to be initialised.
+/* Allocates the columns of a set of "count" patterns, with the bias input set to 1 and
+   the padding of the columns to 0.
+*/
+
+void alloc_patterns(struct pattern_set *set, int count)
+{
+	double *columns;
+	size_t size;
+	int p;
+
+	set->count = count;
+	set->stride = (count + PATTERN_ALIGN - 1) / PATTERN_ALIGN * PATTERN_ALIGN;
+	size = (size_t) (INSIZE + 1 + OPSIZE) * set->stride * sizeof(double);
+	if ( NULL == ( columns = aligned_alloc(PATTERN_ALIGN, size) ) )  {
+		fprintf(stderr, "Fatal Error: in alloc_patterns, out of memory, halting\n");
+		exit(1);
+	}
+	memset(columns, 0, size);
+	set_columns(set, columns);
+	set->columns = columns;
+	set->map = NULL;
+	for ( p = 0; p < count; p++ )
+		set->input[0][p] = 1.0;
+}
+
+/* Moves "fraction" of the patterns of "set", picked at random, to "held_out".  A regular
+   pick, every n-th pattern, would not do: the pattern files are sorted by device and
+   then by input, and each input repeats its values with a short period.  The pick is
+   the same on every run, and both sets keep the order of the file.  The two sets get
+   new columns, and "set" may be a mapped pattern file.
+*/
+
+void split_patterns(struct pattern_set *set, struct pattern_set *held_out, float fraction)
+{
+	struct pattern_set rest;
+	struct pattern_set *to;
+	unsigned int seed = 1;
+	int count, p, i, k, held = 0, kept = 0;
+
+	count = (int) (set->count * fraction + 0.5f);
+	if ( count < 1 || count >= set->count )  {
+		fprintf(stderr, "Fatal Error: in split_patterns, can't hold out %g of %d patterns, "
+		                "halting\n", fraction, set->count);
+		exit(1);
+	}
+	alloc_patterns(held_out, count);
+	alloc_patterns(&rest, set->count - count);
+
+	/* Each pattern is held out with probability (patterns still to hold out) /
+	   (patterns still to look at), which holds out exactly "count" of them. */
+	for ( p = 0; p < set->count; p++ )  {
+		if ( rand_r(&seed) % (set->count - p) < count - held )  {
+			to = held_out;
+			i = held++;
+		}
+		else  {
+			to = &rest;
+			i = kept++;
+		}
+		for ( k = 1; k <= INSIZE; k++ )
+			to->input[k][i] = set->input[k][p];
+		for ( k = 1; k <= OPSIZE; k++ )
+			to->target[k][i] = set->target[k][p];
+	}
+	free_patterns(set);
+	*set = rest;
+}
+
+void free_patterns(struct pattern_set *set)
+{
+	if ( set->map )
+		munmap(set->map, set->map_size);
+	else
+		free(set->columns);
+	set->count = 0;
+}
+
+void set_columns(struct pattern_set *set, double *columns)
+{
+	int i, k;
+
+	for ( i = 0; i <= INSIZE; i++ )
+		set->input[i] = columns + (size_t) i * set->stride;
+	set->target[0] = NULL;
+	for ( k = 1; k <= OPSIZE; k++ )
+		set->target[k] = columns + (size_t) (INSIZE + k) * set->stride;
+}
+
+/* Maps "filename" into "set" if it is a binary pattern file, and returns 0 if it is not.
+   The columns are used in place, read-only, so loading takes no time whatever their size.
+*/
+
+int map_patterns(struct pattern_set *set, char *filename)
+{
+	struct pattern_header header;
+	struct stat st;
+	void *map;
+	int fd;
+
+	if ( (fd = open(filename, O_RDONLY)) < 0 )
+		return 0;
+	if ( read(fd, &header, sizeof(header)) != sizeof(header) ||
+	     memcmp(header.magic, PATTERN_MAGIC, sizeof(header.magic)) )  {
+		close(fd);
+		return 0;
+	}
+	if ( header.byte_order != 0x01020304 || header.insize != INSIZE ||
+	     header.opsize != OPSIZE || header.count == 0 || header.count > INT32_MAX )  {
+		fprintf(stderr, "Fatal Error: in map_patterns, %s was written for another machine "
+		        "or network, or is empty, halting\n", filename);
+		exit(1);
+	}
+	if ( fstat(fd, &st) < 0 || header.columns_offset % PATTERN_ALIGN ||
+	     header.stride < header.count || header.stride % PATTERN_ALIGN ||
+	     header.columns_offset + (INSIZE + 1 + OPSIZE) * header.stride * sizeof(double) >
+	     (uint64_t) st.st_size )  {
+		fprintf(stderr, "Fatal Error: in map_patterns, %s is truncated or corrupt, halting\n",
+		        filename);
+		exit(1);
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if ( map == MAP_FAILED )  {
+		fprintf(stderr, "Fatal Error: in map_patterns, can't map %s, halting\n", filename);
+		exit(1);
+	}
+	set->count = header.count;
+	set->stride = header.stride;
+	set_columns(set, (double *) ((char *) map + header.columns_offset));
+	set->columns = NULL;
+	set->map = map;
+	set->map_size = st.st_size;
+	return 1;
+}
+
+/* Writes "set" to "filename" as a binary pattern file, with the columns starting on a
+   PATTERN_ALIGN boundary.
+*/
+
+void write_patterns(struct pattern_set *set, char *filename)
+{
+	static const char padding[PATTERN_ALIGN];
+	struct pattern_header header;
+	FILE *pattern_file;
+	size_t pad, size;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, PATTERN_MAGIC, sizeof(header.magic));
+	header.byte_order = 0x01020304;
+	header.count = set->count;
+	header.insize = INSIZE;
+	header.opsize = OPSIZE;
+	header.stride = set->stride;
+	header.columns_offset = (sizeof(header) + PATTERN_ALIGN - 1) / PATTERN_ALIGN * PATTERN_ALIGN;
+	pad = header.columns_offset - sizeof(header);
+	size = (size_t) (INSIZE + 1 + OPSIZE) * set->stride;
+
+	if ( NULL == ( pattern_file = fopen(filename, "wb") ) )  {
+		fprintf(stderr, "Fatal Error: in write_patterns, can't open %s for output, halting\n", filename);
+		exit(1);
+	}
+	if ( fwrite(&header, sizeof(header), 1, pattern_file) != 1 ||
+	     fwrite(padding, 1, pad, pattern_file) != pad ||
+	     fwrite(set->input[0], sizeof(double), size, pattern_file) != size ||
+	     fclose(pattern_file) )  {
+		fprintf(stderr, "Fatal Error: in write_patterns, can't write %s, halting\n", filename);
+		exit(1);
+	}
+}
+
+/* A checkpoint holds all that "train_network" needs to go on from where it was saved:
+   the weights and their last changes, the state of the optimizer, of the random
+   number generator and of the validation, the epoch and, with mini-batches, the
+   shuffled order of the training patterns.  A network trained pattern by pattern or
+   with mini-batches then goes on exactly as if it had never stopped, as long as it
+   is resumed with the same options; the replicas of data-parallel training are
+   started afresh.  The checkpoint is written to "<file>.tmp" first and then renamed,
+   so a run killed while saving leaves the last one whole.
 */
 
-void load_initial_weights(void)
+int checkpoint_arrays(struct network *net, double *arrays[], size_t sizes[])
 {
-	int p, i, j, k;
+	int n = 0;
+
+	arrays[n] = &net->w_ih[0][0];       sizes[n++] = sizeof(net->w_ih);
+	arrays[n] = &net->w_ho[0][0];       sizes[n++] = sizeof(net->w_ho);
+	arrays[n] = &net->dw_ih[0][0];      sizes[n++] = sizeof(net->dw_ih);
+	arrays[n] = &net->dw_ho[0][0];      sizes[n++] = sizeof(net->dw_ho);
+	arrays[n] = &net->m_ih[0][0];       sizes[n++] = sizeof(net->m_ih);
+	arrays[n] = &net->m_ho[0][0];       sizes[n++] = sizeof(net->m_ho);
+	arrays[n] = &net->v_ih[0][0];       sizes[n++] = sizeof(net->v_ih);
+	arrays[n] = &net->v_ho[0][0];       sizes[n++] = sizeof(net->v_ho);
+	arrays[n] = &net->best_w_ih[0][0];  sizes[n++] = sizeof(net->best_w_ih);
+	arrays[n] = &net->best_w_ho[0][0];  sizes[n++] = sizeof(net->best_w_ho);
+	return n;
+}
 
-	/* Initialise bias "neurons" to output 1's, note how this has to be done for all the
-	   input patterns, as these serve in turn as the input layer. */
-	for ( p = 0; p < TRAINING_PATTERNS; p++ ) pattern[p][0] = 1.0f;
-	hidden[0] = 1.0f;
+void save_checkpoint(struct network *net, char *filename)
+{
+	struct checkpoint_header header;
+	double *arrays[16];
+	size_t sizes[16];
+	char *temporary;
+	FILE *checkpoint;
+	int i, n, failed;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+	header.byte_order = 0x01020304;
+	header.insize = INSIZE;
+	header.hdsize = HDSIZE;
+	header.opsize = OPSIZE;
+	header.optimizer = optimizer;
+	header.seed = net->seed;
+	header.epochs = net->epochs;
+	header.best_epoch = net->best_epoch;
+	header.order_size = net->order ? net->shard_size : 0;
+	header.order_pos = net->order_pos;
+	header.steps = net->steps;
+	header.eta = net->eta;
+	header.alpha = net->alpha;
+	header.c = net->c;
+	header.epoch_error = net->epoch_error;
+	header.best_error = net->best_error;
+
+	temporary = malloc(strlen(filename) + 5);
+	if ( !temporary )  {
+		fprintf(stderr, "Fatal Error: in save_checkpoint, out of memory, halting\n");
+		exit(1);
+	}
+	sprintf(temporary, "%s.tmp", filename);
+	if ( NULL == ( checkpoint = fopen(temporary, "wb") ) )  {
+		fprintf(stderr, "Fatal Error: in save_checkpoint, can't open %s for output, halting\n",
+		        temporary);
+		exit(1);
+	}
+	failed = fwrite(&header, sizeof(header), 1, checkpoint) != 1;
+	n = checkpoint_arrays(net, arrays, sizes);
+	for ( i = 0; i < n; i++ )
+		failed |= fwrite(arrays[i], sizes[i], 1, checkpoint) != 1;
+	if ( header.order_size > 0 )
+		failed |= fwrite(net->order, sizeof(*net->order), header.order_size, checkpoint) !=
+		          header.order_size;
+	failed |= fclose(checkpoint) != 0;
+	if ( failed || rename(temporary, filename) )  {
+		fprintf(stderr, "Fatal Error: in save_checkpoint, can't write %s, halting\n", filename);
+		exit(1);
+	}
+	free(temporary);
+}
+
+/* Loads a checkpoint into a network made by "new_network".  The shuffled order is only
+   taken if it is for a training set of the same size, and is shuffled afresh
+   otherwise.
+*/
+
+void load_checkpoint(struct network *net, char *filename)
+{
+	struct checkpoint_header header;
+	double *arrays[16];
+	size_t sizes[16];
+	FILE *checkpoint;
+	int i, n, failed;
+
+	if ( NULL == ( checkpoint = fopen(filename, "rb") ) )  {
+		fprintf(stderr, "Fatal Error: in load_checkpoint, can't open %s for input, halting\n",
+		        filename);
+		exit(1);
+	}
+	if ( fread(&header, sizeof(header), 1, checkpoint) != 1 ||
+	     memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) )  {
+		fprintf(stderr, "Fatal Error: in load_checkpoint, %s is not a checkpoint, halting\n",
+		        filename);
+		exit(1);
+	}
+	if ( header.byte_order != 0x01020304 || header.insize != INSIZE ||
+	     header.hdsize != HDSIZE || header.opsize != OPSIZE )  {
+		fprintf(stderr, "Fatal Error: in load_checkpoint, %s was written for another machine "
+		        "or network, halting\n", filename);
+		exit(1);
+	}
+	if ( header.optimizer != (uint32_t) optimizer && !load_file )  {
+		fprintf(stderr, "Fatal Error: in load_checkpoint, %s was trained with -o %s, "
+		        "halting\n", filename, optimizer_names[header.optimizer % 3]);
+		exit(1);
+	}
+	n = checkpoint_arrays(net, arrays, sizes);
+	for ( i = 0, failed = 0; i < n; i++ )
+		failed |= fread(arrays[i], sizes[i], 1, checkpoint) != 1;
+	if ( !failed && net->order && header.order_size == (uint32_t) net->shard_size &&
+	     header.order_pos <= header.order_size )  {
+		failed = fread(net->order, sizeof(*net->order), header.order_size, checkpoint) !=
+		         header.order_size;
+		net->order_pos = header.order_pos;
+	}
+	fclose(checkpoint);
+	if ( failed )  {
+		fprintf(stderr, "Fatal Error: in load_checkpoint, %s is truncated, halting\n", filename);
+		exit(1);
+	}
+	net->seed = header.seed;
+	net->epochs = header.epochs;
+	net->best_epoch = header.best_epoch;
+	net->steps = header.steps;
+	net->eta = header.eta;
+	net->alpha = header.alpha;
+	net->c = header.c;
+	net->epoch_error = header.epoch_error;
+	net->best_error = header.best_error;
+}
+
+/* Allocates a network with the given parameters and its initial weights.  Every network
+   starts with the same seed, and so with the same weights.
+*/
+
+struct network *new_network(float eta, float alpha, float c)
+{
+	struct network *net;
+
+	net = calloc(1, sizeof(*net));
+	if ( !net )  {
+		fprintf(stderr, "Fatal Error: in new_network, out of memory, halting\n");
+		exit(1);
+	}
+	net->eta = eta;
+	net->alpha = alpha;
+	net->c = c;
+	net->seed = 1;
+	net->best_error = HUGE_VALF;
+	net->shard_stride = 1;
+	net->shard_size = training_set.count;
+	load_initial_weights(net);
+	if ( batch_size > 0 )
+		init_batches(net);
+	return net;
+}
+
+/* Here the initial weight vectors are established.  Note especially how the bias "unit" of
+   the hidden layer (array index 0) is set up with an output value of 1.  Since biases and
+   weights are being treated uniformly as weights, it is important to remember that the bias
+   "units" need to be initialised; that of the input layer is set by "alloc_patterns".
+*/
+
+void load_initial_weights(struct network *net)
+{
+	int i, j, k;
+
+	net->hidden[0] = 1.0f;
 
 	/* Initialise the weights to small random values. */
 	for ( i = 0; i <= INSIZE; i++ )
 		for ( j = 1; j <= HDSIZE; j++ )  {
-		    w_ih[i][j] = random_val();
-		    dw_ih[i][j] = 0.0f;
+		    net->w_ih[i][j] = random_val(net);
+		    net->dw_ih[i][j] = 0.0f;
 		}
 
     for ( j = 0; j <= HDSIZE; j++ )
 		for ( k = 0; k <= OPSIZE; k++ )  {
-			w_ho[j][k] = random_val();
-			dw_ho[j][k] = 0.0f;
+			net->w_ho[j][k] = random_val(net);
+			net->dw_ho[j][k] = 0.0f;
 		}
 }
 
 
 /* Generate a random number uniformly distributed in the range -0.5...0.5. */
 
-float random_val(void)
+float random_val(struct network *net)
 {
-	return (float) rand() / (float) RAND_MAX - 0.5f;
+	return (float) rand_r(&net->seed) / (float) RAND_MAX - 0.5f;
 }
 
 /* Report status information about the network to the user. This assumes that 
@@ -415,33 +1962,49 @@ float random_val(void)
 
 */
 
-void report_operation(void)
+void report_operation(struct network *net, struct pattern_set *set)
+{
+    int misclassifications, good_classifications;
+
+    good_classifications = test_network(net, set, &misclassifications, 1);
+
+    printf("%4d tests, %4d (%6.2lf%%) correct classifications,\n",  
+           set->count,  good_classifications,
+	   100.0 * ((double)(good_classifications)) / ((double) set->count));
+    printf("            %4d (%6.2lf%%) misclassifications\n", 
+           misclassifications,
+	   100.0 * ((double)(misclassifications)) / ((double) set->count));
+}
+
+/* Applies every pattern of "set" to the network and returns the number of correct
+   classifications, and the number of misclassifications in "misclassifications".
+   The outputs of every pattern are displayed if "report" is set.
+*/
+
+int test_network(struct network *net, struct pattern_set *set, int *misclassifications,
+                 int report)
 {
-    int p, misclassifications, good_classifications;
+    int p, good_classifications;
 
-    misclassifications = 0;
+    *misclassifications = 0;
     good_classifications = 0;
-    for ( p = 0; p < TESTING_PATTERNS; p++ )  {
-      forwardprop( p );
-    	if ( mismatch(p) ) {
-    	  misclassifications++;
-        report_outputs( p, MISCLASS );
+    for ( p = 0; p < set->count; p++ )  {
+      forwardprop( net, set, p );
+    	if ( mismatch(net, set, p) ) {
+    	  (*misclassifications)++;
+    	  if ( report )
+          report_outputs( net, set, p, MISCLASS );
     	}
-    	else if ( match(p) ) {
+    	else if ( match(net, set, p) ) {
     	  good_classifications++;
-        report_outputs( p, CLASS );
+    	  if ( report )
+          report_outputs( net, set, p, CLASS );
       }
-      else {
-        report_outputs( p, INDEF );
+      else if ( report ) {
+        report_outputs( net, set, p, INDEF );
       }
     }
-
-    printf("%4d tests, %4d (%6.2lf%%) correct classifications,\n",  
-           TESTING_PATTERNS,  good_classifications,
-	   100.0 * ((double)(good_classifications)) / ((double) TESTING_PATTERNS));
-    printf("            %4d (%6.2lf%%) misclassifications\n", 
-           misclassifications,
-	   100.0 * ((double)(misclassifications)) / ((double) TESTING_PATTERNS));
+    return good_classifications;
 }
 
 
@@ -449,13 +2012,13 @@ void report_operation(void)
    match the desired outputs (within the tolerance DELTA).
 */
 
-int mismatch(int p)
+int mismatch(struct network *net, struct pattern_set *set, int p)
 {
     int i, mismatch;
 
     mismatch = 0;
     for ( i = 1; i <= OPSIZE; i++ )  {
-			if ( fabs(desired[p][i] - output[i]) > (DELTA * desired[p][i]) )  {
+			if ( fabs(set->target[i][p] - net->output[i]) > (DELTA * set->target[i][p]) )  {
 	    	mismatch = 1;
 	    	break;
 			}
@@ -467,13 +2030,13 @@ int mismatch(int p)
    match the desired outputs (within the tolerance DELTA).
 */
 
-int match(int p)
+int match(struct network *net, struct pattern_set *set, int p)
 {
     int i, match;
 
     match = 0;
     for ( i = 1; i <= OPSIZE; i++ )  {
-      if ( fabs(desired[p][i] - output[i]) < (DELTA * desired[p][i]) )  {
+      if ( fabs(set->target[i][p] - net->output[i]) < (DELTA * set->target[i][p]) )  {
         match = 1;
       }
       else {
@@ -492,7 +2055,7 @@ int match(int p)
    occured before this routine is called).
 */
 
-void report_outputs(int p, int type)
+void report_outputs(struct network *net, struct pattern_set *set, int p, int type)
 {
     int i;
 
@@ -502,26 +2065,510 @@ void report_outputs(int p, int type)
     else if ( type == INDEF )        printf("I ");  /* Indefinite result.......*/
     else                             printf("? ");  /* Unknown code............*/
     
-    for ( i = 1; i <= OPSIZE; i++ )  printf("%6.3f     ", desired[p][i]);
+    for ( i = 1; i <= OPSIZE; i++ )  printf("%6.3f     ", set->target[i][p]);
     printf("\n                ");
-    for ( i = 1; i <= OPSIZE; i++ )  printf("%6.3f     ", output[i]);
+    for ( i = 1; i <= OPSIZE; i++ )  printf("%6.3f     ", net->output[i]);
     printf("\n");
 }
 
 
 /* Dump the weight matrices of the network in a "nice" form. */
 
-void dump_weights(void)
+void dump_weights(struct network *net)
 {
     int i, j, k;
 
     printf("\n");
     for ( i = 0; i <= INSIZE; i++ )
         for ( j = 1; j <= HDSIZE; j++ )
-          printf("w_ih[%1d][%1d] = %6.3f\n", i, j, w_ih[i][j]);
+          printf("w_ih[%1d][%1d] = %6.3f\n", i, j, net->w_ih[i][j]);
     printf("\n");
     for ( j = 0; j <= HDSIZE; j++ )
         for ( k = 1; k <= OPSIZE; k++ )
-          printf("w_ho[%1d][%1d] = %6.3f\n", j, k, w_ho[j][k]);
+          printf("w_ho[%1d][%1d] = %6.3f\n", j, k, net->w_ho[j][k]);
     printf("\n");
-}
\ No newline at end of file
+}
+
+
+/* Fixed-point export.  The kernel cannot use floating point, so the network is run
+   there with the weights, inputs and outputs as Q numbers of FIXED_Q fraction bits,
+   in s32, and products accumulated in s64.  "forwardprop_fixed" is the inference
+   written out by "export_network", and "report_fixed" tests it here on the same
+   patterns as the network it comes from.
+*/
+
+void quantize_network(struct network *net, int32_t q_ih[INSIZE+1][HDSIZE+1],
+                      int32_t q_ho[HDSIZE+1][OPSIZE+1])
+{
+    int i, j, k;
+
+    for ( i = 0; i <= INSIZE; i++ )
+        for ( j = 1; j <= HDSIZE; j++ )  {
+            if ( fabs(net->w_ih[i][j]) * FIXED_ONE >= INT32_MAX )  {
+                fprintf(stderr, "Fatal Error: in quantize_network, w_ih[%d][%d] = %f does not "
+                        "fit in Q%d, halting\n", i, j, net->w_ih[i][j], FIXED_Q);
+                exit(1);
+            }
+            q_ih[i][j] = (int32_t) lround(net->w_ih[i][j] * FIXED_ONE);
+        }
+    for ( j = 0; j <= HDSIZE; j++ )
+        for ( k = 1; k <= OPSIZE; k++ )  {
+            if ( fabs(net->w_ho[j][k]) * FIXED_ONE >= INT32_MAX )  {
+                fprintf(stderr, "Fatal Error: in quantize_network, w_ho[%d][%d] = %f does not "
+                        "fit in Q%d, halting\n", j, k, net->w_ho[j][k], FIXED_Q);
+                exit(1);
+            }
+            q_ho[j][k] = (int32_t) lround(net->w_ho[j][k] * FIXED_ONE);
+        }
+}
+
+int32_t fixed_round(int64_t x)
+{
+    return (int32_t) ((x + (1 << (FIXED_Q - 1))) >> FIXED_Q);
+}
+
+void forwardprop_fixed(int32_t q_ih[INSIZE+1][HDSIZE+1], int32_t q_ho[HDSIZE+1][OPSIZE+1],
+                       int32_t in[INSIZE+1], int32_t out[OPSIZE+1])
+{
+    int32_t hidden[HDSIZE+1];
+    int64_t acc;
+    int i, j, k;
+
+    for ( j = 1; j <= HDSIZE; j++ )  {
+        acc = (int64_t) q_ih[0][j] << FIXED_Q;
+        for ( i = 1; i <= INSIZE; i++ )
+            acc += (int64_t) q_ih[i][j] * in[i];
+        hidden[j] = fixed_round(acc);
+    }
+    for ( k = 1; k <= OPSIZE; k++ )  {
+        acc = (int64_t) q_ho[0][k] << FIXED_Q;
+        for ( j = 1; j <= HDSIZE; j++ )
+            acc += (int64_t) q_ho[j][k] * hidden[j];
+        out[k] = fixed_round(acc);
+    }
+}
+
+void report_fixed(struct network *net, struct pattern_set *set)
+{
+    static struct network fixed;
+    int32_t q_ih[INSIZE+1][HDSIZE+1], q_ho[HDSIZE+1][OPSIZE+1], in[INSIZE+1], out[OPSIZE+1];
+    int p, i, k, good_classifications = 0;
+    double error, max_error = 0.0;
+
+    quantize_network(net, q_ih, q_ho);
+    fixed = *net;
+    for ( p = 0; p < set->count; p++ )  {
+        forwardprop(net, set, p);
+        for ( i = 1; i <= INSIZE; i++ )
+            in[i] = (int32_t) lround(set->input[i][p] * FIXED_ONE);
+        forwardprop_fixed(q_ih, q_ho, in, out);
+        for ( k = 1; k <= OPSIZE; k++ )  {
+            fixed.output[k] = (double) out[k] / FIXED_ONE;
+            error = fabs(fixed.output[k] - net->output[k]);
+            if ( error > max_error )
+                max_error = error;
+        }
+        if ( match(&fixed, set, p) )
+            good_classifications++;
+    }
+    printf("Fixed-point (Q%d) network: %4d (%6.2lf%%) correct classifications,\n", FIXED_Q,
+           good_classifications,
+           100.0 * ((double)(good_classifications)) / ((double) set->count));
+    printf("                           largest difference with the network %f\n\n", max_error);
+}
+
+/* Writes the network to "filename" as a header for lowmemorykiller.c: the quantized
+   weights, without the unused column 0 of the network arrays, and lmk_aad_infer(), the
+   integer-only inference of "forwardprop_fixed".  Its inputs and outputs are in the
+   units of the patterns, as Q numbers.
+*/
+
+void export_network(struct network *net, char *filename)
+{
+    int32_t q_ih[INSIZE+1][HDSIZE+1], q_ho[HDSIZE+1][OPSIZE+1];
+    FILE *f;
+    int i, j, k;
+
+    quantize_network(net, q_ih, q_ho);
+    if ( NULL == ( f = fopen(filename, "w") ) )  {
+        fprintf(stderr, "Fatal Error: in export_network, can't open %s for output, halting\n",
+                filename);
+        exit(1);
+    }
+    fprintf(f, "/* lowmemorykiller_aad.h\n"
+               " *\n"
+               " * Generated by backprop-lmk -e, do not edit: train the network again instead.\n"
+               " * eta = %f, alpha = %f, c = %f, %d epochs, epoch error %f,\n"
+               " * %d of %d test patterns correctly classified.\n"
+               " *\n"
+               " * Integer-only inference of the AAD network. Inputs and outputs are in the\n"
+               " * units of the patterns (see \"Explicacion patrones\"), as Q%d numbers:\n"
+               " * lmk_aad_fix(x, d) is x / d.\n"
+               " */\n\n",
+            net->eta, net->alpha, net->c, net->epochs, net->epoch_error,
+            test_network(net, &testing_set, &i, 0), testing_set.count, FIXED_Q);
+    fprintf(f, "#ifndef _LOWMEMORYKILLER_AAD_H\n"
+               "#define _LOWMEMORYKILLER_AAD_H\n\n"
+               "#include <linux/types.h>\n"
+               "#include <linux/math64.h>\n\n"
+               "#define LMK_AAD_INSIZE\t%d\n"
+               "#define LMK_AAD_HDSIZE\t%d\n"
+               "#define LMK_AAD_OPSIZE\t%d\n"
+               "#define LMK_AAD_Q\t%d\n"
+               "#define LMK_AAD_ONE\t(1 << LMK_AAD_Q)\n\n",
+            INSIZE, HDSIZE, OPSIZE, FIXED_Q);
+
+    fprintf(f, "/* Row 0 holds the bias weights */\n"
+               "static const s32 lmk_aad_w_ih[LMK_AAD_INSIZE + 1][LMK_AAD_HDSIZE] = {\n");
+    for ( i = 0; i <= INSIZE; i++ )  {
+        fprintf(f, "\t{");
+        for ( j = 1; j <= HDSIZE; j++ )
+            fprintf(f, " %d%s", q_ih[i][j], j < HDSIZE ? "," : " ");
+        fprintf(f, "},\n");
+    }
+    fprintf(f, "};\n\n"
+               "static const s32 lmk_aad_w_ho[LMK_AAD_HDSIZE + 1][LMK_AAD_OPSIZE] = {\n");
+    for ( j = 0; j <= HDSIZE; j++ )  {
+        fprintf(f, "\t{");
+        for ( k = 1; k <= OPSIZE; k++ )
+            fprintf(f, "%s%d%s", k == 5 ? "\n\t " : " ", q_ho[j][k], k < OPSIZE ? "," : " ");
+        fprintf(f, "},\n");
+    }
+    fprintf(f, "};\n\n");
+
+    fprintf(f, "static inline s32 lmk_aad_fix(long x, int d)\n"
+               "{\n"
+               "\treturn div_s64((s64)x << LMK_AAD_Q, d);\n"
+               "}\n\n"
+               "static inline s32 lmk_aad_round(s64 x)\n"
+               "{\n"
+               "\treturn (s32)((x + (1 << (LMK_AAD_Q - 1))) >> LMK_AAD_Q);\n"
+               "}\n\n"
+               "static inline void lmk_aad_infer(const s32 in[LMK_AAD_INSIZE],\n"
+               "\t\ts32 out[LMK_AAD_OPSIZE])\n"
+               "{\n"
+               "\ts32 hidden[LMK_AAD_HDSIZE];\n"
+               "\ts64 acc;\n"
+               "\tint i, j, k;\n\n"
+               "\tfor (j = 0; j < LMK_AAD_HDSIZE; j++) {\n"
+               "\t\tacc = (s64)lmk_aad_w_ih[0][j] << LMK_AAD_Q;\n"
+               "\t\tfor (i = 0; i < LMK_AAD_INSIZE; i++)\n"
+               "\t\t\tacc += (s64)lmk_aad_w_ih[i + 1][j] * in[i];\n"
+               "\t\thidden[j] = lmk_aad_round(acc);\n"
+               "\t}\n"
+               "\tfor (k = 0; k < LMK_AAD_OPSIZE; k++) {\n"
+               "\t\tacc = (s64)lmk_aad_w_ho[0][k] << LMK_AAD_Q;\n"
+               "\t\tfor (j = 0; j < LMK_AAD_HDSIZE; j++)\n"
+               "\t\t\tacc += (s64)lmk_aad_w_ho[j + 1][k] * hidden[j];\n"
+               "\t\tout[k] = lmk_aad_round(acc);\n"
+               "\t}\n"
+               "}\n\n"
+               "#endif\n");
+    if ( fclose(f) )  {
+        fprintf(stderr, "Fatal Error: in export_network, can't write %s, halting\n", filename);
+        exit(1);
+    }
+    printf("Network exported to %s\n", filename);
+}
+
+
+/* Benchmarks of the trainer, with "-B".  They print one JSON object per line, so that
+   their output can be kept and compared with that of a later build (with -C):
+
+   {"bench":"train", ...}      BENCH_EPOCHS epochs of a new network, the fastest of
+                               BENCH_REPEATS runs, for each batch size of
+                               "bench_batches" (0 is pattern by pattern) and 1, 2, 4...
+                               up to -j threads: the time of an epoch, the patterns
+                               trained per second, the bytes of the network with its
+                               buffers and replicas, and the peak resident memory of
+                               the process so far.
+   {"bench":"inference", ...}  the latency of a forward pass on the test patterns, p50
+                               and p99, with the network in floating point ("float")
+                               and in Q16 as exported to the kernel ("fixed").  A pass
+                               takes about as long as reading the clock, so they are
+                               timed BENCH_SAMPLE_CALLS at a time, BENCH_CALLS in a
+                               run, and the run with the lowest p50 of BENCH_REPEATS
+                               counts.
+
+   Each benchmark also gives its "spread", how much slower its median run is than its
+   fastest one.  The threads use all-reduce unless -H is given.  With -C, the
+   benchmarks found in both runs, with the same batch, threads, mode and optimizer,
+   are compared, and the exit status is 1 if any training throughput or p50 latency
+   is worse by more than its tolerance: BENCH_SPREADS times the spreads of both runs,
+   and at least BENCH_TOLERANCE.  Some machines change speed from one process to
+   the next, which the spread of a single run does not show: the baseline can then
+   be the output of several runs of -B, and the spread between them is taken too.
+*/
+
+int bench_batches[] = { 0, 1, 8, 32, 128 };
+int bench_regressions;                /* Benchmarks worse than the baseline */
+FILE *bench_baseline;
+
+int run_benchmarks(void)
+{
+	int b, t;
+
+	if ( baseline_file && NULL == ( bench_baseline = fopen(baseline_file, "r") ) )  {
+		fprintf(stderr, "Fatal Error: in run_benchmarks, can't open %s for input, halting\n",
+		        baseline_file);
+		exit(1);
+	}
+	for ( b = 0; b < (int) (sizeof(bench_batches) / sizeof(bench_batches[0])); b++ )
+		for ( t = 1; ; t = t * 2 < jobs ? t * 2 : jobs )  {
+			batch_size = bench_batches[b];
+			if ( (bench_batches[b] > 0 || t == 1) && worker_count(t) == t )
+				bench_training(bench_batches[b], t);
+			if ( t == jobs )
+				break;
+		}
+	bench_inference(0);
+	bench_inference(1);
+	if ( bench_baseline )  {
+		fclose(bench_baseline);
+		fprintf(stderr, "%d benchmarks worse than %s beyond their tolerance\n",
+		        bench_regressions, baseline_file);
+	}
+	return bench_regressions > 0;
+}
+
+void bench_training(int batch, int threads)
+{
+	struct network *net;
+	struct rusage usage;
+	char line[512];
+	int64_t start, runs[BENCH_REPEATS];
+	int epoch, run;
+	double seconds, spread;
+
+	batch_size = batch;
+	train_threads = threads;
+	for ( run = 0; run < BENCH_REPEATS; run++ )  {
+		net = new_network(eta_values[0], alpha_values[0], c_values[0]);
+		start = clock_ns();
+		if ( threads > 1 )
+			start_workers(net);
+		for ( epoch = 1; epoch <= BENCH_EPOCHS; epoch++ )  {
+			net->rate = learning_rate(net, epoch);
+			if ( net->workers )
+				train_epoch_parallel(net);
+			else if ( batch > 0 )
+				train_epoch_batch(net);
+			else
+				train_epoch(net);
+		}
+		if ( net->workers )
+			stop_workers(net);
+		runs[run] = clock_ns() - start;
+		free(net->order);
+		free(net->batch_in);
+		free(net->batch_target);
+		free(net->batch_hidden);
+		free(net->batch_output);
+		free(net->batch_delta_o);
+		free(net->batch_delta_h);
+		free(net);
+	}
+	getrusage(RUSAGE_SELF, &usage);
+	spread = bench_spread(runs);
+	seconds = runs[0] * 1e-9;
+	snprintf(line, sizeof(line), "{\"bench\":\"train\",\"batch\":%d,\"threads\":%d,"
+	         "\"mode\":\"%s\",\"optimizer\":\"%s\",\"epochs\":%d,\"seconds\":%.6f,"
+	         "\"epoch_us\":%.2f,\"patterns_per_s\":%.0f,\"spread\":%.4f,\"bytes\":%zu,"
+	         "\"maxrss_kb\":%ld}",
+	         batch, threads, threads == 1 ? "serial" : hogwild ? "hogwild" : "all-reduce",
+	         optimizer_names[optimizer], BENCH_EPOCHS, seconds, 1e6 * seconds / BENCH_EPOCHS,
+	         (double) BENCH_EPOCHS * (training_set.count / 4) / seconds, spread,
+	         network_bytes(batch, threads), usage.ru_maxrss);
+	printf("%s\n", line);
+	fflush(stdout);
+	compare_benchmark(line);
+}
+
+void bench_inference(int fixed)
+{
+	struct network *net;
+	int32_t q_ih[INSIZE+1][HDSIZE+1], q_ho[HDSIZE+1][OPSIZE+1], out[OPSIZE+1];
+	int32_t (*in)[INSIZE+1];
+	int64_t *times, *best_times, p50s[BENCH_REPEATS], start;
+	int samples = BENCH_CALLS / BENCH_SAMPLE_CALLS;
+	int sample, call, run, p = 0, i;
+	char line[512];
+
+	times = malloc(2 * samples * sizeof(*times));
+	in = malloc(testing_set.count * sizeof(*in));
+	if ( !times || !in )  {
+		fprintf(stderr, "Fatal Error: in bench_inference, out of memory, halting\n");
+		exit(1);
+	}
+	best_times = times + samples;
+	batch_size = 0;
+	train_threads = 1;
+	net = new_network(eta_values[0], alpha_values[0], c_values[0]);
+	quantize_network(net, q_ih, q_ho);
+	for ( p = 0; p < testing_set.count; p++ )
+		for ( i = 1; i <= INSIZE; i++ )
+			in[p][i] = (int32_t) lround(testing_set.input[i][p] * FIXED_ONE);
+
+	p = 0;
+	for ( run = 0; run < BENCH_REPEATS; run++ )  {
+		for ( sample = 0; sample < samples; sample++ )  {
+			start = clock_ns();
+			for ( call = 0; call < BENCH_SAMPLE_CALLS; call++ )  {
+				if ( fixed )
+					forwardprop_fixed(q_ih, q_ho, in[p], out);
+				else
+					forwardprop(net, &testing_set, p);
+				if ( ++p == testing_set.count )
+					p = 0;
+			}
+			times[sample] = clock_ns() - start;
+		}
+		qsort(times, samples, sizeof(*times), compare_times);
+		p50s[run] = times[samples / 2];
+		if ( run == 0 || p50s[run] < best_times[samples / 2] )
+			memcpy(best_times, times, samples * sizeof(*times));
+	}
+	snprintf(line, sizeof(line), "{\"bench\":\"inference\",\"kind\":\"%s\",\"calls\":%d,"
+	         "\"sample_calls\":%d,\"p50_ns\":%.2f,\"p99_ns\":%.2f,\"spread\":%.4f}",
+	         fixed ? "fixed" : "float", BENCH_CALLS, BENCH_SAMPLE_CALLS,
+	         (double) best_times[samples / 2] / BENCH_SAMPLE_CALLS,
+	         (double) best_times[samples * 99 / 100] / BENCH_SAMPLE_CALLS, bench_spread(p50s));
+	printf("%s\n", line);
+	fflush(stdout);
+	compare_benchmark(line);
+	free(times);
+	free(in);
+	free(net);
+}
+
+/* How much slower the median of BENCH_REPEATS runs is than the fastest one, which
+   it leaves first. */
+
+double bench_spread(int64_t *runs)
+{
+	qsort(runs, BENCH_REPEATS, sizeof(*runs), compare_times);
+	if ( runs[0] <= 0 )
+		return 0.0;
+	return (double) (runs[BENCH_REPEATS / 2] - runs[0]) / runs[0];
+}
+
+int compare_times(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+int64_t clock_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* The memory of a network being trained: the network, its buffers and shuffled order
+   with mini-batches, and its replicas, with theirs, in data-parallel training. */
+
+size_t network_bytes(int batch, int threads)
+{
+	size_t one = sizeof(struct network);
+
+	if ( batch > 0 )
+		one += (size_t) batch * (INSIZE+1 + 2 * (HDSIZE+1) + 3 * (OPSIZE+1)) * sizeof(double) +
+		       training_set.count * sizeof(int);
+	if ( threads > 1 )
+		return one + threads * one + sizeof(struct workers);
+	return one;
+}
+
+/* The number of "key" in a line of -B output, or NaN if it has none. */
+
+double json_number(char *line, char *key)
+{
+	char pattern[64];
+	char *p;
+
+	snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+	if ( NULL == ( p = strstr(line, pattern) ) )
+		return NAN;
+	return atof(p + strlen(pattern));
+}
+
+/* Whether the string or number of "key" is the same in two lines of -B output. */
+
+int json_same(char *a, char *b, char *key)
+{
+	char pattern[64];
+	size_t length;
+
+	snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+	a = strstr(a, pattern);
+	b = strstr(b, pattern);
+	if ( !a || !b )
+		return a == b;
+	length = strcspn(a, ",}");
+	return length == strcspn(b, ",}") && !strncmp(a, b, length);
+}
+
+/* Looks for the same benchmark in the baseline and reports how this run compares.  The
+   baseline may hold several runs of -B: this run is compared with their median, and
+   the spread between them counts as a spread of the baseline.  A baseline without
+   spreads is given the least tolerance. */
+
+void compare_benchmark(char *line)
+{
+	char old[512], *key, *name;
+	double times[BENCH_BASELINES], now, then, value, spread, spread_then = 0.0;
+	double change, tolerance;
+	int train = strstr(line, "\"bench\":\"train\"") != NULL;
+	int runs = 0, i, j;
+
+	if ( !bench_baseline )
+		return;
+	key = train ? "patterns_per_s" : "p50_ns";
+	rewind(bench_baseline);
+	while ( runs < BENCH_BASELINES && fgets(old, sizeof(old), bench_baseline) )  {
+		if ( !json_same(old, line, "bench") ||
+		     ( train ? !json_same(old, line, "batch") || !json_same(old, line, "threads") ||
+		               !json_same(old, line, "mode") || !json_same(old, line, "optimizer")
+		             : !json_same(old, line, "kind") ) )
+			continue;
+		value = json_number(old, key);
+		if ( isnan(value) || value <= 0.0 )
+			continue;
+		/* In time, as the spreads: seconds per pattern, or ns, sorted */
+		value = train ? 1.0 / value : value;
+		for ( i = runs++; i > 0 && times[i-1] > value; i-- )
+			times[i] = times[i-1];
+		times[i] = value;
+		spread = json_number(old, "spread");
+		if ( spread > spread_then )
+			spread_then = spread;
+	}
+	if ( runs == 0 )
+		return;
+	if ( times[runs-1] / times[0] - 1.0 > spread_then )
+		spread_then = times[runs-1] / times[0] - 1.0;
+	j = runs / 2;
+	then = train ? 1.0 / times[j] : times[j];
+	now = json_number(line, key);
+
+	tolerance = BENCH_SPREADS * (json_number(line, "spread") + spread_then);
+	if ( !( tolerance > BENCH_TOLERANCE ) )
+		tolerance = BENCH_TOLERANCE;
+	/* Positive changes are slowdowns: fewer patterns per second, or more ns */
+	change = train ? then / now - 1.0 : now / then - 1.0;
+	name = change > tolerance ? "REGRESSION" : "ok";
+	if ( change > tolerance )
+		bench_regressions++;
+	if ( train )
+		fprintf(stderr, "train batch %d threads %d: %.0f patterns/s, was %.0f, time %+.1f%% "
+		        "(tolerance %.1f%%)  %s\n",
+		        (int) json_number(line, "batch"), (int) json_number(line, "threads"),
+		        now, then, 100.0 * change, 100.0 * tolerance, name);
+	else
+		fprintf(stderr, "inference %s: p50 %.1f ns, was %.1f, %+.1f%% (tolerance %.1f%%)  %s\n",
+		        strstr(line, "fixed") ? "fixed" : "float", now, then, 100.0 * change,
+		        100.0 * tolerance, name);
+}
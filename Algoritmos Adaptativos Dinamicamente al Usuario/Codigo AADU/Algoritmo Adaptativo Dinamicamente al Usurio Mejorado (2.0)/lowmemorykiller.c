@@ -46,9 +46,25 @@
 #include <linux/time.h>
 #include <linux/ktime.h>
 #include <linux/shrinker.h>
+#include <linux/sort.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+#include <linux/seqlock.h>
+#include <linux/completion.h>
+#include <linux/profile.h>
+#include <linux/hugetlb.h>
+#include <linux/spinlock.h>
+#include <linux/math64.h>
+#ifdef CONFIG_PSI
+#include <linux/psi.h>
+#endif
+
+#include "lowmemorykiller_aad.h"
 
-#define NUM_OF_PROCESS 100	/* That limit is never reached */
+#define NUM_OF_PROCESS 100	/* Initial size of the candidate table */
 #define X_KILL_PROCESSES 3
+#define KILL_EWMA_SHIFT 2	/* Weight of a new inter-kill interval, 1/4 */
+#define KILL_INTERVAL_MAX NSEC_PER_SEC	/* Longest inter-kill interval counted */
 #define ORDER_SIZE 0
 #define ORDER_OOM 1
 #define NO_ORDER 2
@@ -65,6 +81,15 @@
 #define LVL8 6144	/* 24MB */
 #define LVL9 10240	/* 40MB */
 #define LVL10 15360	/* 60MB */
+#define VICTIM_EXIT_TIMEOUT_MS 20
+#define MAX_BATCH_KILL 8
+#define LEVEL_SHIFT 8		/* minfree levels in 1/256 of a configuration */
+#define LEVEL_ONE (1 << LEVEL_SHIFT)
+#define LEVEL_GAIN 128		/* Part of the way to the target, in 1/256 */
+#define LEVEL_DEADBAND LEVEL_ONE	/* Smallest change of level applied */
+#define PSI_POLL_MS 100		/* Period of the memory stall samples */
+#define PSI_SAMPLES 20		/* Samples in the stall window, 2 s */
+#define PSI_POLL_TRIGGER "some 100000 1000000"	/* PSI polls every 100 ms */
 
 #ifdef CONFIG_HIGHMEM
 #define _ZONE ZONE_HIGHMEM
@@ -82,12 +107,69 @@ static int adaptive_LMK = 1;
  */
 static int pages_patch = 1;
 
+/* Batch kill active if batch_kill = 1: each kill covers the whole deficit of
+ * free pages with as many victims as needed, instead of one task per call.
+ * We can change the value of this variable from outside the kernel.
+ */
+static int batch_kill;
+
+/* Device-adapted configurations if aad_net = 1 (experimental): the ratios
+ * between the seven configurations and the thresholds of adapt_lmk are taken
+ * from the AAD network of lowmemorykiller_aad.h instead of the fixed ones.
+ * The inputs of the network are measured once at boot, TIME_INIT_ADAPT
+ * seconds after the LMK is loaded. The exported network is not validated:
+ * in the simulator it kills more than the fixed ratios, so it stays off. We
+ * can change the value of this variable from outside the kernel.
+ */
+static int aad_net;
+
+/* Inputs of the AAD network measured at boot, valid once aad_measured = 1,
+ * under scan_mutex
+ */
+static s32 aad_in[LMK_AAD_INSIZE];
+static int aad_measured;
+
+/* Continuous minfrees if continuous_minfree = 1: adapt_lmk moves a level
+ * between the seven configurations instead of jumping from one to another,
+ * and the minfrees are interpolated between the two configurations around it
+ * (see minfree_control). We can change the value of this variable from
+ * outside the kernel.
+ */
+static int continuous_minfree;
+
+/* Hysteresis in adapt_lmk if hysteresis = 1: a configuration is kept at least
+ * min_ms_configuration, and a rule applies its step once, when its measure
+ * crosses the enter threshold, and does not fire again until the measure has
+ * crossed back an exit threshold, laxer than the enter one. We can change the
+ * value of this variable from outside the kernel.
+ */
+static int hysteresis;
+
+/* Kills driven by memory stall if psi_trigger = 1: the LMK samples the PSI
+ * memory stall of the system every PSI_POLL_MS and, while the stall of the
+ * last PSI_SAMPLES samples is below psi_some_ms and psi_full_ms, only kills
+ * at the first minfree level. Each time the stall crosses them adapt_lmk runs
+ * again. Without CONFIG_PSI it has no effect. The PSI triggers and the
+ * PSI_POLL totals it reads are from Linux 5.2, newer than the kernel of this
+ * driver, so for now it only builds against the simulator shim. We can change
+ * the value of this variable from outside the kernel.
+ */
+static int psi_trigger;
+
 /* 1=Extreme Ligth 2=Very Light; 3=Light; 4=Medium; 5=Aggressive;
  * 6=Very Aggressive; 7=Extreme Aggresive
  */
 static int minfree_config = 4;
 static int last_minfree_config = 4;
 
+/* Level of the continuous minfrees, in 1/LEVEL_ONE of a configuration: the
+ * level applied to lowmem_minfree, the output of the controller and the target
+ * it is moving to.
+ */
+static int minfree_level = 4 << LEVEL_SHIFT;
+static int minfree_output = 4 << LEVEL_SHIFT;
+static int minfree_target = 4 << LEVEL_SHIFT;
+
 /* Generic configurations */
 /* 1MB, 2MB, 3MB, 6MB, 10MB, 15MB */
 static int extreme_light_minfree[6] = {LVL1 / 4, LVL2 / 4, LVL7 / 4, LVL8 / 4,
@@ -109,17 +191,21 @@ static int very_aggressive_minfree[6] = {LVL1 * 4, LVL2 * 4, LVL3 * 4, LVL4 * 4,
 static int extreme_aggressive_minfree[6] = {LVL1 * 8, LVL2 * 8, LVL3 * 8,
 					LVL4 * 8, LVL5 * 8, LVL6 * 8};
 
+static int *minfree_tables[7] = {extreme_light_minfree, very_light_minfree,
+	light_minfree, medium_minfree, aggressive_minfree,
+	very_aggressive_minfree, extreme_aggressive_minfree};
+
 /* Algorithm params */
-static struct timeval time_kill_X_processes;
-static struct timeval time_no_kill_processes;
+static s64 time_kill_X_processes;	/* ns */
+static s64 time_no_kill_processes;	/* ns */
 static int new_processes_no_kill;
 static int running_processes = -1;
 static long size_big_foreground_process;
 
-/* Algorithm threshold */
-static struct timeval min_time_kill_X_processes = { 1, 0 };
-static struct timeval max_time_no_kill_processes = { 1200, 0 };
-static struct timeval max_time_fail_measure = { 600, 0 };
+/* Algorithm threshold. Times in ns. */
+static s64 min_time_kill_X_processes = 1 * (s64)NSEC_PER_SEC;
+static s64 max_time_no_kill_processes = 1200 * (s64)NSEC_PER_SEC;
+static s64 max_time_fail_measure = 600 * (s64)NSEC_PER_SEC;
 static int max_new_processes_no_kill = 10;
 static int max_running_processes = 27;
 static long max_size_big_foreground_process = 150000;
@@ -127,25 +213,78 @@ static long max_ms_without_use_adapt_lmk = 500000;
 static long min_ms_without_use_adapt_lmk = 250000;
 static long ms_without_use_adapt_lmk = 300000;
 
-/* Aux arrays */
-static struct task_struct *tasks[NUM_OF_PROCESS];
-static long size_of_process[NUM_OF_PROCESS];
-static short oom_of_process[NUM_OF_PROCESS];
-static long size_foreground_processes[NUM_OF_PROCESS];
+/* Exit thresholds of the rules with hysteresis = 1, in percent of their enter
+ * threshold, so that they follow the thresholds aad_adapt_configurations sets.
+ * The rules that fire on a low measure have an exit percent above 100.
+ */
+static int exit_percent_kill_X_processes = 200;
+static int exit_percent_no_kill_processes = 50;
+static int exit_percent_running_processes = 89;
+static int exit_percent_size_big_foreground_process = 80;
+static long min_ms_configuration = 10000;
+
+/* Memory stall thresholds with psi_trigger = 1, in ms per stall window */
+static long psi_some_ms = 5;
+static long psi_full_ms = 3;
+
+/* Rules that have fired and not yet crossed their exit threshold */
+static int big_foreground_active;
+static int running_processes_active;
+static int kill_X_processes_active;
+static int no_kill_processes_active;
+static long suppressed_configurations;
+
+/* Entry of the process lists. The sort keys live next to the task pointer so
+ * that sorting moves a single array. pos is the position of the task in the
+ * task list and keeps the order of tasks with the same key.
+ */
+struct lmk_candidate {
+	struct task_struct *task;
+	long size;		/* kB */
+	short oom;
+	int pos;
+};
 
-/* Aux variables */
+/* Aux arrays. The candidate table is allocated when the module is loaded and
+ * only grown from a work item, never from the reclaim path.
+ */
+static struct lmk_candidate *candidates;
+static int candidates_size;
+static int candidates_wanted;
+static int num_candidates;
+static void grow_candidates(struct work_struct *work);
+static DECLARE_WORK(grow_candidates_work, grow_candidates);
+static long size_foreground_max;
+
+/* Aux variables. Times are ktime_get() in ns, -1 until they are set. */
 static int fail_measure;
 static int running_processes_last_kill = -1;
-static struct timeval time_last_lmk_use_1;
-static struct timeval time_last_lmk_use_2 = { -1, 0 };
-static struct timeval time_first_kill = { -1, 0 };
-static struct timeval time_measure_no_kill = { -1, 0 };
-static struct timeval time_init_adapt_lmk_1 = { -1, 0 };
-static struct timeval time_init_adapt_lmk_2;
-static struct timeval time_last_kill = { -1, 0 };
-static struct timeval time_init_configuration = { -1, 0 };
-static struct timeval time_use_adapt_lmk_1;
-static struct timeval time_use_adapt_lmk_2 = { -1, 0 };
+static s64 time_last_lmk_use = -1;
+static s64 time_first_kill = -1;
+static s64 time_last_kill = -1;
+static s64 kill_interval = -1;		/* EWMA */
+static s64 time_measure_no_kill = -1;
+static s64 time_init_adapt_lmk = -1;
+static s64 time_init_configuration = -1;
+static s64 time_use_adapt_lmk = -1;
+
+/* Memory stall of the PSI trigger mode, under scan_mutex */
+static int psi_stalled;
+static int psi_pressure;		/* Some stall in the window */
+
+#ifdef CONFIG_PSI
+/* Memory stall samples, PSI total stall in ns */
+static u64 psi_some[PSI_SAMPLES];
+static u64 psi_full[PSI_SAMPLES];
+static int psi_sample;
+static s64 time_psi_sample = -1;
+
+/* The PSI_AVGS totals only move every 2 s, too late for this window. While a
+ * trigger is registered PSI also keeps the PSI_POLL totals, which move every
+ * tenth of the trigger window, and only polls while there is memory stall.
+ */
+static void *psi_poll_trigger;
+#endif
 
 static int uses_no_config;
 static int limit_uses_no_config = 10;
@@ -177,26 +316,156 @@ static int lowmem_minfree[6] = {
 	16 * 1024,	/* 64MB */
 };
 static int lowmem_minfree_size = 4;
+
+/* lowmem_minfree is rewritten by adapt_lmk from a work item while the
+ * shrinker may be reading it.
+ */
+static DEFINE_SEQLOCK(lowmem_minfree_lock);
 static int lmk_fast_run = 1;
 
 static unsigned long lowmem_deathpending_timeout;
 
+/* Tasks killed by the LMK in the last kill, until their memory is back: when
+ * the reaper has unmapped them or when they are freed, whatever happens
+ * first. victim_exit is completed when that has happened to all of them, and
+ * lowmem_freed_pages counts the pages they have given back.
+ */
+struct lmk_victim {
+	struct task_struct *task;
+	int tasksize;
+	short oom_score_adj;
+};
+
+static struct lmk_victim lowmem_victims[MAX_BATCH_KILL];
+static int lowmem_victims_pending;
+/* Taken with the bottom halves off: the task_free notifier can run from the
+ * RCU callback of delayed_put_task_struct, in softirq context.
+ */
+static DEFINE_SPINLOCK(lowmem_victims_lock);
+static DECLARE_COMPLETION(victim_exit);
+static atomic_long_t lowmem_freed_pages = ATOMIC_LONG_INIT(0);
+
+/* Reaper and the victims handed to it */
+static struct workqueue_struct *lowmem_reaper_wq;
+static struct task_struct *reap_tasks[MAX_BATCH_KILL];
+static int nr_reap_tasks;
+
 #define lowmem_print(level, x...)			\
 	do {						\
 		if (lowmem_debug_level >= (level))	\
 			pr_info(x);			\
 	} while (0)
 
+/* This function gets the inputs of the AAD network, in the units of its
+ * patterns: the total and the free RAM in hundreds of MB, the number of user
+ * processes in tens and the size of the biggest one in hundreds of MB. The
+ * processes are those that adapt_lmk counts, and the page cache counts as free
+ * as it does for the minfree levels.
+ */
+static void aad_measure(s32 in[LMK_AAD_INSIZE])
+{
+	struct task_struct *tsk;
+	struct task_struct *p;
+	long pages_per_100mb = 100L << (20 - PAGE_SHIFT);
+	long free_pages;
+	long biggest = 0;
+	long tasksize;
+	int processes = 0;
+
+	free_pages = global_page_state(NR_FREE_PAGES) +
+		global_page_state(NR_FILE_PAGES) -
+		global_page_state(NR_SHMEM);
+
+	rcu_read_lock();
+	for_each_process(tsk) {
+		if (tsk->flags & PF_KTHREAD)
+			continue;
+		p = find_lock_task_mm(tsk);
+		if (!p)
+			continue;
+		tasksize = get_mm_rss(p->mm);
+		if ((tasksize > 0) && (p->signal->oom_score_adj >= 0)) {
+			processes++;
+			if (tasksize > biggest)
+				biggest = tasksize;
+		}
+		task_unlock(p);
+	}
+	rcu_read_unlock();
+
+	in[0] = lmk_aad_fix(totalram_pages, pages_per_100mb);
+	in[1] = lmk_aad_fix(free_pages, pages_per_100mb);
+	in[2] = lmk_aad_fix(processes, 10);
+	in[3] = lmk_aad_fix(biggest, pages_per_100mb);
+}
+
+
+/* This function adjusts the seven configurations and the thresholds of
+ * adapt_lmk with the AAD network. Its first three outputs multiply the medium
+ * configuration to give the aggressive ones, the next three divide it to give
+ * the light ones, and the last two are the thresholds of running processes, in
+ * tens, and of the size of the biggest foreground process, in hundreds of MB.
+ * If the inputs have not been measured yet or the outputs would not keep the
+ * configurations in order, nothing is changed and 0 is returned.
+ */
+static int aad_adapt_configurations(void)
+{
+	s32 out[LMK_AAD_OPSIZE];
+	int i;
+
+	if (!aad_measured) {
+		lowmem_print(1, "AAD network inputs not measured yet, "
+			"used when they are\n");
+		return 0;
+	}
+	lmk_aad_infer(aad_in, out);
+	if (!(out[0] > out[1] && out[1] > out[2] && out[2] > LMK_AAD_ONE &&
+		out[5] > out[4] && out[4] > out[3] && out[3] > LMK_AAD_ONE &&
+		out[6] > 0 && out[7] > 0)) {
+		lowmem_print(1, "AAD network out of range, not used\n");
+		return 0;
+	}
+
+	for (i = 0; i < 6; i++) {
+		extreme_aggressive_minfree[i] =
+			((s64)medium_minfree[i] * out[0]) >> LMK_AAD_Q;
+		very_aggressive_minfree[i] =
+			((s64)medium_minfree[i] * out[1]) >> LMK_AAD_Q;
+		aggressive_minfree[i] =
+			((s64)medium_minfree[i] * out[2]) >> LMK_AAD_Q;
+		light_minfree[i] =
+			div_s64((s64)medium_minfree[i] << LMK_AAD_Q, out[3]);
+		very_light_minfree[i] =
+			div_s64((s64)medium_minfree[i] << LMK_AAD_Q, out[4]);
+		extreme_light_minfree[i] =
+			div_s64((s64)medium_minfree[i] << LMK_AAD_Q, out[5]);
+	}
+	max_running_processes = lmk_aad_round((s64)out[6] * 10);
+	max_size_big_foreground_process =
+		((s64)out[7] * 100 * 1024) >> LMK_AAD_Q;
+	lowmem_print(1, "Configuration adapted by the AAD network: "
+		"max_running_processes %d, "
+		"max_size_big_foreground_process %ld KB\n",
+		max_running_processes, max_size_big_foreground_process);
+	return 1;
+}
+
 /* This function adjust the seven configurations. To do this, it take the defect
  * configuration of our device, defines this as the medium configuration,
- * and adjust the other configurations from these values.
+ * and adjust the other configurations from these values, with the AAD network
+ * if aad_net = 1 or with fixed ratios otherwise.
  */
 static void adapt_configurations(void)
 {
 	int i;
 
-	for (i = 0; i < 6; i++) {
+	for (i = 0; i < 6; i++)
 		medium_minfree[i] = lowmem_minfree[i];
+
+	if (aad_net == 1 && aad_adapt_configurations())
+		return;
+
+	for (i = 0; i < 6; i++) {
 		extreme_aggressive_minfree[i] = medium_minfree[i] * 4;
 		very_aggressive_minfree[i] = medium_minfree[i] * 3;
 		aggressive_minfree[i] = medium_minfree[i] * 2;
@@ -213,11 +482,12 @@ static void adapt_configurations(void)
 static void configure_minfrees(int minfree_config)
 {
 	int i = 0;
-	do_gettimeofday(&time_init_configuration);
+	time_init_configuration = ktime_to_ns(ktime_get());
 	lmk_count_configuration = 0;
 	lmk_count = 0;
 	lowmem_print(1, "New configuration: %d\n",
 			minfree_config);
+	write_seqlock(&lowmem_minfree_lock);
 	switch (minfree_config) {
 	case 1:
 		for (i = 0; i < ARRAY_SIZE(lowmem_minfree); i++)
@@ -250,102 +520,175 @@ static void configure_minfrees(int minfree_config)
 	default:
 		break;
 	}
+	write_sequnlock(&lowmem_minfree_lock);
 }
 
-/* This function clean a long array putting 0 in all its values. */
-static void clean_array_long (long array[], int num_elem)
+/* This function sets the minfrees of a level between two configurations, in
+ * 1/LEVEL_ONE of a configuration: level 4 << LEVEL_SHIFT is the medium
+ * configuration, and a quarter of the way from there to the aggressive one is
+ * 4 << LEVEL_SHIFT + LEVEL_ONE / 4. Each minfree is interpolated linearly
+ * between those of the two configurations around the level.
+ */
+static void configure_minfree_level(int level)
 {
 	int i;
-	for (i = 0; i < num_elem; i++)
-		array[i] = 0;
+	int config = level >> LEVEL_SHIFT;
+	int frac = level & (LEVEL_ONE - 1);
+	int *low = minfree_tables[config - 1];
+	int *high = minfree_tables[config < 7 ? config : 6];
+
+	time_init_configuration = ktime_to_ns(ktime_get());
+	lmk_count_configuration = 0;
+	lmk_count = 0;
+	lowmem_print(1, "New configuration: %d (level %d/%d)\n",
+			config, level, LEVEL_ONE);
+	write_seqlock(&lowmem_minfree_lock);
+	for (i = 0; i < ARRAY_SIZE(lowmem_minfree); i++)
+		lowmem_minfree[i] = low[i] +
+			(((high[i] - low[i]) * frac) >> LEVEL_SHIFT);
+	write_sequnlock(&lowmem_minfree_lock);
 }
 
-/* This function clean a short array putting 0 in all its values. */
-static void clean_array_short(short array[], int num_elem)
+/* Controller of the continuous minfrees. The rules of adapt_lmk do not set the
+ * configuration: their steps, "demand", move the target level, which so adds
+ * them up over the runs of adapt_lmk, as the integral term of a controller.
+ * The output then goes LEVEL_GAIN/256 of the way to the target on each run, the
+ * proportional term, and the minfrees only change when it has moved
+ * LEVEL_DEADBAND from the level they were set for, or has reached the target.
+ * With half the way and a deadband of one configuration, a step of one
+ * configuration is applied on the run that asks for it and a bigger one moves
+ * the minfrees one configuration per run, so adapt_lmk runs, at least
+ * min_ms_without_use_adapt_lmk apart, are not wasted waiting for the output.
+ * A step of two undone by the next run, as in the jumps 6, 4, 2 of the
+ * discrete configurations, only moves the minfrees one configuration and
+ * back. Returns 1 if they were changed.
+ */
+static int minfree_control(int demand)
 {
-	int i;
-	for (i = 0; i < num_elem; i++)
-		array[i] = 0;
+	minfree_target += demand << LEVEL_SHIFT;
+	minfree_target = clamp(minfree_target, 1 << LEVEL_SHIFT,
+			7 << LEVEL_SHIFT);
+
+	minfree_output += ((minfree_target - minfree_output) * LEVEL_GAIN) >>
+			LEVEL_SHIFT;
+	if (abs(minfree_target - minfree_output) < LEVEL_DEADBAND)
+		minfree_output = minfree_target;
+	if ((abs(minfree_output - minfree_level) < LEVEL_DEADBAND) &&
+		(minfree_output != minfree_target))
+		return 0;
+	if (minfree_output == minfree_level)
+		return 0;
+
+	minfree_level = minfree_output;
+	configure_minfree_level(minfree_level);
+	return 1;
 }
 
-/* This function clean a task_struct array putting NULL in all its values. */
-static void clean_array_tasks(struct task_struct *array[], int num_elem)
+/* This function adds a task to the table of candidates and returns the number
+ * of tasks added so far in this scan. It runs in the reclaim path, so it never
+ * allocates: once the table is 3/4 full a work item grows it, and the tasks
+ * that do not fit meanwhile are counted but left out of the lists.
+ */
+static int add_candidate(int sop_pos, struct task_struct *p, int tasksize,
+		short oom_score_adj)
 {
-	int i;
-	for (i = 0; i < num_elem; i++)
-		array[i] = NULL;
+	if (sop_pos < candidates_size) {
+		candidates[sop_pos].task = p;
+		candidates[sop_pos].size = tasksize * (long)(PAGE_SIZE / 1024);
+		candidates[sop_pos].oom = oom_score_adj;
+		candidates[sop_pos].pos = sop_pos;
+		num_candidates = sop_pos + 1;
+	} else if (sop_pos == candidates_size) {
+		lowmem_print(1, "Limit of processes: %d\n", candidates_size);
+	}
+
+	sop_pos++;
+	if ((sop_pos > (candidates_size / 4) * 3) &&
+		(sop_pos > candidates_wanted)) {
+		candidates_wanted = sop_pos;
+		schedule_work(&grow_candidates_work);
+	}
+
+	return sop_pos;
 }
 
-/* This function gets the size of each of the tasks of an array task_struct. */
-static void get_processes_size(long array_sizes[],
-		struct task_struct *array_processes[], int num_elem)
+static int candidate_size_cmp(const void *a, const void *b)
 {
-	int i;
-	int size;
+	const struct lmk_candidate *x = a;
+	const struct lmk_candidate *y = b;
 
-	for (i = 0; (i < num_elem) && (array_processes[i] != NULL); i++) {
-		size = get_mm_rss(array_processes[i]->mm);
-		array_sizes[i] = (size)*(long)(PAGE_SIZE / 1024);
-	}
+	if (x->size != y->size)
+		return x->size < y->size ? 1 : -1;
+	return x->pos - y->pos;
 }
 
-/* This function sort a task_struct array by size from largest to smallest. */
-static void process_size_sort(long array_sizes[],
-		struct task_struct *array_processes[], int num_elem)
+static int candidate_oom_cmp(const void *a, const void *b)
 {
-	int i, j;
-	long temp1;
-	struct task_struct *temp2;
-
-	for (i = 1; i < num_elem; i++) {
-		for (j = 0; (j < num_elem - 1) && (array_processes[j] != NULL);
-				j++) {
-			if (array_sizes[j] < array_sizes[j + 1]) {
-				temp1 = array_sizes[j];
-				temp2 = array_processes[j];
-
-				array_sizes[j] = array_sizes[j + 1];
-				array_processes[j] = array_processes[j + 1];
-
-				array_sizes[j + 1] = temp1;
-				array_processes[j + 1] = temp2;
-			}
-		}
-	}
+	const struct lmk_candidate *x = a;
+	const struct lmk_candidate *y = b;
+
+	if (x->oom != y->oom)
+		return x->oom < y->oom ? 1 : -1;
+	return x->pos - y->pos;
 }
 
-/* This function gets the oom of each of the tasks of an array task_struct. */
-static void get_processes_oom(short array_oom[],
-		struct task_struct *array_processes[], int num_elem)
+/* This function sort the candidates by size from largest to smallest. Only
+ * the num_candidates entries filled by the last scan are sorted, with the
+ * heapsort of lib/sort.c.
+ */
+static void process_size_sort(void)
 {
-	int i;
-	for (i = 0; (i < num_elem) && (array_processes[i] != NULL); i++)
-		array_oom[i] = array_processes[i]->signal->oom_score_adj;
+	sort(candidates, num_candidates, sizeof(candidates[0]),
+		candidate_size_cmp, NULL);
 }
 
-/* This function sort a task_struct array by oom from largest to smallest. */
-static void process_oom_sort(short array_oom[],
-		struct task_struct *array_processes[], int num_elem)
+/* This function sort the candidates by oom from largest to smallest. */
+static void process_oom_sort(void)
 {
-	int i, j;
-	short temp1;
-	struct task_struct *temp2;
-
-	for (i = 1; i < num_elem; i++) {
-		for (j = 0; (j < num_elem - 1) && (array_processes[j] != NULL);
-				j++) {
-			if (array_oom[j] < array_oom[j + 1]) {
-				temp1 = array_oom[j];
-				temp2 = array_processes[j];
-
-				array_oom[j] = array_oom[j + 1];
-				array_processes[j] = array_processes[j + 1];
-
-				array_oom[j + 1] = temp1;
-				array_processes[j + 1] = temp2;
-			}
-		}
+	sort(candidates, num_candidates, sizeof(candidates[0]),
+		candidate_oom_cmp, NULL);
+}
+
+/* Order in which the LMK kills: by oom and, within the same oom, by size,
+ * both from largest to smallest.
+ */
+static int candidate_kill_cmp(const void *a, const void *b)
+{
+	const struct lmk_candidate *x = a;
+	const struct lmk_candidate *y = b;
+
+	if (x->oom != y->oom)
+		return x->oom < y->oom ? 1 : -1;
+	return candidate_size_cmp(a, b);
+}
+
+/* Batch kill: it picks from the candidates of the last scan the victims with
+ * oom >= min_score_adj, in the order the LMK kills, until their size covers
+ * the deficit of free pages. It returns the number of victims.
+ */
+static int select_batch_victims(struct lmk_victim victims[],
+		short min_score_adj, int deficit)
+{
+	int k;
+	int nr_victims = 0;
+	long size = 0;
+
+	sort(candidates, num_candidates, sizeof(candidates[0]),
+		candidate_kill_cmp, NULL);
+
+	for (k = 0; (k < num_candidates) && (nr_victims < MAX_BATCH_KILL) &&
+			(size < deficit); k++) {
+		if (candidates[k].oom < min_score_adj)
+			break;
+		victims[nr_victims].task = candidates[k].task;
+		victims[nr_victims].tasksize = candidates[k].size /
+			(long)(PAGE_SIZE / 1024);
+		victims[nr_victims].oom_score_adj = candidates[k].oom;
+		size += victims[nr_victims].tasksize;
+		nr_victims++;
 	}
+
+	return nr_victims;
 }
 
 /* The lowmemorykiller uses the TIF_MEMDIE flag to help ensure it doesn't
@@ -380,6 +723,236 @@ static int test_task_flag(struct task_struct *p, int flag)
 
 static DEFINE_MUTEX(scan_mutex);
 
+/* The memory of a task is back: the pages the reaper has unmapped, or all of
+ * it (pages < 0) when the task is freed. Nothing to do if it is not one of
+ * our pending victims.
+ */
+static void victim_released(struct task_struct *task, long pages)
+{
+	int i;
+
+	spin_lock_bh(&lowmem_victims_lock);
+	for (i = 0; i < MAX_BATCH_KILL; i++) {
+		if (lowmem_victims[i].task != task)
+			continue;
+		lowmem_victims[i].task = NULL;
+		if (pages < 0)
+			pages = lowmem_victims[i].tasksize;
+		atomic_long_add(pages, &lowmem_freed_pages);
+		if (--lowmem_victims_pending == 0)
+			complete_all(&victim_exit);
+		break;
+	}
+	spin_unlock_bh(&lowmem_victims_lock);
+}
+
+/* Task handoff notifier, called from __put_task_struct when the task_struct
+ * is freed. That is after exit_mm, once the last reference to the task is
+ * dropped, so it can come later than the mm teardown; the reaper reports the
+ * memory earlier, and wait_victim_exit is bounded anyway. It must return
+ * NOTIFY_DONE: NOTIFY_OK would tell the kernel that we took the task_struct
+ * and it would never be freed.
+ */
+static int task_notify_func(struct notifier_block *self, unsigned long val,
+		void *data)
+{
+	victim_released(data, -1);
+
+	return NOTIFY_DONE;
+}
+
+static struct notifier_block task_nb = {
+	.notifier_call = task_notify_func,
+};
+
+/* Give the system time to free up the memory of a dying task. If our last
+ * victims are still pending we wait until their memory is back, at most
+ * VICTIM_EXIT_TIMEOUT_MS; the tasks killed by someone else are not notified,
+ * so for them the whole time is waited.
+ */
+static void wait_victim_exit(void)
+{
+	if (lowmem_victims_pending)
+		wait_for_completion_timeout(&victim_exit,
+			msecs_to_jiffies(VICTIM_EXIT_TIMEOUT_MS));
+	else
+		msleep_interruptible(VICTIM_EXIT_TIMEOUT_MS);
+}
+
+/* The reaper unmaps the private memory of a victim right away, without
+ * waiting for the victim to be scheduled and run its exit path, which is slow
+ * under memory pressure. Shared, locked and hugetlb mappings are left to the
+ * exit path, and so is a victim that holds its mmap_sem.
+ */
+/* Tell if a process that has not been killed shares the mm of the victim
+ * (CLONE_VM), or a kernel thread uses it: its pages are not ours to unmap,
+ * and the reaper leaves such an mm alone as the oom_reaper does. mm_users
+ * only counts more than the threads of the victim and our reference when
+ * somebody else has the mm, so the walk is rarely needed.
+ */
+static int mm_shared_with_live(struct task_struct *tsk, struct mm_struct *mm)
+{
+	struct task_struct *p;
+	struct task_struct *t;
+	int shared = 0;
+
+	if (atomic_read(&mm->mm_users) <= get_nr_threads(tsk) + 1)
+		return 0;
+
+	rcu_read_lock();
+	for_each_process(p) {
+		if (same_thread_group(p, tsk))
+			continue;
+		t = find_lock_task_mm(p);
+		if (!t)
+			continue;
+		if ((t->mm == mm) && ((p->flags & PF_KTHREAD) ||
+			!fatal_signal_pending(t)))
+			shared = 1;
+		task_unlock(t);
+		if (shared)
+			break;
+	}
+	rcu_read_unlock();
+
+	return shared;
+}
+
+static void reap_victim(struct task_struct *tsk)
+{
+	struct mm_struct *mm;
+	struct vm_area_struct *vma;
+	long freed;
+
+	mm = get_task_mm(tsk);
+	if (!mm)
+		goto out;
+
+	if (mm_shared_with_live(tsk, mm)) {
+		lowmem_print(2, "'%s' (%d) shares its memory, not reaped\n",
+			tsk->comm, tsk->pid);
+		mmput(mm);
+		goto out;
+	}
+
+	if (!down_read_trylock(&mm->mmap_sem)) {
+		mmput(mm);
+		goto out;
+	}
+
+	freed = get_mm_rss(mm);
+	for (vma = mm->mmap; vma; vma = vma->vm_next) {
+		if (is_vm_hugetlb_page(vma))
+			continue;
+		if (vma->vm_flags & (VM_LOCKED | VM_PFNMAP))
+			continue;
+		if (!vma->vm_file || !(vma->vm_flags & VM_SHARED))
+			zap_page_range(vma, vma->vm_start,
+				vma->vm_end - vma->vm_start, NULL);
+	}
+	freed -= get_mm_rss(mm);
+	up_read(&mm->mmap_sem);
+	mmput(mm);
+
+	lowmem_print(2, "Reaped '%s' (%d), freed %ldkB\n", tsk->comm, tsk->pid,
+		freed * (long)(PAGE_SIZE / 1024));
+
+	/* Its memory is back: the scans can ignore it from now on */
+	set_tsk_thread_flag(tsk, TIF_MM_RELEASED);
+	victim_released(tsk, freed);
+out:
+	put_task_struct(tsk);
+}
+
+static void lowmem_reap_task(struct work_struct *work)
+{
+	struct task_struct *tsk;
+
+	for (;;) {
+		spin_lock_bh(&lowmem_victims_lock);
+		tsk = nr_reap_tasks ? reap_tasks[--nr_reap_tasks] : NULL;
+		spin_unlock_bh(&lowmem_victims_lock);
+		if (!tsk)
+			break;
+		reap_victim(tsk);
+	}
+}
+
+static DECLARE_WORK(lowmem_reap_work, lowmem_reap_task);
+
+/* Start a new kill: the victims of the previous one that have not given
+ * their memory back yet are forgotten.
+ */
+static void start_kill(struct lmk_victim victims[], int nr_victims)
+{
+	int i;
+
+	spin_lock_bh(&lowmem_victims_lock);
+	INIT_COMPLETION(victim_exit);
+	atomic_long_xchg(&lowmem_freed_pages, 0);
+	for (i = 0; i < MAX_BATCH_KILL; i++)
+		lowmem_victims[i].task = NULL;
+	for (i = 0; i < nr_victims; i++)
+		lowmem_victims[i] = victims[i];
+	lowmem_victims_pending = nr_victims;
+	spin_unlock_bh(&lowmem_victims_lock);
+}
+
+/* Hand a victim, already killed, to the reaper. If the reaper is still
+ * behind with the earlier kills its queue can be full: the victim is then
+ * left to its own exit path, and the task_free notifier reports its memory.
+ */
+static void queue_reap(struct task_struct *tsk)
+{
+	int queued = 0;
+
+	spin_lock_bh(&lowmem_victims_lock);
+	if (nr_reap_tasks < MAX_BATCH_KILL) {
+		get_task_struct(tsk);
+		reap_tasks[nr_reap_tasks++] = tsk;
+		queued = 1;
+	}
+	spin_unlock_bh(&lowmem_victims_lock);
+
+	if (!queued) {
+		lowmem_print(1, "Reaper queue full, '%s' (%d) not reaped\n",
+			tsk->comm, tsk->pid);
+		return;
+	}
+	queue_work(lowmem_reaper_wq, &lowmem_reap_work);
+}
+
+/* Work that grows the table of candidates to twice the number of tasks the
+ * last scans found. The new table is allocated before taking scan_mutex,
+ * because the allocation may enter direct reclaim and call lowmem_shrink.
+ */
+static void grow_candidates(struct work_struct *work)
+{
+	struct lmk_candidate *new_candidates;
+	struct lmk_candidate *old_candidates;
+	int new_size = candidates_wanted * 2;
+
+	new_candidates = kcalloc(new_size, sizeof(*new_candidates),
+			GFP_KERNEL);
+	if (!new_candidates)
+		return;
+
+	mutex_lock(&scan_mutex);
+	if (new_size <= candidates_size) {
+		mutex_unlock(&scan_mutex);
+		kfree(new_candidates);
+		return;
+	}
+	old_candidates = candidates;
+	candidates = new_candidates;
+	candidates_size = new_size;
+	num_candidates = 0;
+	mutex_unlock(&scan_mutex);
+
+	kfree(old_candidates);
+	lowmem_print(1, "Candidate table grown to %d processes\n", new_size);
+}
+
 /* Function that show active services ordered by size from largest to smallest.
  * To do this, it obtains the tasks with positive size and negative oom.
  */
@@ -394,8 +967,7 @@ static void show_services_list(void)
 			return;
 
 	rcu_read_lock();
-	clean_array_long(size_of_process, NUM_OF_PROCESS);
-	clean_array_tasks(tasks, NUM_OF_PROCESS);
+	num_candidates = 0;
 
 	for_each_process(tsk) {
 		struct task_struct *p;
@@ -411,8 +983,7 @@ static void show_services_list(void)
 		if (time_before_eq(jiffies, lowmem_deathpending_timeout)) {
 			if (test_task_flag(tsk, TIF_MEMDIE)) {
 				rcu_read_unlock();
-				/* give the system time to free up the memory */
-				msleep_interruptible(20);
+				wait_victim_exit();
 				mutex_unlock(&scan_mutex);
 				return;
 			}
@@ -426,12 +997,8 @@ static void show_services_list(void)
 		oom_score_adj = p->signal->oom_score_adj;
 
 		if ((tasksize > 0) && (oom_score_adj < 0)) {
-			tasks[sop_pos] = p;
-			sop_pos++;
-			if (sop_pos >= NUM_OF_PROCESS) {
-				lowmem_print(1, "Limit of services\n");
-				sop_pos = 0;
-			}
+			sop_pos = add_candidate(sop_pos, p, tasksize,
+					oom_score_adj);
 		}
 		if (oom_score_adj >= 0) {
 			task_unlock(p);
@@ -442,44 +1009,68 @@ static void show_services_list(void)
 			continue;
 	}
 
-	get_processes_size(size_of_process, tasks, NUM_OF_PROCESS);
-	process_size_sort(size_of_process, tasks, NUM_OF_PROCESS);
+	process_size_sort();
 
 	lowmem_print(1, "LIST OF ACTIVES SERVICES\n");
 
-	for (k = 0; (k < (NUM_OF_PROCESS)) && (tasks[k] != NULL); k++) {
+	for (k = 0; k < num_candidates; k++) {
 		lowmem_print(1, "Service %d '%s': size(%ldkB), pid(%d), "
 			"oom_score_adj(%d)\n",
-			k, tasks[k]->comm, size_of_process[k], tasks[k]->pid,
-			tasks[k]->signal->oom_score_adj);
+			k, candidates[k].task->comm, candidates[k].size,
+			candidates[k].task->pid, candidates[k].oom);
 	}
 
 	rcu_read_unlock();
 	mutex_unlock(&scan_mutex);
 }
 
+/* Sort the candidates of the last scan by size (order 0) or by oom (order 1)
+ * and show them.
+ */
+static void print_process_list(int order)
+{
+	int k;
+
+	if (order == ORDER_SIZE) {
+		process_size_sort();
+
+		lowmem_print(1, "List of active processes\n");
+
+		for (k = 0; k < num_candidates; k++) {
+			lowmem_print(1, "Process %d '%s': size(%ldkB), "
+				"pid(%d), oom_score_adj(%d)\n",
+				k, candidates[k].task->comm, candidates[k].size,
+				candidates[k].task->pid, candidates[k].oom);
+		}
+	} else if (order == ORDER_OOM) {
+		process_oom_sort();
+
+		lowmem_print(1, "List of active processes\n");
+
+		for (k = 0; k < num_candidates; k++) {
+			lowmem_print(1, "Process %d '%s': "
+				"oom_score_adj(%d), size(%ldkB), pid(%d)\n",
+				k, candidates[k].task->comm, candidates[k].oom,
+				candidates[k].size, candidates[k].task->pid);
+		}
+	}
+}
+
 /* Function that show active processes. To do this, it obtains the tasks with
  * positive size and oom >= 0. Also, it has two parameters that allow us to
  * choose how sort tasks, by size or by oom, and if we want to display them
- * using printks or not.
+ * using printks or not. It must be called with scan_mutex held.
  */
-static void show_process_list(int order, int print)
+static void __show_process_list(int order, int print)
 {
 	int aux_count_processes = 0;
-	long aux_count = 0;
 	int tasksize;
 	int sop_pos = 0;
-	int k = 0;
 	struct task_struct *tsk;
 
-	if (mutex_lock_interruptible(&scan_mutex) < 0)
-			return;
-
 	rcu_read_lock();
-	clean_array_long(size_of_process, NUM_OF_PROCESS);
-	clean_array_long(size_foreground_processes, NUM_OF_PROCESS);
-	clean_array_short(oom_of_process, NUM_OF_PROCESS);
-	clean_array_tasks(tasks, NUM_OF_PROCESS);
+	num_candidates = 0;
+	size_foreground_max = 0;
 
 	for_each_process(tsk) {
 		struct task_struct *p;
@@ -495,9 +1086,7 @@ static void show_process_list(int order, int print)
 		if (time_before_eq(jiffies, lowmem_deathpending_timeout)) {
 			if (test_task_flag(tsk, TIF_MEMDIE)) {
 				rcu_read_unlock();
-				/* give the system time to free up the memory */
-				msleep_interruptible(20);
-				mutex_unlock(&scan_mutex);
+				wait_victim_exit();
 				return;
 			}
 		}
@@ -510,15 +1099,20 @@ static void show_process_list(int order, int print)
 		oom_score_adj = p->signal->oom_score_adj;
 
 		if ((tasksize > 0) && (oom_score_adj >= 0)) {
-			tasks[sop_pos] = p;
 			aux_count_processes = sop_pos;
-			sop_pos++;
-			if (sop_pos >= NUM_OF_PROCESS) {
-				lowmem_print(1, "Limit of processes\n");
-				sop_pos = 0;
-			}
+			sop_pos = add_candidate(sop_pos, p, tasksize,
+					oom_score_adj);
 		}
 
+		/* adapt_lmk only needs the biggest foreground process, so it
+		 * is kept here instead of sorting the list for it.
+		 */
+		if ((tasksize > 0) && (oom_score_adj == 0) &&
+			(tasksize * (long)(PAGE_SIZE / 1024) >
+				size_foreground_max))
+			size_foreground_max = tasksize *
+				(long)(PAGE_SIZE / 1024);
+
 		if (oom_score_adj < 0) {
 			task_unlock(p);
 			continue;
@@ -533,53 +1127,17 @@ static void show_process_list(int order, int print)
 	if (running_processes_last_kill == -1)
 		running_processes_last_kill = running_processes;
 
-	if (order == 0) {
-		get_processes_size(size_of_process, tasks, NUM_OF_PROCESS);
-		process_size_sort(size_of_process, tasks, NUM_OF_PROCESS);
-
-		if (print == 1) {
-			lowmem_print(1, "List of active processes\n");
-
-			for (k = 0; (k < (NUM_OF_PROCESS)) &&
-				(tasks[k] != NULL); k++) {
-				lowmem_print(1, "Process %d '%s': size(%ldkB), "
-					"pid(%d), oom_score_adj(%d)\n",
-					k, tasks[k]->comm, size_of_process[k],
-					tasks[k]->pid,
-					tasks[k]->signal->oom_score_adj);
-			}
-
-		}
-	} else if (order == 1) {
-		get_processes_oom(oom_of_process, tasks, NUM_OF_PROCESS);
-		process_oom_sort(oom_of_process, tasks, NUM_OF_PROCESS);
-
-		aux_count = 0;
-		for (k = 0; (k < (NUM_OF_PROCESS)) && (tasks[k] != NULL); k++) {
-			if (oom_of_process[k] == 0) {
-				size_foreground_processes[aux_count] =
-					(get_mm_rss(tasks[k]->mm)) *
-					(long)(PAGE_SIZE / 1024);
-				aux_count++;
-			}
-		}
-
-		if (print == 1) {
-			lowmem_print(1, "List of active processes\n");
-
-			for (k = 0; (k < (NUM_OF_PROCESS)) &&
-				(tasks[k] != NULL); k++) {
-				lowmem_print(1, "Process %d '%s': "
-					"oom_score_adj(%d), size(%ldkB), "
-					"pid(%d)\n",
-					k, tasks[k]->comm, oom_of_process[k],
-					(get_mm_rss(tasks[k]->mm)) *
-					(long)(PAGE_SIZE / 1024),
-					tasks[k]->pid);
-			}
-		}
-	}
+	/* The list is only sorted when it is going to be shown */
+	if (print == 1)
+		print_process_list(order);
 	rcu_read_unlock();
+}
+
+static void show_process_list(int order, int print)
+{
+	if (mutex_lock_interruptible(&scan_mutex) < 0)
+		return;
+	__show_process_list(order, print);
 	mutex_unlock(&scan_mutex);
 }
 
@@ -589,15 +1147,7 @@ static void show_process_list(int order, int print)
  */
 static long get_size_big_foreground_process(void)
 {
-	int k;
-	long final_size = 0;
-
-	for (k = 0; (size_foreground_processes[k] != 0); k++) {
-		if (size_foreground_processes[k] > final_size)
-			final_size = size_foreground_processes[k];
-	}
-
-	return final_size;
+	return size_foreground_max;
 }
 
 /* Get the number of active processes. It is important to execute the function
@@ -612,49 +1162,67 @@ static int get_running_processes(void)
 	return final_processes;
 }
 
-/* Get the time that the LMK takes to kill X_processes. Until it kills
- * X_processes it returns a negative time value.
+/* Get the time to kill X_processes, in ns, below which the LMK lowers the
+ * configuration or, if exit = 1, from which the rule is re-armed once it has
+ * fired with hysteresis. The thresholds are whole seconds, so 1 s is any time
+ * below 2 s.
  */
-static struct timeval get_time_kill_X_processes(int X_processes)
+static s64 get_limit_kill_X_processes(int exit)
 {
-	struct timeval result = {-1, 0};
+	if (exit)
+		return div_s64(min_time_kill_X_processes *
+			exit_percent_kill_X_processes, 100) + NSEC_PER_SEC;
 
-	int microseconds = (time_last_kill.tv_sec -
-		time_first_kill.tv_sec) * 1000000 +
-		((int)time_last_kill.tv_usec -
-		(int)time_first_kill.tv_usec);
-	int seconds = microseconds/1000000;
-	microseconds = microseconds%1000000;
+	return min_time_kill_X_processes + NSEC_PER_SEC;
+}
 
-	if ((seconds >  min_time_kill_X_processes.tv_sec) && (lmk_count > 0))
-		lmk_count = 0;
+/* Kill-rate estimator: it keeps an exponentially weighted moving average of
+ * the interval between kills, updated in O(1) on every kill with the
+ * monotonic time in ns of the kill. Intervals longer than KILL_INTERVAL_MAX
+ * are all slow for the rules, and count as KILL_INTERVAL_MAX so that a few
+ * fast kills after a pause move the average.
+ */
+static void account_kill(s64 now)
+{
+	s64 interval;
 
-	if ((lmk_count >= X_processes) && (time_first_kill.tv_sec >= 0)) {
-		result.tv_sec = seconds;
-		result.tv_usec = microseconds;
+	if (time_last_kill >= 0) {
+		interval = min(now - time_last_kill,
+				(s64)KILL_INTERVAL_MAX);
+		if (kill_interval < 0)
+			kill_interval = interval;
+		else
+			kill_interval += (interval - kill_interval) >>
+				KILL_EWMA_SHIFT;
 	}
+	time_last_kill = now;
+}
+
+/* Get the time, in ns, that the LMK takes to kill X_processes at the rate of
+ * the estimator. The interval since the last kill counts as well, so that a
+ * rate measured long ago does not fire the rules. Until it kills X_processes
+ * since the measure was restarted it returns a negative time value.
+ */
+static s64 get_time_kill_X_processes(int X_processes, s64 now)
+{
+	s64 interval = kill_interval;
+
+	if ((lmk_count < X_processes) || (kill_interval < 0))
+		return -1;
 
-	return result;
+	if (now - time_last_kill > interval)
+		interval = now - time_last_kill;
+
+	return interval * (X_processes - 1);
 }
 
-/* Get the time without the LMK has killed any process. */
-static struct timeval get_time_no_kill_processes(void)
+/* Get the time, in ns, without the LMK has killed any process. */
+static s64 get_time_no_kill_processes(s64 now)
 {
-	struct timeval result = {-1, 0};
-
-	struct timeval time_now;
-	do_gettimeofday(&time_now);
-
-	if (fail_measure == 0) {
-		int microseconds = (time_now.tv_sec -
-			time_measure_no_kill.tv_sec) * 1000000 +
-			((int)time_now.tv_usec -
-			(int)time_measure_no_kill.tv_usec);
-		result.tv_sec = microseconds/1000000;
-		result.tv_usec = microseconds%1000000;
-	}
+	if (fail_measure == 0)
+		return now - time_measure_no_kill;
 
-	return result;
+	return -1;
 }
 
 /* Get the number of new processes without the LMK has killed any process. It is
@@ -677,18 +1245,62 @@ static int get_new_processes_no_kill(void)
 	return diff_processes;
 }
 
+/* This function tells if a rule of adapt_lmk fires: when its measure reaches
+ * the enter threshold. With hysteresis = 1 it only fires when it enters, and
+ * it is re-armed when the measure drops below the exit threshold.
+ */
+static int rule_fires(int *active, long value, long enter, long exit)
+{
+	if (hysteresis != 1)
+		return value >= enter;
+
+	if (*active) {
+		if (value < exit)
+			*active = 0;
+		return 0;
+	}
+	*active = (value >= enter);
+
+	return *active;
+}
+
+/* Get the milliseconds since the minfree configuration was set. */
+static long get_ms_configuration(s64 now)
+{
+	return div_s64(now - time_init_configuration, NSEC_PER_MSEC);
+}
+
 /* Algorithm that gets parameters with the above functions, compares these
  * parameters with the thresholds defined above and reconfigure minfrees if it
  * is necessary. It is important to execute the function show_processes_list(..)
- * first because many functions require it.
+ * first because many functions require it. It must be called with scan_mutex
+ * held: it shares the measures of the rules with lowmem_scan.
  */
 static void adapt_lmk(void){
 
-	show_process_list(ORDER_OOM, NO_PRINT);
+	int changed;
+	int start_config = minfree_config;
+	int suppressed = 0;
+	int restart_kill_count = 0;
+	int restart_no_kill = 0;
+	int restart_new_processes = 0;
+	int start_big_foreground = big_foreground_active;
+	int start_running_processes = running_processes_active;
+	int start_kill_X_processes = kill_X_processes_active;
+	int start_no_kill_processes = no_kill_processes_active;
+	long ms_configuration;
+	s64 now = ktime_to_ns(ktime_get());
+	s64 seconds;
+	s32 rem;
+
+	__show_process_list(ORDER_OOM, NO_PRINT);
 
 	size_big_foreground_process = get_size_big_foreground_process();
 
-	if (size_big_foreground_process >= max_size_big_foreground_process) {
+	if (rule_fires(&big_foreground_active, size_big_foreground_process,
+			max_size_big_foreground_process,
+			max_size_big_foreground_process *
+				exit_percent_size_big_foreground_process / 100)) {
 		if (minfree_config < 5) {
 			lowmem_print(1, "size_big_foreground_process: %ld KB\n",
 				size_big_foreground_process);
@@ -701,7 +1313,10 @@ static void adapt_lmk(void){
 	} else {
 
 		running_processes = get_running_processes();
-		if (running_processes >= max_running_processes) {
+		if (rule_fires(&running_processes_active, running_processes,
+				max_running_processes,
+				max_running_processes *
+					exit_percent_running_processes / 100)) {
 			if (minfree_config > 3) {
 				lowmem_print(1, "running_processes: %d\n",
 					running_processes);
@@ -713,36 +1328,45 @@ static void adapt_lmk(void){
 			}
 		}
 
-		if ((time_first_kill.tv_sec >= 0)) {
-			time_kill_X_processes =
-				get_time_kill_X_processes(X_KILL_PROCESSES);
-
-			if ((time_kill_X_processes.tv_sec >= 0) &&
-				(time_kill_X_processes.tv_sec <=
-					min_time_kill_X_processes.tv_sec)) {
-				lowmem_print(1, "time_kill_%d_processes: %d s, "
-					"%d us\n",
-					X_KILL_PROCESSES,
-					(int)time_kill_X_processes.tv_sec,
-					(int)time_kill_X_processes.tv_usec);
-
-				lmk_count = 0;
-
-				if (minfree_config >= 2)
-					minfree_config = minfree_config - 1;
-			}
+		time_kill_X_processes =
+			get_time_kill_X_processes(X_KILL_PROCESSES, now);
+
+		if (kill_X_processes_active) {
+			if (time_kill_X_processes >=
+					get_limit_kill_X_processes(1))
+				kill_X_processes_active = 0;
+		} else if ((time_kill_X_processes >= 0) &&
+			(time_kill_X_processes <
+				get_limit_kill_X_processes(0))) {
+			lowmem_print(1, "time_kill_%d_processes: %d ms\n",
+				X_KILL_PROCESSES,
+				(int)div_s64(time_kill_X_processes,
+					NSEC_PER_MSEC));
+
+			restart_kill_count = 1;
+			kill_X_processes_active = (hysteresis == 1);
+
+			if (minfree_config >= 2)
+				minfree_config = minfree_config - 1;
 		}
 	}
 
-	time_no_kill_processes = get_time_no_kill_processes();
-	if ((time_no_kill_processes.tv_sec >= 0) &&
-			(time_no_kill_processes.tv_sec >
-			max_time_no_kill_processes.tv_sec)) {
+	time_no_kill_processes = get_time_no_kill_processes(now);
+	if (no_kill_processes_active) {
+		if ((time_no_kill_processes >= 0) &&
+			(time_no_kill_processes <
+				div_s64(max_time_no_kill_processes *
+					exit_percent_no_kill_processes, 100)))
+			no_kill_processes_active = 0;
+	} else if ((time_no_kill_processes >= 0) &&
+			(time_no_kill_processes > max_time_no_kill_processes)) {
+		seconds = div_s64_rem(time_no_kill_processes, NSEC_PER_SEC,
+				&rem);
 		lowmem_print(1, "time_no_kill_processes: %d s, %d us\n",
-			(int)time_no_kill_processes.tv_sec,
-			(int)time_no_kill_processes.tv_usec);
+			(int)seconds, rem / 1000);
 
-		do_gettimeofday(&time_measure_no_kill);
+		restart_no_kill = 1;
+		no_kill_processes_active = (hysteresis == 1);
 
 		if (minfree_config <= 6)
 			minfree_config = minfree_config + 1;
@@ -753,16 +1377,62 @@ static void adapt_lmk(void){
 		lowmem_print(1, "new_processes_no_kill: %d\n",
 			new_processes_no_kill);
 
-		running_processes_last_kill = running_processes;
+		restart_new_processes = 1;
 
 		if (minfree_config <= 6)
 			minfree_config = minfree_config + 1;
 	}
 
-	/* Update the minfree configuration */
-	if (minfree_config != last_minfree_config) {
-		configure_minfrees(minfree_config);
+	/* With hysteresis, a configuration younger than min_ms_configuration is
+	 * kept and the change the rules asked for is only logged.
+	 */
+	if ((hysteresis == 1) && (minfree_config != start_config)) {
+		ms_configuration = get_ms_configuration(now);
+		if (ms_configuration < min_ms_configuration) {
+			lowmem_print(1, "Suppressed configuration: %d -> %d "
+				"after %ld ms\n", start_config, minfree_config,
+				ms_configuration);
+			suppressed_configurations++;
+			minfree_config = start_config;
+			suppressed = 1;
+
+			/* The rules that entered now fire again later */
+			big_foreground_active = start_big_foreground;
+			running_processes_active = start_running_processes;
+			kill_X_processes_active = start_kill_X_processes;
+			no_kill_processes_active = start_no_kill_processes;
+		}
+	}
+
+	/* The measures of the rules that have fired restart only when their
+	 * change is applied: a suppressed change is asked for again later.
+	 */
+	if (!suppressed) {
+		if (restart_kill_count)
+			lmk_count = 0;
+		if (restart_no_kill)
+			time_measure_no_kill = now;
+		if (restart_new_processes)
+			running_processes_last_kill = running_processes;
+	}
+
+	/* Update the minfree configuration, or the level of the continuous
+	 * minfrees with the steps of the rules above. minfree_config then
+	 * follows the configuration of the level.
+	 */
+	if (continuous_minfree == 1) {
+		changed = minfree_control(minfree_config - start_config);
+		minfree_config = minfree_level >> LEVEL_SHIFT;
 		last_minfree_config = minfree_config;
+	} else {
+		changed = (minfree_config != last_minfree_config);
+		if (changed) {
+			configure_minfrees(minfree_config);
+			last_minfree_config = minfree_config;
+		}
+	}
+
+	if (changed) {
 		uses_no_config = 0;
 		if (ms_without_use_adapt_lmk > min_ms_without_use_adapt_lmk)
 			ms_without_use_adapt_lmk =
@@ -780,6 +1450,187 @@ static void adapt_lmk(void){
 	return;
 }
 
+/* adapt_lmk walks the whole task list, so the shrinker does not call it: it
+ * only schedules this work, and reads the minfree configuration it publishes.
+ * adapt_pending tells a run of the algorithm from a minfree_config written
+ * from outside the kernel.
+ */
+static int adapt_pending;
+
+static void adapt_lmk_work_fn(struct work_struct *work)
+{
+	mutex_lock(&scan_mutex);
+	if (adapt_pending) {
+		adapt_pending = 0;
+		adapt_lmk();
+	} else if (minfree_config != last_minfree_config) {
+		if (continuous_minfree == 1) {
+			minfree_config = clamp(minfree_config, 1, 7);
+			minfree_level = minfree_config << LEVEL_SHIFT;
+			minfree_output = minfree_level;
+			minfree_target = minfree_level;
+			configure_minfree_level(minfree_level);
+		} else {
+			configure_minfrees(minfree_config);
+		}
+		last_minfree_config = minfree_config;
+	}
+	mutex_unlock(&scan_mutex);
+}
+
+static DECLARE_WORK(adapt_lmk_work, adapt_lmk_work_fn);
+
+/* This work measures the inputs of the AAD network at boot, in process
+ * context, so the shrinker never walks the task list to get them. If a scan
+ * has already adapted the configurations with the fixed ratios, they are
+ * adapted again with the network and the current one is applied again.
+ */
+static void aad_measure_work_fn(struct work_struct *work)
+{
+	s32 in[LMK_AAD_INSIZE];
+
+	aad_measure(in);
+
+	mutex_lock(&scan_mutex);
+	memcpy(aad_in, in, sizeof(aad_in));
+	aad_measured = 1;
+	if ((aad_net == 1) && (time_init_configuration != -1) &&
+		aad_adapt_configurations()) {
+		if (continuous_minfree == 1)
+			configure_minfree_level(minfree_level);
+		else
+			configure_minfrees(last_minfree_config);
+	}
+	mutex_unlock(&scan_mutex);
+}
+
+static DECLARE_DELAYED_WORK(aad_measure_work, aad_measure_work_fn);
+
+/* psi_trigger only has effect with CONFIG_PSI and the trigger registered */
+static int psi_active(void)
+{
+#ifdef CONFIG_PSI
+	return (psi_trigger == 1) && psi_poll_trigger;
+#else
+	return 0;
+#endif
+}
+
+static void psi_register(void)
+{
+#ifdef CONFIG_PSI
+	char buf[] = PSI_POLL_TRIGGER;
+	struct psi_trigger *t;
+
+	t = psi_trigger_create(&psi_system, buf, sizeof(buf), PSI_MEM);
+	if (IS_ERR(t)) {
+		lowmem_print(1, "No PSI trigger, psi_trigger has no effect\n");
+		return;
+	}
+	psi_trigger_replace(&psi_poll_trigger, t);
+#endif
+}
+
+static void psi_unregister(void)
+{
+#ifdef CONFIG_PSI
+	psi_trigger_replace(&psi_poll_trigger, NULL);
+#endif
+}
+
+/* This function takes the memory stall samples due at now, in ns, and tells
+ * if the stall over the last PSI_SAMPLES samples reaches psi_some_ms or
+ * psi_full_ms. The samples missed while nobody sampled get the last totals
+ * seen, which keeps the stall of that time in the window. Without CONFIG_PSI
+ * there is no stall to measure.
+ */
+static int psi_update(s64 now)
+{
+#ifdef CONFIG_PSI
+	u64 some = psi_system.total[PSI_POLL][PSI_MEM_SOME];
+	u64 full = psi_system.total[PSI_POLL][PSI_MEM_FULL];
+	s64 period = PSI_POLL_MS * (s64)NSEC_PER_MSEC;
+	int missed;
+	int oldest;
+
+	if (time_psi_sample == -1) {
+		for (missed = 0; missed < PSI_SAMPLES; missed++) {
+			psi_some[missed] = some;
+			psi_full[missed] = full;
+		}
+		time_psi_sample = now;
+	}
+
+	if (now - time_psi_sample >= period) {
+		missed = div_s64(now - time_psi_sample, period) - 1;
+		missed = min(missed, PSI_SAMPLES - 1);
+		while (missed-- > 0) {
+			psi_some[(psi_sample + 1) % PSI_SAMPLES] =
+				psi_some[psi_sample];
+			psi_full[(psi_sample + 1) % PSI_SAMPLES] =
+				psi_full[psi_sample];
+			psi_sample = (psi_sample + 1) % PSI_SAMPLES;
+		}
+		psi_sample = (psi_sample + 1) % PSI_SAMPLES;
+		psi_some[psi_sample] = some;
+		psi_full[psi_sample] = full;
+		time_psi_sample = now;
+	}
+
+	oldest = (psi_sample + 1) % PSI_SAMPLES;
+	psi_pressure = some != psi_some[oldest];
+
+	return (some - psi_some[oldest] >= psi_some_ms * NSEC_PER_MSEC) ||
+		(full - psi_full[oldest] >= psi_full_ms * NSEC_PER_MSEC);
+#else
+	return 0;
+#endif
+}
+
+/* This function updates the memory stall at now, in ns, and runs adapt_lmk
+ * again when the stall crosses the thresholds. Returns if there is stall.
+ * It must be called with scan_mutex held.
+ */
+static int psi_check(s64 now)
+{
+	int stalled = psi_update(now);
+
+	if (stalled && !psi_stalled && (adaptive_LMK == 1) &&
+		(now - time_init_adapt_lmk > TIME_INIT_ADAPT * (s64)NSEC_PER_SEC)) {
+		lowmem_print(1, "Memory stall\n");
+		adapt_pending = 1;
+		schedule_work(&adapt_lmk_work);
+		time_use_adapt_lmk = now;
+	}
+	psi_stalled = stalled;
+
+	return stalled;
+}
+
+/* Samples the memory stall every PSI_POLL_MS while psi_trigger = 1 and the
+ * window holds some stall, also when the shrinker is not called. Once the
+ * window is clear it stops, and the next shrinker call arms it again.
+ */
+static void psi_sample_work_fn(struct work_struct *work)
+{
+	s64 now = ktime_to_ns(ktime_get());
+	int pressure;
+
+	if (!psi_active())
+		return;
+
+	mutex_lock(&scan_mutex);
+	psi_check(now);
+	pressure = psi_pressure;
+	mutex_unlock(&scan_mutex);
+
+	if (pressure)
+		schedule_delayed_work(to_delayed_work(work),
+				msecs_to_jiffies(PSI_POLL_MS));
+}
+
+static DECLARE_DELAYED_WORK(psi_sample_work, psi_sample_work_fn);
+
 /* In certain memory configurations there can be a large number of CMA pages
  * which are not suitable to satisfy certain memory requests. This large number
  * of unsuitable pages can cause the lowmemorykiller to not kill any tasks
@@ -968,25 +1819,41 @@ void tune_lmk_param(int *other_free, int *other_file, struct shrink_control *sc)
 	}
 }
 
-/*'sc' is passed shrink_control which includes a count 'nr_to_scan' and
- * a 'gfpmask'. It should look through the least-recently-used 'nr_to_scan'
- * entries and attempt to free them up.  It should return the number of objects
- * which remain in the cache.  If it returns -1, it means it cannot do any
- * scanning at this time (eg. there is a risk of deadlock).
- *
- * The 'gfpmask' refers to the allocation we are currently trying to fulfil.
- *
- * Note that 'shrink' will be passed nr_to_scan == 0 when the VM is querying
- * the cache size, so a fastpath for that case is appropriate.
+/* Number of objects the shrinker reports to the VM: the pages on the LRU
+ * lists, read from the per-zone counters the VM keeps up to date.
  */
-static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
+static int lowmem_lru_pages(void)
+{
+	return global_page_state(NR_ACTIVE_ANON) +
+		global_page_state(NR_ACTIVE_FILE) +
+		global_page_state(NR_INACTIVE_ANON) +
+		global_page_state(NR_INACTIVE_FILE);
+}
+
+/* Count entry point, for the nr_to_scan == 0 queries of shrink_slab (two per
+ * batch). Only the size of the cache is needed, so nothing is measured,
+ * adapted or tuned here.
+ */
+static int lowmem_count(struct shrinker *s, struct shrink_control *sc)
+{
+	int rem = lowmem_lru_pages();
+
+	lowmem_print(5, "lowmem_shrink init %lu, %x, return %d\n",
+		     sc->nr_to_scan, sc->gfp_mask, rem);
+	return rem;
+}
+
+/* Scan entry point: it updates the algorithm measures, schedules adapt_lmk
+ * and kills a process if the free memory is below the minfree levels.
+ */
+static int lowmem_scan(struct shrinker *s, struct shrink_control *sc)
 {
 	int aux_count_processes = 0;
 	struct task_struct *tsk;
 	struct task_struct *selected = NULL;
 	int rem = 0;
 	int tasksize;
-	int i, k;
+	int i;
 	int sop_pos = 0;
 	short min_score_adj = OOM_SCORE_ADJ_MAX + 1;
 	int minfree = 0;
@@ -995,75 +1862,79 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 	int array_size = ARRAY_SIZE(lowmem_adj);
 	int other_free = global_page_state(NR_FREE_PAGES) - totalreserve_pages;
 	int other_file;
-	int us;
-	int us2;
+	s64 now = ktime_to_ns(ktime_get());
+	s64 since_first_kill;
+	s32 since_first_kill_ns;
+	int stalled = 1;
+	unsigned seq;
+	struct lmk_victim victims[MAX_BATCH_KILL];
+	int nr_victims;
+	int v;
 	struct reclaim_state *reclaim_state = current->reclaim_state;
 
 	/* How many slab objects shrinker() should scan and try to reclaim */
 	unsigned long nr_to_scan = sc->nr_to_scan;
 
-	if (time_init_configuration.tv_sec == -1) {
+	if (mutex_lock_interruptible(&scan_mutex) < 0)
+		return 0;
+
+	/* now is the only clock read of the call: every time below is taken
+	 * from it. The measures of the rules are shared with adapt_lmk, so
+	 * they are only touched with scan_mutex held.
+	 */
+	if (time_init_configuration == -1) {
 		adapt_configurations();
-		do_gettimeofday(&time_init_configuration);
-		do_gettimeofday(&time_init_adapt_lmk_1);
-		do_gettimeofday(&time_last_kill);
-		do_gettimeofday(&time_measure_no_kill);
-		do_gettimeofday(&time_last_lmk_use_2);
+		time_init_configuration = now;
+		time_init_adapt_lmk = now;
+		time_measure_no_kill = now;
+		time_last_lmk_use = now;
 	}
 
-	do_gettimeofday(&time_last_lmk_use_1);
-
-	if ((time_last_lmk_use_1.tv_sec - time_last_lmk_use_2.tv_sec) >=
-		max_time_fail_measure.tv_sec) {
+	if (now - time_last_lmk_use >= max_time_fail_measure) {
 		fail_measure = 1;
-		do_gettimeofday(&time_measure_no_kill);
+		time_measure_no_kill = now;
 		lowmem_print(1, "Fail measure\n");
 	} else {
 		fail_measure = 0;
 	}
 
-	do_gettimeofday(&time_last_lmk_use_2);
-	do_gettimeofday(&time_init_adapt_lmk_2);
+	time_last_lmk_use = now;
 
 	/* It starts to call the algorithm TIME_INIT_ADAPT seconds after
 	 * the device is started. In addition, it limit the number of executions
-	 * of the algorithm, no more than 1 in max_ms_without_use_adapt_lmk.
+	 * of the algorithm, no more than 1 in ms_without_use_adapt_lmk (in us).
 	 */
-	if ((((time_init_adapt_lmk_2.tv_sec) - (time_init_adapt_lmk_1.tv_sec)) >
-		TIME_INIT_ADAPT) && (adaptive_LMK == 1)) {
+	if ((now - time_init_adapt_lmk > TIME_INIT_ADAPT * (s64)NSEC_PER_SEC) &&
+		(adaptive_LMK == 1)) {
 
-		do_gettimeofday(&time_use_adapt_lmk_1);
-
-		if (time_use_adapt_lmk_2.tv_sec == -1) {
-			adapt_lmk();
-			do_gettimeofday(&time_use_adapt_lmk_2);
+		if (time_use_adapt_lmk == -1) {
+			adapt_pending = 1;
+			schedule_work(&adapt_lmk_work);
+			time_use_adapt_lmk = now;
 		}
 
-		us2 = (time_use_adapt_lmk_1.tv_sec -
-			time_use_adapt_lmk_2.tv_sec) * 1000000 +
-			((int)time_use_adapt_lmk_1.tv_usec -
-				(int)time_use_adapt_lmk_2.tv_usec);
-
-
 		/* Exception: execute the adapt algorithm if we have killed one
 		 * process in the last execution.
 		 */
-		if ((us2 >= ms_without_use_adapt_lmk) || (kill == 1)) {
+		if ((now - time_use_adapt_lmk >=
+			ms_without_use_adapt_lmk * (s64)NSEC_PER_USEC) ||
+			(kill == 1)) {
 			kill = 0;
-			adapt_lmk();
-			do_gettimeofday(&time_use_adapt_lmk_2);
+			adapt_pending = 1;
+			schedule_work(&adapt_lmk_work);
+			time_use_adapt_lmk = now;
 		}
 
 	}
 
-	if (minfree_config != last_minfree_config) {
-		configure_minfrees(minfree_config);
-		last_minfree_config = minfree_config;
-	}
+	if (minfree_config != last_minfree_config)
+		schedule_work(&adapt_lmk_work);
 
-	if (nr_to_scan > 0) {
-		if (mutex_lock_interruptible(&scan_mutex) < 0)
-			return 0;
+	if (psi_active()) {
+		stalled = psi_check(now);
+		if (psi_pressure)
+			schedule_delayed_work(&psi_sample_work,
+					msecs_to_jiffies(PSI_POLL_MS));
 	}
 
 	if (global_page_state(NR_SHMEM) + total_swapcache_pages() <
@@ -1081,37 +1952,43 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 		array_size = lowmem_adj_size;
 	if (lowmem_minfree_size < array_size)
 		array_size = lowmem_minfree_size;
-	for (i = 0; i < array_size; i++) {
-		minfree = lowmem_minfree[i];
-		if (other_free < minfree && other_file < minfree) {
-			min_score_adj = lowmem_adj[i];
-			break;
+	do {
+		seq = read_seqbegin(&lowmem_minfree_lock);
+		min_score_adj = OOM_SCORE_ADJ_MAX + 1;
+		for (i = 0; i < array_size; i++) {
+			minfree = lowmem_minfree[i];
+			if (other_free < minfree && other_file < minfree) {
+				min_score_adj = lowmem_adj[i];
+				break;
+			}
 		}
-	}
+	} while (read_seqretry(&lowmem_minfree_lock, seq));
 
-	if (nr_to_scan > 0)
-		lowmem_print(3, "lowmem_shrink %lu, %x, ofree %d %d, ma %hd\n",
-				nr_to_scan, sc->gfp_mask, other_free,
-				other_file, min_score_adj);
-	rem = global_page_state(NR_ACTIVE_ANON) +
-		global_page_state(NR_ACTIVE_FILE) +
-		global_page_state(NR_INACTIVE_ANON) +
-		global_page_state(NR_INACTIVE_FILE);
-	if (nr_to_scan <= 0 || min_score_adj == OOM_SCORE_ADJ_MAX + 1) {
+	lowmem_print(3, "lowmem_shrink %lu, %x, ofree %d %d, ma %hd\n",
+			nr_to_scan, sc->gfp_mask, other_free,
+			other_file, min_score_adj);
+	rem = lowmem_lru_pages();
+	if (min_score_adj == OOM_SCORE_ADJ_MAX + 1) {
 		lowmem_print(5, "lowmem_shrink init %lu, %x, return %d\n",
 			     nr_to_scan, sc->gfp_mask, rem);
-
-		if (nr_to_scan > 0)
-			mutex_unlock(&scan_mutex);
-
+		mutex_unlock(&scan_mutex);
 		return rem;
 	}
 	selected_oom_score_adj = min_score_adj;
 
+	/* With psi_trigger = 1 and no memory stall, free pages below the
+	 * minfrees are not enough to kill but at the first level.
+	 */
+	if (!stalled && (i > 0)) {
+		lowmem_print(2, "lowmem_shrink no memory stall, adj %hd, "
+			     "return %d\n", min_score_adj, rem);
+		mutex_unlock(&scan_mutex);
+		return rem;
+	}
+
 	rcu_read_lock();
-	clean_array_long(size_of_process, NUM_OF_PROCESS);
-	clean_array_short(oom_of_process, NUM_OF_PROCESS);
-	clean_array_tasks(tasks, NUM_OF_PROCESS);
+
+	num_candidates = 0;
 	for_each_process(tsk) {
 		struct task_struct *p;
 		short oom_score_adj;
@@ -1126,8 +2003,7 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 		if (time_before_eq(jiffies, lowmem_deathpending_timeout)) {
 			if (test_task_flag(tsk, TIF_MEMDIE)) {
 				rcu_read_unlock();
-				/* give the system time to free up the memory */
-				msleep_interruptible(20);
+				wait_victim_exit();
 				mutex_unlock(&scan_mutex);
 				return 0;
 			}
@@ -1140,21 +2016,15 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 		tasksize = get_mm_rss(p->mm);
 		oom_score_adj = p->signal->oom_score_adj;
 		if ((tasksize > 0) && (oom_score_adj >= 0)) {
-			tasks[sop_pos] = p;
 			aux_count_processes = sop_pos;
-			sop_pos++;
-			if (sop_pos >= NUM_OF_PROCESS) {
-				lowmem_print(1, "Limit of processes\n");
-				sop_pos = 0;
-			}
-		}
-
-		if (oom_score_adj < min_score_adj) {
-			task_unlock(p);
-			continue;
+			sop_pos = add_candidate(sop_pos, p, tasksize,
+					oom_score_adj);
 		}
 
 		task_unlock(p);
+
+		if (oom_score_adj < min_score_adj)
+			continue;
 		if (tasksize <= 0)
 			continue;
 
@@ -1174,17 +2044,32 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 	running_processes = aux_count_processes;
 
 	if (selected) {
+		victims[0].task = selected;
+		victims[0].tasksize = selected_tasksize;
+		victims[0].oom_score_adj = selected_oom_score_adj;
+		nr_victims = 1;
+		if (batch_kill == 1)
+			nr_victims = select_batch_victims(victims, min_score_adj,
+				minfree - max(other_free, other_file));
+
+		lowmem_deathpending_timeout = jiffies + HZ;
+		start_kill(victims, nr_victims);
+
+		for (v = 0; v < nr_victims; v++) {
+			selected = victims[v].task;
+			selected_tasksize = victims[v].tasksize;
+			selected_oom_score_adj = victims[v].oom_score_adj;
 
-		if (lmk_count == 0)
-			do_gettimeofday(&time_first_kill);
+			if (lmk_count == 0)
+				time_first_kill = now;
+			account_kill(now);
+			since_first_kill = div_s64_rem(now - time_first_kill,
+					NSEC_PER_SEC, &since_first_kill_ns);
 
-		do_gettimeofday(&time_last_kill);
-		do_gettimeofday(&time_measure_no_kill);
-		us = (time_last_kill.tv_sec - time_first_kill.tv_sec) *
-			1000000 + ((int)time_last_kill.tv_usec -
-				(int)time_first_kill.tv_usec);
+			time_measure_no_kill = now;
+			no_kill_processes_active = 0;
 
-		lowmem_print(1, "Killing '%s' (%d), adj %hd, "
+			lowmem_print(1, "Killing '%s' (%d), adj %hd, "
 				"to free %ldkB on behalf of '%s' (%d) because "
 				"cache %ldkB is below limit %ldkB for "
 				"oom_score_adj %hd. Free memory is %ldkB above "
@@ -1200,64 +2085,33 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 				min_score_adj,
 				other_free * (long)(PAGE_SIZE / 1024),
 				lmk_count_configuration + 1,
-				time_last_kill.tv_sec -
-					time_init_configuration.tv_sec,
+				(long)div_s64(now - time_init_configuration,
+					NSEC_PER_SEC),
 				lmk_count + 1,
-				us/1000000,
-				us%1000000);
+				(int)since_first_kill,
+				since_first_kill_ns / 1000);
+
+			send_sig(SIGKILL, selected, 0);
+			set_tsk_thread_flag(selected, TIF_MEMDIE);
+			queue_reap(selected);
+			rem -= selected_tasksize;
+			lmk_count++;
+			lmk_count_configuration++;
+			test_lmk_count++;
+		}
 
 		running_processes_last_kill = running_processes;
 
-		if (order_flag == 0) {
-			get_processes_size(size_of_process, tasks,
-				NUM_OF_PROCESS);
-			process_size_sort(size_of_process, tasks,
-				NUM_OF_PROCESS);
-
-			lowmem_print(1, "List of active processes\n");
-
-			for (k = 0; (k < (NUM_OF_PROCESS)) &&
-					(tasks[k] != NULL); k++) {
-				lowmem_print(1, "Process %d '%s': size(%ldkB), "
-					"pid(%d), oom_score_adj(%d)\n",
-					k, tasks[k]->comm, size_of_process[k],
-					tasks[k]->pid,
-					tasks[k]->signal->oom_score_adj);
-			}
-
-		} else if (order_flag == 1) {
-			get_processes_oom(oom_of_process, tasks,
-				NUM_OF_PROCESS);
-			process_oom_sort(oom_of_process, tasks, NUM_OF_PROCESS);
-
-			lowmem_print(1, "List of active processes\n");
-
-			for (k = 0; (k < (NUM_OF_PROCESS)) &&
-					(tasks[k] != NULL); k++) {
-				lowmem_print(1, "Process %d '%s': "
-					"oom_score_adj(%d), size(%ldkB), "
-					"pid(%d)\n",
-					k, tasks[k]->comm, oom_of_process[k],
-					(get_mm_rss(tasks[k]->mm)) *
-						(long)(PAGE_SIZE / 1024),
-					tasks[k]->pid);
-			}
-		}
+		print_process_list(order_flag);
 
-		lowmem_deathpending_timeout = jiffies + HZ;
-		send_sig(SIGKILL, selected, 0);
-		set_tsk_thread_flag(selected, TIF_MEMDIE);
-		rem -= selected_tasksize;
 		rcu_read_unlock();
-		lmk_count++;
-		lmk_count_configuration++;
-		test_lmk_count++;
 		kill = 1;
-		/* give the system time to free up the memory */
-		msleep_interruptible(20);
+		wait_victim_exit();
 
+		/* Credit the pages the victims have actually given back */
 		if (reclaim_state && (pages_patch == 1))
-			reclaim_state->reclaimed_slab += selected_tasksize;
+			reclaim_state->reclaimed_slab +=
+				atomic_long_xchg(&lowmem_freed_pages, 0);
 
 	} else {
 		rcu_read_unlock();
@@ -1269,6 +2123,24 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 	return rem;
 }
 
+/*'sc' is passed shrink_control which includes a count 'nr_to_scan' and
+ * a 'gfpmask'. It should look through the least-recently-used 'nr_to_scan'
+ * entries and attempt to free them up.  It should return the number of objects
+ * which remain in the cache.  If it returns -1, it means it cannot do any
+ * scanning at this time (eg. there is a risk of deadlock).
+ *
+ * The 'gfpmask' refers to the allocation we are currently trying to fulfil.
+ *
+ * Note that 'shrink' will be passed nr_to_scan == 0 when the VM is querying
+ * the cache size, so a fastpath for that case is appropriate.
+ */
+static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
+{
+	if (sc->nr_to_scan == 0)
+		return lowmem_count(s, sc);
+	return lowmem_scan(s, sc);
+}
+
 static struct shrinker lowmem_shrinker = {
 	.shrink = lowmem_shrink,
 	.seeks = DEFAULT_SEEKS * 16
@@ -1276,6 +2148,22 @@ static struct shrinker lowmem_shrinker = {
 
 static int __init lowmem_init(void)
 {
+	candidates = kcalloc(NUM_OF_PROCESS, sizeof(*candidates), GFP_KERNEL);
+	if (!candidates)
+		return -ENOMEM;
+	candidates_size = NUM_OF_PROCESS;
+
+	lowmem_reaper_wq = alloc_workqueue("lmk_reaper",
+			WQ_MEM_RECLAIM | WQ_HIGHPRI, 1);
+	if (!lowmem_reaper_wq) {
+		kfree(candidates);
+		return -ENOMEM;
+	}
+
+	psi_register();
+	schedule_delayed_work(&aad_measure_work,
+			TIME_INIT_ADAPT * HZ);
+	task_handoff_register(&task_nb);
 	register_shrinker(&lowmem_shrinker);
 	return 0;
 }
@@ -1283,6 +2171,14 @@ static int __init lowmem_init(void)
 static void __exit lowmem_exit(void)
 {
 	unregister_shrinker(&lowmem_shrinker);
+	task_handoff_unregister(&task_nb);
+	destroy_workqueue(lowmem_reaper_wq);
+	cancel_work_sync(&adapt_lmk_work);
+	cancel_delayed_work_sync(&psi_sample_work);
+	cancel_delayed_work_sync(&aad_measure_work);
+	psi_unregister();
+	cancel_work_sync(&grow_candidates_work);
+	kfree(candidates);
 }
 
 #ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER_AUTODETECT_OOM_ADJ_VALUES
@@ -1408,6 +2304,17 @@ module_param_named(minfree_config, minfree_config, int,
 			S_IRUGO | S_IWUSR);
 module_param_named(adaptive_LMK, adaptive_LMK, int, S_IRUGO | S_IWUSR);
 module_param_named(pages_patch, pages_patch, int, S_IRUGO | S_IWUSR);
+module_param_named(batch_kill, batch_kill, int, S_IRUGO | S_IWUSR);
+module_param_named(aad_net, aad_net, int, S_IRUGO | S_IWUSR);
+module_param_named(continuous_minfree, continuous_minfree, int,
+			S_IRUGO | S_IWUSR);
+module_param_named(minfree_level, minfree_level, int, S_IRUGO);
+module_param_named(hysteresis, hysteresis, int, S_IRUGO | S_IWUSR);
+module_param_named(psi_trigger, psi_trigger, int, S_IRUGO | S_IWUSR);
+module_param_named(psi_some_ms, psi_some_ms, long, S_IRUGO | S_IWUSR);
+module_param_named(psi_full_ms, psi_full_ms, long, S_IRUGO | S_IWUSR);
+module_param_named(suppressed_configurations, suppressed_configurations, long,
+		S_IRUGO);
 module_param_named(test_lmk_count, test_lmk_count, long, S_IRUGO);
 module_param_named(test_running_count, test_running_count, long, S_IRUGO);
 module_param_cb(show_services_list, &lowmem_ops_services, NULL, 0644);
@@ -0,0 +1,77 @@
+/* lowmemorykiller_aad.h
+ *
+ * Generated by backprop-lmk -e, do not edit: train the network again instead.
+ * eta = 0.003000, alpha = 0.001000, c = 0.075000, 20000 epochs, epoch error 0.012333,
+ * 2160 of 2400 test patterns correctly classified.
+ *
+ * Integer-only inference of the AAD network. Inputs and outputs are in the
+ * units of the patterns (see "Explicacion patrones"), as Q16 numbers:
+ * lmk_aad_fix(x, d) is x / d.
+ */
+
+#ifndef _LOWMEMORYKILLER_AAD_H
+#define _LOWMEMORYKILLER_AAD_H
+
+#include <linux/types.h>
+#include <linux/math64.h>
+
+#define LMK_AAD_INSIZE	4
+#define LMK_AAD_HDSIZE	4
+#define LMK_AAD_OPSIZE	8
+#define LMK_AAD_Q	16
+#define LMK_AAD_ONE	(1 << LMK_AAD_Q)
+
+/* Row 0 holds the bias weights */
+static const s32 lmk_aad_w_ih[LMK_AAD_INSIZE + 1][LMK_AAD_HDSIZE] = {
+	{ 23136, -65718, -161352, 189450 },
+	{ -1944, 7461, 12231, -4041 },
+	{ 78, -298, -175, -363 },
+	{ -11793, -93452, 18867, -5475 },
+	{ 58088, -18716, 7359, -1284 },
+};
+
+static const s32 lmk_aad_w_ho[LMK_AAD_HDSIZE + 1][LMK_AAD_OPSIZE] = {
+	{ 204728, 151518, 96009, 60827,
+	 75773, 88556, 27017, 36471 },
+	{ 4021, 1506, 547, 48,
+	 417, 544, -13932, 29638 },
+	{ 373, -3681, -2091, -271,
+	 -154, -466, -34929, -2646 },
+	{ -25510, -18831, -7411, 1180,
+	 -789, -1866, 23486, 7166 },
+	{ 28213, 12183, 11705, 12330,
+	 15839, 19688, 13507, 2640 },
+};
+
+static inline s32 lmk_aad_fix(long x, int d)
+{
+	return div_s64((s64)x << LMK_AAD_Q, d);
+}
+
+static inline s32 lmk_aad_round(s64 x)
+{
+	return (s32)((x + (1 << (LMK_AAD_Q - 1))) >> LMK_AAD_Q);
+}
+
+static inline void lmk_aad_infer(const s32 in[LMK_AAD_INSIZE],
+		s32 out[LMK_AAD_OPSIZE])
+{
+	s32 hidden[LMK_AAD_HDSIZE];
+	s64 acc;
+	int i, j, k;
+
+	for (j = 0; j < LMK_AAD_HDSIZE; j++) {
+		acc = (s64)lmk_aad_w_ih[0][j] << LMK_AAD_Q;
+		for (i = 0; i < LMK_AAD_INSIZE; i++)
+			acc += (s64)lmk_aad_w_ih[i + 1][j] * in[i];
+		hidden[j] = lmk_aad_round(acc);
+	}
+	for (k = 0; k < LMK_AAD_OPSIZE; k++) {
+		acc = (s64)lmk_aad_w_ho[0][k] << LMK_AAD_Q;
+		for (j = 0; j < LMK_AAD_HDSIZE; j++)
+			acc += (s64)lmk_aad_w_ho[j + 1][k] * hidden[j];
+		out[k] = lmk_aad_round(acc);
+	}
+}
+
+#endif
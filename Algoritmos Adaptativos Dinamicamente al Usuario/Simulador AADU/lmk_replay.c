@@ -0,0 +1,803 @@
+/* lmk_replay.c
+ *
+ * Trace replay for the lowmemorykiller policies. It reads the kernel logs
+ * (the *-PK-* files of "Resultados AADU") recorded while testLightApps.sh,
+ * testMixApps.sh and testHighApps.sh were running, rebuilds from them the
+ * process population of the phone and its memory budget, and plays that
+ * workload again against the policy this program is linked with.
+ *
+ * What the logs give us:
+ *
+ *   - "List of active processes" snapshots with the name, pid, size and
+ *     oom_score_adj of every app, printed periodically and after each kill.
+ *   - "LIST OF ACTIVES SERVICES" with the resident services.
+ *   - "Killing ..." lines with the cache and free memory the recording
+ *     policy saw when it killed.
+ *
+ * The memory available to apps, free memory and page cache is estimated at
+ * every kill as free + cache + the RSS of all the listed tasks, and the
+ * median of those samples is used as the RAM of the simulated device. Page
+ * cache can be reclaimed down to 1/128 of it, so a policy with low minfree
+ * levels runs into the OOM killer instead of thrashing forever.
+ * Between two snapshots the RSS of every app is interpolated linearly; apps
+ * that show up for the first time are launched during the LAUNCH_NS before
+ * the snapshot where they appear.
+ *
+ * Apps are followed by name, not by pid, so the replayed policy is free to
+ * keep alive an app the recording policy killed. When the trace brings back
+ * an app that the replayed policy killed (it is started again with a new pid
+ * or it stops being cached), the app is launched again: it is a cold launch
+ * if it comes back as the foreground app and a restart otherwise. The same
+ * rule is applied to the kills of the recording policy to count the cold
+ * launches and restarts of the trace itself.
+ *
+ * Usage: lmk_replay [-j jobs] [-v] [-t] [-q] trace... [name=value ...]
+ *
+ *   -j  traces replayed in parallel
+ *   -v  print the kernel log of the replay of the first trace
+ *   -t  print the memory trajectory of the first trace: time, free, cache
+ *       and RSS of the apps in the replay and, at the kills of the trace,
+ *       the free memory and cache the recording policy saw (all in kB)
+ *   -q  only print the summary
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "shim/sim.h"
+
+#define MAX_APPS		256
+#define MAX_PARAMS		32
+#define MAX_JOBS		64
+#define FOREGROUND_APP_ADJ	0
+#define CACHED_APP_MIN_ADJ	529
+#define LAUNCH_NS		(2 * NSEC_PER_SEC)
+#define STEP_NS			(100 * NSEC_PER_MSEC)
+#define KILL_SNAPSHOT_NS	(10 * NSEC_PER_MSEC)
+
+enum trace_event_type {
+	TRACE_SNAPSHOT,
+	TRACE_SERVICES,
+	TRACE_KILL
+};
+
+struct trace_proc {
+	char comm[TASK_COMM_LEN];
+	pid_t pid;
+	short oom_score_adj;
+	long size_kb;
+};
+
+struct trace_event {
+	enum trace_event_type type;
+	u64 ns;
+	int first, nr;			/* TRACE_SNAPSHOT/SERVICES: procs[] */
+	struct trace_proc victim;	/* TRACE_KILL */
+	long other_free_kb;
+	long other_file_kb;
+};
+
+struct trace {
+	struct trace_event *events;
+	int nr_events, max_events;
+	struct trace_proc *procs;
+	int nr_procs, max_procs;
+};
+
+enum app_state {
+	APP_NEW,
+	APP_RUNNING,
+	APP_KILLED,		/* killed by the replayed policy */
+	APP_EXITED		/* exited by itself in the trace */
+};
+
+struct app {
+	char comm[TASK_COMM_LEN];
+	enum app_state state;
+	struct task_struct *task;
+	pid_t trace_pid;
+	pid_t trace_killed_pid;		/* pid the recording policy killed */
+	pid_t replay_killed_pid;	/* trace pid when the replay killed it */
+	int seen;			/* listed in the current snapshot */
+	short oom_score_adj;
+	long start;			/* pages at the start of the interval */
+	long target;			/* pages at the snapshot */
+	u64 launch_ns;			/* 0 if not launched in this interval */
+	int pending;			/* launch_ns not reached yet */
+};
+
+/* Result of one replay, sent from the child to the parent through a pipe */
+struct replay_result {
+	int index;
+	long trace_kills;
+	long trace_cold_launches;
+	long trace_restarts;
+	long cold_launches;
+	long restarts;
+	long config_changes;
+	long ram_kb;
+	struct sim_stats stats;
+};
+
+struct options {
+	int jobs;
+	int verbose;
+	int trajectory;
+	int quiet;
+	int nr_traces;
+	char **traces;
+	int nr_params;
+	char *params[MAX_PARAMS];
+};
+
+static struct app apps[MAX_APPS];
+static int nr_apps;
+static pid_t next_pid = 20000;
+
+/* Trace parsing */
+
+static void *grow(void *array, int *max, size_t size)
+{
+	*max = *max ? *max * 2 : 256;
+	array = realloc(array, *max * size);
+	if (!array) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	return array;
+}
+
+static struct trace_event *trace_add_event(struct trace *trace,
+		enum trace_event_type type, u64 ns)
+{
+	struct trace_event *ev;
+
+	if (trace->nr_events == trace->max_events)
+		trace->events = grow(trace->events, &trace->max_events,
+				     sizeof(*trace->events));
+	ev = &trace->events[trace->nr_events++];
+	memset(ev, 0, sizeof(*ev));
+	ev->type = type;
+	ev->ns = ns;
+	ev->first = trace->nr_procs;
+	return ev;
+}
+
+static void trace_add_proc(struct trace *trace, struct trace_event *ev,
+		const struct trace_proc *proc)
+{
+	if (trace->nr_procs == trace->max_procs)
+		trace->procs = grow(trace->procs, &trace->max_procs,
+				    sizeof(*trace->procs));
+	trace->procs[trace->nr_procs++] = *proc;
+	ev->nr++;
+}
+
+/* Both orders used by show_process_list() and the services list */
+static int parse_proc(const char *msg, struct trace_proc *proc)
+{
+	int pid, adj;
+
+	if (sscanf(msg, "%*s %*d '%15[^']': size(%ldkB), pid(%d), "
+		   "oom_score_adj(%d)", proc->comm, &proc->size_kb, &pid,
+		   &adj) == 4 ||
+	    sscanf(msg, "%*s %*d '%15[^']': oom_score_adj(%d), "
+		   "size(%ldkB), pid(%d)", proc->comm, &adj, &proc->size_kb,
+		   &pid) == 4) {
+		proc->pid = pid;
+		proc->oom_score_adj = adj;
+		return 0;
+	}
+	return -1;
+}
+
+static int parse_kill(const char *msg, struct trace_event *ev)
+{
+	struct trace_proc *victim = &ev->victim;
+	int pid, adj;
+
+	if (sscanf(msg, "Killing '%15[^']' (%d), adj %d, to free %ldkB on "
+		   "behalf of '%*[^']' (%*d) because cache %ldkB is below "
+		   "limit %*dkB for oom_score_adj %*d. Free memory is %ldkB",
+		   victim->comm, &pid, &adj, &victim->size_kb,
+		   &ev->other_file_kb, &ev->other_free_kb) != 6)
+		return -1;
+	victim->pid = pid;
+	victim->oom_score_adj = adj;
+	return 0;
+}
+
+static int trace_load(const char *path, struct trace *trace)
+{
+	struct trace_event *list = NULL, *ev;
+	struct trace_proc proc;
+	unsigned long sec, usec;
+	char line[1024];
+	const char *msg;
+	u64 ns, last_ns = 0;
+	FILE *f;
+
+	memset(trace, 0, sizeof(*trace));
+	f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "<%*d>[%lu.%lu]", &sec, &usec) != 2)
+			continue;
+		msg = strstr(line, "lowmemorykiller: ");
+		if (!msg)
+			continue;
+		msg += strlen("lowmemorykiller: ");
+
+		/* Lines are only ordered within one boot: never go back */
+		ns = max((u64)sec * NSEC_PER_SEC + usec * NSEC_PER_USEC,
+			 last_ns);
+		last_ns = ns;
+
+		if ((!strncmp(msg, "Process ", 8) ||
+		     !strncmp(msg, "Service ", 8)) && list) {
+			if (!parse_proc(msg, &proc))
+				trace_add_proc(trace, list, &proc);
+			continue;
+		}
+
+		list = NULL;
+		if (!strncmp(msg, "List of active processes", 24)) {
+			list = trace_add_event(trace, TRACE_SNAPSHOT, ns);
+		} else if (!strncmp(msg, "LIST OF ACTIVES SERVICES", 24)) {
+			list = trace_add_event(trace, TRACE_SERVICES, ns);
+		} else if (!strncmp(msg, "Killing ", 8)) {
+			ev = trace_add_event(trace, TRACE_KILL, ns);
+			if (parse_kill(msg, ev))
+				trace->nr_events--;
+		}
+	}
+
+	fclose(f);
+	return 0;
+}
+
+static long trace_list_kb(const struct trace *trace,
+		const struct trace_event *ev)
+{
+	long kb = 0;
+	int i;
+
+	for (i = 0; i < ev->nr; i++)
+		kb += trace->procs[ev->first + i].size_kb;
+	return kb;
+}
+
+static int cmp_long(const void *a, const void *b)
+{
+	long x = *(const long *)a, y = *(const long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Memory left for free pages, page cache and processes, estimated at each
+ * kill from the snapshot printed right after it and the last services list.
+ * Returns the median in kB, or 0 if the trace has no usable kill.
+ */
+static long trace_ram_kb(const struct trace *trace)
+{
+	const struct trace_event *ev, *services = NULL;
+	long *samples, ram = 0;
+	int i, n = 0;
+
+	samples = calloc(trace->nr_events + 1, sizeof(*samples));
+
+	for (i = 0; i < trace->nr_events; i++) {
+		ev = &trace->events[i];
+		if (ev->type == TRACE_SERVICES && !services)
+			services = ev;
+		if (ev->type != TRACE_KILL || i + 1 >= trace->nr_events)
+			continue;
+		if (ev[1].type != TRACE_SNAPSHOT ||
+		    ev[1].ns - ev->ns > KILL_SNAPSHOT_NS)
+			continue;
+		samples[n++] = max(ev->other_free_kb, 0L) +
+			ev->other_file_kb + trace_list_kb(trace, &ev[1]);
+	}
+
+	/* Services barely change during a test: use the first list */
+	if (n && services) {
+		qsort(samples, n, sizeof(*samples), cmp_long);
+		ram = samples[n / 2] + trace_list_kb(trace, services);
+	}
+	free(samples);
+	return ram;
+}
+
+/* Replay */
+
+static struct app *app_find(const char *comm)
+{
+	struct app *app;
+	int i;
+
+	for (i = 0; i < nr_apps; i++)
+		if (!strcmp(apps[i].comm, comm))
+			return &apps[i];
+	if (nr_apps == MAX_APPS)
+		return NULL;
+
+	app = &apps[nr_apps++];
+	memset(app, 0, sizeof(*app));
+	strncpy(app->comm, comm, TASK_COMM_LEN - 1);
+	return app;
+}
+
+static void app_exit(struct task_struct *task)
+{
+	struct app *app = task->sim_priv;
+
+	if (!app || app->task != task)
+		return;
+	app->task = NULL;
+	app->state = task->sim_exit_ns ? APP_KILLED : APP_EXITED;
+	app->replay_killed_pid = app->trace_pid;
+}
+
+static void app_spawn(struct app *app)
+{
+	app->task = sim_spawn(app->comm, next_pid++, app->oom_score_adj, 0, 0);
+	app->task->sim_priv = app;
+	app->state = APP_RUNNING;
+}
+
+/* RSS of the app at now, on its way from start to target */
+static long app_pages(const struct app *app, u64 from, u64 now, u64 end)
+{
+	long frac;
+
+	if (app->launch_ns)
+		from = app->launch_ns;
+	if (now >= end || end <= from)
+		return app->target;
+
+	/* Linear interpolation in 1/1024 steps */
+	frac = (long)(((now - from) << 10) / (end - from));
+	return app->start + (app->target - app->start) * frac / 1024;
+}
+
+static void replay_snapshot(const struct trace *trace,
+		const struct trace_event *ev, u64 from,
+		struct replay_result *res)
+{
+	const struct trace_proc *proc;
+	struct app *app;
+	u64 now, end = ev->ns;
+	long want;
+	int i, step, steps;
+
+	for (i = 0; i < nr_apps; i++)
+		apps[i].seen = 0;
+
+	for (i = 0; i < ev->nr; i++) {
+		proc = &trace->procs[ev->first + i];
+		app = app_find(proc->comm);
+		if (!app)
+			continue;
+
+		/* Two processes with the same name count as one */
+		if (app->seen) {
+			app->target += proc->size_kb / SIM_KB(1);
+			continue;
+		}
+		app->seen = 1;
+		app->target = proc->size_kb / SIM_KB(1);
+		app->oom_score_adj = proc->oom_score_adj;
+		app->launch_ns = 0;
+
+		/* The recording policy killed it and the app came back */
+		if (app->trace_killed_pid && proc->pid != app->trace_killed_pid) {
+			if (proc->oom_score_adj == FOREGROUND_APP_ADJ)
+				res->trace_cold_launches++;
+			else
+				res->trace_restarts++;
+			app->trace_killed_pid = 0;
+		}
+		app->trace_pid = proc->pid;
+
+		switch (app->state) {
+		case APP_RUNNING:
+			sim_set_oom_score_adj(app->task, app->oom_score_adj);
+			app->start = get_mm_rss(app->task->mm);
+			break;
+		case APP_KILLED:
+			/* Still the same cached process in the trace */
+			if (proc->pid == app->replay_killed_pid &&
+			    app->oom_score_adj >= CACHED_APP_MIN_ADJ)
+				break;
+			if (app->oom_score_adj == FOREGROUND_APP_ADJ)
+				res->cold_launches++;
+			else
+				res->restarts++;
+			/* fall through */
+		default:
+			app->launch_ns = max(from, end - min(end,
+						(u64)LAUNCH_NS));
+			app->launch_ns = max(app->launch_ns, (u64)1);
+			app->pending = 1;
+			app->start = 0;
+			break;
+		}
+	}
+
+	/* Gone from the trace without being killed: the app exited */
+	for (i = 0; i < nr_apps; i++) {
+		app = &apps[i];
+		if (app->seen || app->state != APP_RUNNING ||
+		    app->trace_killed_pid)
+			continue;
+		sim_exit(app->task);
+	}
+
+	steps = max((long)((end - from) / STEP_NS), 1L);
+	for (step = 1; step <= steps; step++) {
+		now = from + (end - from) * step / steps;
+
+		for (i = 0; i < nr_apps; i++) {
+			app = &apps[i];
+			if (!app->seen)
+				continue;
+			if (app->pending) {
+				if (app->launch_ns > now)
+					continue;
+				app->pending = 0;
+				app_spawn(app);
+				sim_file_add(app->target / 4);
+			}
+			if (app->state != APP_RUNNING)
+				continue;
+
+			want = app_pages(app, from, now, end);
+			if (want > get_mm_rss(app->task->mm))
+				sim_alloc(app->task,
+					  want - get_mm_rss(app->task->mm));
+			else
+				sim_free(app->task,
+					 get_mm_rss(app->task->mm) - want);
+		}
+
+		if (now > sim_now())
+			sim_advance(now - sim_now());
+	}
+}
+
+static void print_trajectory(const struct trace_event *kill)
+{
+	long rss = 0;
+	int i;
+
+	for (i = 0; i < nr_apps; i++)
+		if (apps[i].task && apps[i].task->mm)
+			rss += get_mm_rss(apps[i].task->mm);
+
+	printf("%lu.%03lu,%ld,%ld,%ld", (unsigned long)(sim_now() / NSEC_PER_SEC),
+	       (unsigned long)(sim_now() % NSEC_PER_SEC / NSEC_PER_MSEC),
+	       SIM_KB(global_page_state(NR_FREE_PAGES) - totalreserve_pages),
+	       SIM_KB(global_page_state(NR_FILE_PAGES)), SIM_KB(rss));
+	if (kill)
+		printf(",%ld,%ld\n", kill->other_free_kb, kill->other_file_kb);
+	else
+		printf(",,\n");
+}
+
+static int minfree_changed(char *last, size_t len)
+{
+	char buf[256];
+
+	sim_param_get("minfree", buf, sizeof(buf));
+	if (!strncmp(buf, last, len))
+		return 0;
+	snprintf(last, len, "%s", buf);
+	return 1;
+}
+
+static void replay(const struct options *opt, const struct trace *trace,
+		struct replay_result *res, int trajectory)
+{
+	const struct trace_event *ev, *first = NULL, *services = NULL;
+	const struct trace_event *kill = NULL;
+	const struct trace_proc *proc;
+	struct app *app;
+	char minfree[256];
+	long ram_kb, ram_pages, free_pages;
+	u64 last;
+	int i, n;
+
+	for (i = 0; i < trace->nr_events; i++) {
+		ev = &trace->events[i];
+		if (ev->type == TRACE_SERVICES && !services)
+			services = ev;
+		if (ev->type == TRACE_SNAPSHOT && !first)
+			first = ev;
+	}
+
+	ram_kb = trace_ram_kb(trace);
+	res->ram_kb = ram_kb;
+	if (!ram_kb || !first)
+		return;
+
+	/* The policy only sees the memory above totalreserve_pages, which is
+	 * 3/512 of the RAM in the shim.
+	 */
+	ram_pages = ram_kb / SIM_KB(1);
+	sim_init(ram_pages * 512 / 509, 0);
+	sim_file_min_pages = ram_pages / 128;
+	sim_exit_hook = app_exit;
+
+	for (i = 0; i < services->nr; i++) {
+		proc = &trace->procs[services->first + i];
+		sim_spawn(proc->comm, proc->pid, proc->oom_score_adj,
+			  proc->size_kb / SIM_KB(1), 0);
+	}
+
+	/* The apps of the first snapshot are already running */
+	for (i = 0; i < first->nr; i++) {
+		proc = &trace->procs[first->first + i];
+		app = app_find(proc->comm);
+		if (!app || app->state == APP_RUNNING)
+			continue;
+		app->oom_score_adj = proc->oom_score_adj;
+		app->trace_pid = proc->pid;
+		app_spawn(app);
+		sim_alloc(app->task, proc->size_kb / SIM_KB(1));
+	}
+
+	/* What is left above the high watermark is page cache */
+	free_pages = global_page_state(NR_FREE_PAGES) - totalreserve_pages -
+		high_wmark_pages(&sim_zone);
+	sim_file_add(max(free_pages, 0L));
+
+	for (n = 0; n < opt->nr_params; n++)
+		if (sim_param_set_arg(opt->params[n]))
+			fprintf(stderr, "unknown parameter '%s'\n",
+				opt->params[n]);
+
+	if (trajectory)
+		printf("time_s,free_kb,file_kb,rss_kb,trace_free_kb,"
+		       "trace_file_kb\n");
+
+	sim_advance(first->ns);
+	sim_module_load();
+	minfree_changed(minfree, sizeof(minfree));
+	last = first->ns;
+
+	for (i = first - trace->events + 1; i < trace->nr_events; i++) {
+		ev = &trace->events[i];
+		switch (ev->type) {
+		case TRACE_KILL:
+			res->trace_kills++;
+			app = app_find(ev->victim.comm);
+			if (app)
+				app->trace_killed_pid = ev->victim.pid;
+			kill = ev;
+			break;
+		case TRACE_SNAPSHOT:
+			replay_snapshot(trace, ev, last, res);
+			last = ev->ns;
+			res->config_changes += minfree_changed(minfree,
+							       sizeof(minfree));
+			if (trajectory)
+				print_trajectory(kill && ev->ns - kill->ns <=
+						 KILL_SNAPSHOT_NS ? kill : NULL);
+			kill = NULL;
+			break;
+		default:
+			break;
+		}
+	}
+
+	res->stats = sim_stats;
+}
+
+static void print_result(const struct options *opt,
+		const struct replay_result *res)
+{
+	const char *path = opt->traces[res->index];
+
+	if (!res->ram_kb) {
+		printf("%s: no kills to estimate the memory from\n", path);
+		return;
+	}
+	printf("%s: ram %ld MB, trace kills %ld (cold launches %ld, restarts "
+	       "%ld), replay kills %ld (cold launches %ld, restarts %ld), "
+	       "oom kills %ld, config changes %ld, memory stall %.1f ms\n",
+	       path, res->ram_kb / 1024, res->trace_kills,
+	       res->trace_cold_launches, res->trace_restarts, res->stats.kills,
+	       res->cold_launches, res->restarts, res->stats.oom_kills,
+	       res->config_changes, res->stats.stall_ns / 1e6);
+}
+
+struct summary {
+	int n;
+	double trace_kills, trace_cold, trace_restarts;
+	double kills, cold, restarts, oom_kills, changes, stall_ms, shrink_ms;
+};
+
+static void summary_add(struct summary *sum, const struct replay_result *res)
+{
+	if (!res->ram_kb)
+		return;
+	sum->n++;
+	sum->trace_kills += res->trace_kills;
+	sum->trace_cold += res->trace_cold_launches;
+	sum->trace_restarts += res->trace_restarts;
+	sum->kills += res->stats.kills;
+	sum->cold += res->cold_launches;
+	sum->restarts += res->restarts;
+	sum->oom_kills += res->stats.oom_kills;
+	sum->changes += res->config_changes;
+	sum->stall_ms += res->stats.stall_ns / 1e6;
+	sum->shrink_ms += res->stats.shrink_ns / 1e6;
+}
+
+static void summary_print(const struct summary *sum)
+{
+	int n = sum->n;
+
+	if (!n)
+		return;
+	printf("%d traces: trace kills %.2f (cold launches %.2f, restarts "
+	       "%.2f), replay kills %.2f (cold launches %.2f, restarts %.2f), "
+	       "oom kills %.2f, config changes %.2f, memory stall %.1f ms, "
+	       "shrinker time %.3f ms\n",
+	       n, sum->trace_kills / n, sum->trace_cold / n,
+	       sum->trace_restarts / n, sum->kills / n, sum->cold / n,
+	       sum->restarts / n, sum->oom_kills / n, sum->changes / n,
+	       sum->stall_ms / n, sum->shrink_ms / n);
+}
+
+static pid_t start_replay(const struct options *opt, int index, int *fd)
+{
+	struct replay_result res = { 0 };
+	struct trace trace;
+	int pipefd[2];
+	pid_t pid;
+
+	if (pipe(pipefd) < 0) {
+		perror("pipe");
+		exit(1);
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		exit(1);
+	}
+	if (pid == 0) {
+		close(pipefd[0]);
+		if (trace_load(opt->traces[index], &trace))
+			_exit(1);
+		if (opt->verbose && index == 0)
+			sim_set_log(stdout);
+		replay(opt, &trace, &res, opt->trajectory && index == 0);
+		res.index = index;
+		fflush(stdout);
+		if (write(pipefd[1], &res, sizeof(res)) != sizeof(res))
+			_exit(1);
+		_exit(0);
+	}
+
+	close(pipefd[1]);
+	*fd = pipefd[0];
+	return pid;
+}
+
+static int finish_replay(const struct options *opt, pid_t *pids, int *fds,
+		struct summary *sum)
+{
+	struct replay_result res;
+	int status, i;
+	pid_t pid;
+
+	do {
+		pid = wait(&status);
+	} while (pid < 0 && errno == EINTR);
+
+	for (i = 0; i < opt->jobs; i++)
+		if (pids[i] == pid)
+			break;
+	if (i == opt->jobs)
+		return -1;
+
+	if (read(fds[i], &res, sizeof(res)) == sizeof(res)) {
+		if (!opt->quiet)
+			print_result(opt, &res);
+		summary_add(sum, &res);
+	} else {
+		fprintf(stderr, "replay failed (status %d)\n", status);
+	}
+	close(fds[i]);
+	return i;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-j jobs] [-v] [-t] [-q] trace... "
+		"[name=value ...]\n", prog);
+	exit(1);
+}
+
+static void parse_options(int argc, char *argv[], struct options *opt)
+{
+	int c;
+
+	opt->jobs = 1;
+
+	while ((c = getopt(argc, argv, "j:vtq")) != -1) {
+		switch (c) {
+		case 'j':
+			opt->jobs = min(max(atoi(optarg), 1), MAX_JOBS);
+			break;
+		case 'v':
+			opt->verbose = 1;
+			break;
+		case 't':
+			opt->trajectory = 1;
+			break;
+		case 'q':
+			opt->quiet = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	/* Traces first, then the module parameters */
+	opt->traces = &argv[optind];
+	for (; optind < argc && !strchr(argv[optind], '='); optind++)
+		opt->nr_traces++;
+	for (; optind < argc && opt->nr_params < MAX_PARAMS; optind++)
+		opt->params[opt->nr_params++] = argv[optind];
+	if (!opt->nr_traces)
+		usage(argv[0]);
+
+	/* The trajectory and the log of the first trace go to stdout */
+	if (opt->verbose || opt->trajectory)
+		opt->jobs = 1;
+}
+
+int main(int argc, char *argv[])
+{
+	struct options opt = { 0 };
+	struct summary sum = { 0 };
+	pid_t pids[MAX_JOBS];
+	int fds[MAX_JOBS];
+	int started = 0, running = 0, slot;
+
+	parse_options(argc, argv, &opt);
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	for (slot = 0; slot < opt.jobs; slot++)
+		pids[slot] = 0;
+
+	while (started < opt.nr_traces || running > 0) {
+		if (started < opt.nr_traces && running < opt.jobs) {
+			for (slot = 0; pids[slot]; slot++)
+				;
+			pids[slot] = start_replay(&opt, started, &fds[slot]);
+			started++;
+			running++;
+			continue;
+		}
+		slot = finish_replay(&opt, pids, fds, &sum);
+		if (slot >= 0) {
+			pids[slot] = 0;
+			running--;
+		}
+	}
+
+	summary_print(&sum);
+	return 0;
+}
@@ -0,0 +1,491 @@
+/* lmk_sim.c
+ *
+ * Offline memory pressure simulator for the lowmemorykiller policies. The
+ * policy file (lowmemorykiller.c of one of the AADU algorithms) is linked
+ * unmodified against the kernel shim in shim/, and this program plays the
+ * role of the phone: it boots a set of services, launches apps the way the
+ * testLightApps.sh/testMixApps.sh/testHighApps.sh scripts do and lets page
+ * reclaim call the shrinker whenever free memory runs low.
+ *
+ * Every run is executed in its own forked process, so the static state of
+ * the policy starts from scratch each time and several runs can execute in
+ * parallel. A run of ~100 launches (13 minutes on a device) takes a few
+ * milliseconds.
+ *
+ * Usage: lmk_sim [-n runs] [-j jobs] [-s seed] [-w light|mix|high]
+ *                [-l launches] [-m ram_MB] [-v] [-q] [name=value ...]
+ *
+ *   -n  number of runs (each one with seed, seed + 1, ...)
+ *   -j  runs executed in parallel
+ *   -s  first random seed
+ *   -w  workload, i.e. the size of the apps that are launched
+ *   -l  app launches per run
+ *   -m  RAM of the simulated device
+ *   -v  print the kernel log of the first run (same format as dmesg)
+ *   -q  do not print one line per run, only the summary
+ *
+ * Any "name=value" argument is written to the module parameter of that name
+ * before the run starts, e.g. "adaptive_LMK=0 pages_patch=0" turns the 2.0
+ * build into the original algorithm and "minfree=1536,2048,4096,16384"
+ * changes the initial minfree table.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "shim/sim.h"
+
+#define MAX_APPS		40
+#define MAX_PARAMS		32
+#define MAX_JOBS		64
+#define FOREGROUND_APP_ADJ	0
+#define PREVIOUS_APP_ADJ	529
+#define CACHED_APP_MAX_ADJ	1000
+#define LAUNCH_STEPS		10
+#define LAUNCH_STEP_NS		(200 * NSEC_PER_MSEC)
+
+enum workload {
+	WORKLOAD_LIGHT,
+	WORKLOAD_MIX,
+	WORKLOAD_HIGH
+};
+
+struct app {
+	char comm[TASK_COMM_LEN];
+	long rss;			/* pages once fully launched */
+	pid_t pid;			/* 0 if not running */
+	int launched;
+	int lru;			/* launch order, larger is more recent */
+};
+
+struct service {
+	const char *comm;
+	short oom_score_adj;
+	int size_mb;
+};
+
+/* Result of one run, sent from the child to the parent through a pipe */
+struct sim_result {
+	unsigned int seed;
+	long launches;
+	long first_launches;
+	long warm_launches;
+	long cold_relaunches;
+	long config_changes;
+	long running_at_end;
+	struct sim_stats stats;
+};
+
+struct options {
+	int runs;
+	int jobs;
+	unsigned int seed;
+	enum workload workload;
+	int launches;
+	long ram_mb;
+	int verbose;
+	int quiet;
+	int nr_params;
+	char *params[MAX_PARAMS];
+};
+
+/* Resident services and persistent processes of the bq device used in the
+ * AADU tests, taken from its "LIST OF ACTIVES SERVICES" output.
+ */
+static const struct service services[] = {
+	{ "init", -941, 1 }, { "ueventd", -941, 1 }, { "zygote", -941, 43 },
+	{ "surfaceflinger", -941, 11 }, { "mediaserver", -941, 10 },
+	{ "rild", -941, 7 }, { "drmserver", -941, 5 }, { "netd", -941, 2 },
+	{ "vold", -941, 1 }, { "mm-qcamera-daem", -941, 5 },
+	{ "system_server", -705, 55 }, { "ndroid.systemui", -705, 55 },
+	{ "droid.launcher3", -705, 53 }, { "m.android.phone", -705, 36 },
+	{ "com.dolby", -705, 22 }, { "droid.gallery3d", -705, 20 },
+	{ ".gms.persistent", 58, 48 }, { "gle.android.gms", 294, 51 },
+	{ "e.process.gapps", 294, 41 },
+};
+
+static struct app apps[MAX_APPS];
+static int nr_apps;
+static int lru_clock;
+static pid_t next_pid = 3000;
+
+static struct app *app_by_pid(pid_t pid)
+{
+	int i;
+
+	for (i = 0; i < nr_apps; i++)
+		if (apps[i].pid == pid)
+			return &apps[i];
+	return NULL;
+}
+
+static void app_exit(struct task_struct *task)
+{
+	struct app *app = app_by_pid(task->pid);
+
+	if (app)
+		app->pid = 0;
+}
+
+static double rand_unit(void)
+{
+	return rand() / ((double)RAND_MAX + 1.0);
+}
+
+static void create_apps(enum workload workload)
+{
+	static const int min_mb[] = { 15, 15, 60 };
+	static const int max_mb[] = { 45, 190, 190 };
+	int i, size_mb;
+
+	nr_apps = 20;
+	for (i = 0; i < nr_apps; i++) {
+		size_mb = min_mb[workload] +
+			rand_unit() * (max_mb[workload] - min_mb[workload]);
+		snprintf(apps[i].comm, TASK_COMM_LEN, "com.app%02d", i);
+		apps[i].rss = SIM_MB(size_mb);
+	}
+}
+
+/* Recompute the oom_score_adj of the running apps from their LRU position,
+ * the way the ActivityManager does it: the foreground app gets 0, the
+ * previous one 529 and the cached ones climb towards 1000.
+ */
+static void update_oom_adj(struct app *foreground)
+{
+	struct task_struct *task;
+	int i, rank;
+
+	for (i = 0; i < nr_apps; i++) {
+		if (!apps[i].pid)
+			continue;
+		task = sim_find_pid(apps[i].pid);
+		if (!task)
+			continue;
+		if (&apps[i] == foreground) {
+			sim_set_oom_score_adj(task, FOREGROUND_APP_ADJ);
+			continue;
+		}
+		rank = foreground->lru - apps[i].lru;
+		sim_set_oom_score_adj(task, min(PREVIOUS_APP_ADJ +
+				59 * (rank - 1), CACHED_APP_MAX_ADJ));
+	}
+}
+
+static void launch_app(struct app *app, struct sim_result *res)
+{
+	struct task_struct *task;
+	int step;
+
+	res->launches++;
+	app->lru = ++lru_clock;
+
+	if (app->pid) {
+		res->warm_launches++;
+		update_oom_adj(app);
+		return;
+	}
+
+	if (app->launched)
+		res->cold_relaunches++;
+	else
+		res->first_launches++;
+	app->launched = 1;
+	app->pid = next_pid++;
+	task = sim_spawn(app->comm, app->pid, FOREGROUND_APP_ADJ, 0, 0);
+	update_oom_adj(app);
+
+	/* The app faults in its memory and its code during the launch */
+	for (step = 0; step < LAUNCH_STEPS && app->pid; step++) {
+		sim_alloc(task, app->rss / LAUNCH_STEPS);
+		sim_file_add(app->rss / (4 * LAUNCH_STEPS));
+		sim_advance(LAUNCH_STEP_NS);
+	}
+}
+
+static int minfree_changed(char *last, size_t len)
+{
+	char buf[256];
+
+	sim_param_get("minfree", buf, sizeof(buf));
+	if (!strncmp(buf, last, len))
+		return 0;
+	snprintf(last, len, "%s", buf);
+	return 1;
+}
+
+static void run(const struct options *opt, unsigned int seed,
+		struct sim_result *res)
+{
+	char minfree[256];
+	unsigned int i;
+	int n;
+
+	srand(seed);
+	memset(res, 0, sizeof(*res));
+	res->seed = seed;
+
+	sim_init(SIM_MB(opt->ram_mb), SIM_MB(opt->ram_mb) / 4);
+	sim_file_min_pages = SIM_MB(opt->ram_mb) / 128;
+	sim_exit_hook = app_exit;
+
+	for (i = 0; i < ARRAY_SIZE(services); i++)
+		sim_spawn(services[i].comm, 200 + i, services[i].oom_score_adj,
+			  SIM_MB(services[i].size_mb), 0);
+
+	for (n = 0; n < opt->nr_params; n++)
+		if (sim_param_set_arg(opt->params[n]))
+			fprintf(stderr, "unknown parameter '%s'\n",
+				opt->params[n]);
+
+	sim_module_load();
+	sim_advance(20 * NSEC_PER_SEC);
+	create_apps(opt->workload);
+	minfree_changed(minfree, sizeof(minfree));
+
+	for (n = 0; n < opt->launches; n++) {
+		struct app *app;
+		int k;
+
+		/* Mostly reuse a few favourite apps, sometimes open another */
+		k = rand_unit() < 0.6 ? rand() % 6 : rand() % nr_apps;
+		app = &apps[k];
+		launch_app(app, res);
+
+		/* The user plays with the app for 2 to 20 seconds */
+		sim_advance((2 + rand() % 19) * NSEC_PER_SEC);
+		sim_kswapd();
+		res->config_changes += minfree_changed(minfree,
+						       sizeof(minfree));
+	}
+
+	for (n = 0; n < nr_apps; n++)
+		res->running_at_end += apps[n].pid != 0;
+	res->stats = sim_stats;
+}
+
+static void print_result(const struct sim_result *res)
+{
+	printf("seed %u: launches %ld, first %ld, warm %ld, cold relaunches "
+	       "%ld, kills %ld (%ld MB), oom kills %ld, config changes %ld, "
+	       "running %ld, memory stall %.1f ms, shrinker calls %ld "
+	       "(%ld scans, %.3f ms)\n",
+	       res->seed, res->launches, res->first_launches,
+	       res->warm_launches, res->cold_relaunches, res->stats.kills,
+	       res->stats.killed_kb / 1024, res->stats.oom_kills,
+	       res->config_changes,
+	       res->running_at_end, res->stats.stall_ns / 1e6,
+	       res->stats.shrink_calls,
+	       res->stats.shrink_scans, res->stats.shrink_ns / 1e6);
+}
+
+struct summary {
+	int n;
+	double kills, kills2;
+	double cold, cold2;
+	double warm, oom_kills, changes, stall_ms, calls, scans, shrink_ms;
+};
+
+static void summary_add(struct summary *sum, const struct sim_result *res)
+{
+	sum->n++;
+	sum->kills += res->stats.kills;
+	sum->kills2 += (double)res->stats.kills * res->stats.kills;
+	sum->cold += res->cold_relaunches;
+	sum->cold2 += (double)res->cold_relaunches * res->cold_relaunches;
+	sum->warm += res->warm_launches;
+	sum->oom_kills += res->stats.oom_kills;
+	sum->changes += res->config_changes;
+	sum->stall_ms += res->stats.stall_ns / 1e6;
+	sum->calls += res->stats.shrink_calls;
+	sum->scans += res->stats.shrink_scans;
+	sum->shrink_ms += res->stats.shrink_ns / 1e6;
+}
+
+static double stddev(double sum, double sum2, int n)
+{
+	double mean = sum / n;
+
+	return n > 1 ? sqrt(fmax(sum2 / n - mean * mean, 0.0)) : 0.0;
+}
+
+static void summary_print(const struct summary *sum)
+{
+	int n = sum->n;
+
+	if (!n)
+		return;
+	printf("%d runs: kills %.2f (sd %.2f), cold relaunches %.2f "
+	       "(sd %.2f), warm launches %.2f, oom kills %.2f, config changes "
+	       "%.2f, memory stall %.1f ms, shrinker calls %.1f (%.1f scans), "
+	       "shrinker time %.3f ms\n",
+	       n, sum->kills / n, stddev(sum->kills, sum->kills2, n),
+	       sum->cold / n, stddev(sum->cold, sum->cold2, n),
+	       sum->warm / n, sum->oom_kills / n, sum->changes / n,
+	       sum->stall_ms / n,
+	       sum->calls / n, sum->scans / n, sum->shrink_ms / n);
+}
+
+static pid_t start_run(const struct options *opt, unsigned int seed,
+		int *fd)
+{
+	struct sim_result res;
+	int pipefd[2];
+	pid_t pid;
+
+	if (pipe(pipefd) < 0) {
+		perror("pipe");
+		exit(1);
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		exit(1);
+	}
+	if (pid == 0) {
+		close(pipefd[0]);
+		if (opt->verbose && seed == opt->seed)
+			sim_set_log(stdout);
+		run(opt, seed, &res);
+		fflush(stdout);
+		if (write(pipefd[1], &res, sizeof(res)) != sizeof(res))
+			_exit(1);
+		_exit(0);
+	}
+
+	close(pipefd[1]);
+	*fd = pipefd[0];
+	return pid;
+}
+
+static int finish_run(pid_t *pids, int *fds, int nr_jobs,
+		struct summary *sum, int quiet)
+{
+	struct sim_result res;
+	int status, i;
+	pid_t pid;
+
+	do {
+		pid = wait(&status);
+	} while (pid < 0 && errno == EINTR);
+
+	for (i = 0; i < nr_jobs; i++)
+		if (pids[i] == pid)
+			break;
+	if (i == nr_jobs)
+		return -1;
+
+	if (read(fds[i], &res, sizeof(res)) == sizeof(res)) {
+		if (!quiet)
+			print_result(&res);
+		summary_add(sum, &res);
+	} else {
+		fprintf(stderr, "run %d failed (status %d)\n", i, status);
+	}
+	close(fds[i]);
+	return i;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-n runs] [-j jobs] [-s seed] "
+		"[-w light|mix|high] [-l launches] [-m ram_MB] [-v] [-q] "
+		"[name=value ...]\n", prog);
+	exit(1);
+}
+
+static void parse_options(int argc, char *argv[], struct options *opt)
+{
+	int c;
+
+	opt->runs = 1;
+	opt->jobs = 1;
+	opt->seed = 1;
+	opt->workload = WORKLOAD_MIX;
+	opt->launches = 100;
+	opt->ram_mb = 1024;
+
+	while ((c = getopt(argc, argv, "n:j:s:w:l:m:vq")) != -1) {
+		switch (c) {
+		case 'n':
+			opt->runs = atoi(optarg);
+			break;
+		case 'j':
+			opt->jobs = min(max(atoi(optarg), 1), MAX_JOBS);
+			break;
+		case 's':
+			opt->seed = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			if (!strcmp(optarg, "light"))
+				opt->workload = WORKLOAD_LIGHT;
+			else if (!strcmp(optarg, "mix"))
+				opt->workload = WORKLOAD_MIX;
+			else if (!strcmp(optarg, "high"))
+				opt->workload = WORKLOAD_HIGH;
+			else
+				usage(argv[0]);
+			break;
+		case 'l':
+			opt->launches = atoi(optarg);
+			break;
+		case 'm':
+			opt->ram_mb = atol(optarg);
+			break;
+		case 'v':
+			opt->verbose = 1;
+			break;
+		case 'q':
+			opt->quiet = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	for (; optind < argc && opt->nr_params < MAX_PARAMS; optind++)
+		opt->params[opt->nr_params++] = argv[optind];
+	if (opt->runs <= 0 || opt->launches <= 0 || opt->ram_mb <= 0)
+		usage(argv[0]);
+}
+
+int main(int argc, char *argv[])
+{
+	struct options opt = { 0 };
+	struct summary sum = { 0 };
+	pid_t pids[MAX_JOBS];
+	int fds[MAX_JOBS];
+	int started = 0, running = 0, slot;
+
+	parse_options(argc, argv, &opt);
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	for (slot = 0; slot < opt.jobs; slot++)
+		pids[slot] = 0;
+
+	while (started < opt.runs || running > 0) {
+		if (started < opt.runs && running < opt.jobs) {
+			for (slot = 0; pids[slot]; slot++)
+				;
+			pids[slot] = start_run(&opt, opt.seed + started,
+					       &fds[slot]);
+			started++;
+			running++;
+			continue;
+		}
+		slot = finish_run(pids, fds, opt.jobs, &sum, opt.quiet);
+		if (slot >= 0) {
+			pids[slot] = 0;
+			running--;
+		}
+	}
+
+	summary_print(&sum);
+	return 0;
+}
@@ -0,0 +1,40 @@
+#!/bin/bash
+# -*- ENCODING: UTF-8 -*-
+
+# Replays the kernel logs of "Resultados AADU" against the original, 1.0 and
+# 2.0 algorithms. The logs of the three algorithms are used as workloads for
+# all of them, so each row is the average over the same 30 traces.
+#
+# Usage: ./replay.sh [light|mix|high ...] [name=value ...]
+
+results="../Resultados AADU"
+policies="original 1.0 2.0"
+workloads=""
+params=()
+
+for arg in "$@"
+do
+	case $arg in
+	*=*)
+		params+=("$arg")
+		;;
+	*)
+		workloads="$workloads $arg"
+		;;
+	esac
+done
+
+if [ -z "$workloads" ]
+then
+	workloads="light mix high"
+fi
+
+for workload in $workloads
+do
+	echo "## $workload"
+	for policy in $policies
+	do
+		echo -n "$policy: "
+		./lmk_replay-$policy -q -j "$(nproc)" "$results"/*/$workload/*-PK-*.txt "${params[@]}"
+	done
+done
@@ -0,0 +1,2 @@
+/* Userspace stand-in for <linux/time.h>, see lmk_shim.h */
+#include "../lmk_shim.h"
@@ -0,0 +1,1069 @@
+/* lmk_shim.c
+ *
+ * Simulated system behind lmk_shim.h: clock, task list, page counters,
+ * kswapd and shrink_slab(), module parameters and the few kernel services
+ * the lowmemorykiller calls (sleeps, completions, signals, notifiers,
+ * mutexes, allocations, workqueues, page unmapping, sort()).
+ *
+ * The memory model is deliberately small. Memory is split in free pages,
+ * anonymous pages (the RSS of the tasks) and page cache. Page cache is
+ * reclaimed first, down to sim_file_min_pages; from then on only the
+ * lowmemorykiller can give memory back, exactly as on the devices where the
+ * AADU logs were taken (no swap). If it does not, the OOM killer does.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "sim.h"
+
+#define SIM_MAX_PARAMS		64
+#define SIM_MAX_WORKQUEUES	4
+#define SIM_KSWAPD_PASSES	4096
+#define SIM_KSWAPD_PASS_NS	(100 * NSEC_PER_USEC)
+#define SHRINK_BATCH		128
+
+struct sim_param {
+	const char *name;
+	void *value;
+	enum sim_param_type type;
+	size_t elemsize;
+	int *num;
+	int max;
+	const struct kernel_param_ops *ops;
+};
+
+extern initcall_t sim_module_init;
+extern exitcall_t sim_module_exit;
+
+unsigned long jiffies;
+long sim_vm_stat[NR_VM_ZONE_STAT_ITEMS];
+unsigned long totalreserve_pages;
+unsigned long totalram_pages;
+struct zone sim_zone;
+struct zonelist sim_zonelist;
+struct task_struct *sim_task_list;
+struct task_struct *sim_current;
+int sim_rcu_depth;
+
+struct sim_stats sim_stats;
+struct psi_group psi_system;
+static u64 sim_psi_total[NR_PSI_STATES - 1];	/* Live stall, in ns */
+static struct psi_trigger *sim_psi_trigger;
+long sim_file_min_pages;
+u64 sim_exit_latency_ns = 10 * NSEC_PER_MSEC;
+void (*sim_kill_hook)(struct task_struct *victim);
+void (*sim_exit_hook)(struct task_struct *task);
+
+static u64 sim_clock_ns;
+static FILE *sim_log;
+static struct task_struct *sim_task_tail;
+static struct notifier_block *sim_task_free_notifier;
+static struct task_struct sim_kswapd_task;
+static struct task_struct sim_idle_task;
+static struct task_struct sim_kworker_task;
+static struct shrinker *sim_shrinker;
+static struct sim_param sim_params[SIM_MAX_PARAMS];
+static int sim_nr_params;
+static struct workqueue_struct *sim_workqueues[SIM_MAX_WORKQUEUES];
+static struct delayed_work *sim_timers;
+static struct task_struct *sim_stalled_task;
+static int sim_nr_workqueues;
+static int sim_shrinker_depth;
+static int sim_mutexes_held;
+
+static void sim_fatal(const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	fprintf(stderr, "sim: ");
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+	abort();
+}
+
+static u64 sim_host_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/* printk */
+
+void sim_set_log(FILE *log)
+{
+	sim_log = log;
+}
+
+void sim_printk(int level, const char *fmt, ...)
+{
+	va_list args;
+
+	if (!sim_log)
+		return;
+
+	fprintf(sim_log, "<%d>[%5lu.%06lu] ", level,
+		(unsigned long)(sim_clock_ns / NSEC_PER_SEC),
+		(unsigned long)(sim_clock_ns % NSEC_PER_SEC / NSEC_PER_USEC));
+	va_start(args, fmt);
+	vfprintf(sim_log, fmt, args);
+	va_end(args);
+}
+
+/* Clock */
+
+static void sim_run_timers(void);
+static void sim_run_work(void);
+
+u64 sim_now(void)
+{
+	return sim_clock_ns;
+}
+
+static void sim_reap(void)
+{
+	struct task_struct *p, *next;
+
+	for (p = sim_task_list; p; p = next) {
+		next = p->sim_next;
+		if (p->sim_exit_ns && p->sim_exit_ns <= sim_clock_ns)
+			sim_exit(p);
+	}
+}
+
+static void sim_stall(u64 ns);
+
+void sim_advance(u64 ns)
+{
+	sim_stall(ns);
+	sim_clock_ns += ns;
+	jiffies = sim_clock_ns / (NSEC_PER_SEC / HZ);
+	sim_reap();
+	sim_run_timers();
+	sim_run_work();
+}
+
+void do_gettimeofday(struct timeval *tv)
+{
+	tv->tv_sec = sim_clock_ns / NSEC_PER_SEC;
+	tv->tv_usec = sim_clock_ns % NSEC_PER_SEC / NSEC_PER_USEC;
+}
+
+ktime_t ktime_get(void)
+{
+	return sim_clock_ns;
+}
+
+void msleep(unsigned int msecs)
+{
+	sim_advance((u64)msecs * NSEC_PER_MSEC);
+}
+
+unsigned long msleep_interruptible(unsigned int msecs)
+{
+	msleep(msecs);
+	return 0;
+}
+
+unsigned long wait_for_completion_timeout(struct completion *x,
+		unsigned long timeout)
+{
+	u64 deadline = sim_clock_ns + (u64)timeout * (NSEC_PER_SEC / HZ);
+
+	while (!x->done && sim_clock_ns < deadline)
+		sim_advance(min((u64)NSEC_PER_MSEC, deadline - sim_clock_ns));
+	if (!x->done)
+		return 0;
+	if (x->done != UINT32_MAX / 2)
+		x->done--;
+	return max((deadline - sim_clock_ns) / (NSEC_PER_SEC / HZ), (u64)1);
+}
+
+/* Zones */
+
+bool zone_watermark_ok(struct zone *z, int order, unsigned long mark,
+		int classzone_idx, int alloc_flags)
+{
+	long free_pages = global_page_state(NR_FREE_PAGES);
+
+	return free_pages > (long)(mark + z->lowmem_reserve[classzone_idx]);
+}
+
+int *get_migratetype_fallbacks(int mtype)
+{
+	static int fallbacks[] = {
+		MIGRATE_RECLAIMABLE, MIGRATE_UNMOVABLE, MIGRATE_RESERVE
+	};
+
+	return fallbacks;
+}
+
+void sim_init(long ram_pages, long file_pages)
+{
+	long min_free = ram_pages / 256;
+
+	totalram_pages = ram_pages;
+	sim_zone.present_pages = ram_pages;
+	sim_zone.watermark[WMARK_MIN] = min_free;
+	sim_zone.watermark[WMARK_LOW] = min_free + min_free / 4;
+	sim_zone.watermark[WMARK_HIGH] = min_free + min_free / 2;
+	sim_zonelist._zonerefs[0].zone = &sim_zone;
+	sim_zonelist._zonerefs[0].zone_idx = ZONE_NORMAL;
+	totalreserve_pages = sim_zone.watermark[WMARK_HIGH];
+
+	sim_vm_stat[NR_FREE_PAGES] = ram_pages;
+	sim_file_add(file_pages);
+
+	strcpy(sim_idle_task.comm, "swapper/0");
+	strcpy(sim_kswapd_task.comm, "kswapd0");
+	sim_kswapd_task.pid = 94;
+	sim_kswapd_task.flags = PF_KTHREAD;
+	strcpy(sim_kworker_task.comm, "kworker/0:1");
+	sim_kworker_task.pid = 21;
+	sim_kworker_task.flags = PF_KTHREAD;
+	sim_current = &sim_idle_task;
+}
+
+/* Tasks */
+
+struct task_struct *sim_spawn(const char *comm, pid_t pid, short oom_score_adj,
+		long rss_pages, unsigned int flags)
+{
+	struct task_struct *p = calloc(1, sizeof(*p));
+
+	if (!p)
+		sim_fatal("out of memory\n");
+
+	strncpy(p->comm, comm, TASK_COMM_LEN - 1);
+	p->pid = pid;
+	p->flags = flags;
+	p->signal = &p->sim_signal;
+	p->signal->oom_score_adj = oom_score_adj;
+	p->group_leader = p;
+
+	if (sim_task_tail)
+		sim_task_tail->sim_next = p;
+	else
+		sim_task_list = p;
+	sim_task_tail = p;
+
+	if (!(flags & PF_KTHREAD)) {
+		p->mm = &p->sim_mm;
+		p->mm->mm_users.counter = 1;
+		p->mm->mmap = &p->mm->sim_vma;
+		p->mm->sim_vma.vm_mm = p->mm;
+		p->mm->sim_vma.vm_end = ~0UL;
+		sim_alloc(p, rss_pages);
+	}
+
+	return p;
+}
+
+void sim_set_oom_score_adj(struct task_struct *task, short oom_score_adj)
+{
+	task->signal->oom_score_adj = oom_score_adj;
+}
+
+struct task_struct *sim_find_pid(pid_t pid)
+{
+	struct task_struct *p;
+
+	for_each_process(p)
+		if (p->pid == pid)
+			return p;
+	return NULL;
+}
+
+void sim_exit(struct task_struct *task)
+{
+	struct task_struct **pp, *prev = NULL;
+
+	for (pp = &sim_task_list; *pp; prev = *pp, pp = &(*pp)->sim_next) {
+		if (*pp != task)
+			continue;
+		*pp = task->sim_next;
+		if (sim_task_tail == task)
+			sim_task_tail = prev;
+		break;
+	}
+
+	if (task->mm) {
+		sim_vm_stat[NR_ACTIVE_ANON] -= task->mm->rss;
+		sim_vm_stat[NR_FREE_PAGES] += task->mm->rss;
+		task->mm->rss = 0;
+		task->mm = NULL;
+	}
+	set_tsk_thread_flag(task, TIF_MM_RELEASED);
+
+	/* Like profile_handoff_task: a notifier that answers NOTIFY_OK has taken
+	 * the task_struct and the kernel would not free it.
+	 */
+	if (sim_task_free_notifier &&
+	    sim_task_free_notifier->notifier_call(sim_task_free_notifier,
+				0, task) == NOTIFY_OK)
+		sim_fatal("the task handoff notifier took task %d\n", task->pid);
+
+	/* The task_struct itself is never freed: callers may still hold it
+	 * (a task can be killed while it allocates) and a run is short lived.
+	 */
+	if (sim_exit_hook)
+		sim_exit_hook(task);
+}
+
+int send_sig(int sig, struct task_struct *p, int priv)
+{
+	if (sig != SIGKILL || p->sim_exit_ns)
+		return 0;
+
+	p->sim_exit_ns = sim_clock_ns + sim_exit_latency_ns;
+	sim_stats.kills++;
+	sim_stats.killed_kb += p->mm ? SIM_KB(p->mm->rss) : 0;
+	if (sim_kill_hook)
+		sim_kill_hook(p);
+	return 0;
+}
+
+int task_handoff_register(struct notifier_block *n)
+{
+	if (sim_task_free_notifier)
+		sim_fatal("only one task handoff notifier is supported\n");
+	sim_task_free_notifier = n;
+	return 0;
+}
+
+int task_handoff_unregister(struct notifier_block *n)
+{
+	if (sim_task_free_notifier == n)
+		sim_task_free_notifier = NULL;
+	return 0;
+}
+
+int current_is_kswapd(void)
+{
+	return current == &sim_kswapd_task;
+}
+
+/* Locking */
+
+int mutex_lock_interruptible(struct mutex *lock)
+{
+	mutex_lock(lock);
+	return 0;
+}
+
+void mutex_lock(struct mutex *lock)
+{
+	if (lock->locked)
+		sim_fatal("deadlock: %s taken twice\n", lock->name);
+	lock->locked = 1;
+	sim_mutexes_held++;
+}
+
+void mutex_unlock(struct mutex *lock)
+{
+	if (!lock->locked)
+		sim_fatal("%s released while not held\n", lock->name);
+	lock->locked = 0;
+	sim_mutexes_held--;
+}
+
+void spin_lock(spinlock_t *lock)
+{
+	if (lock->locked)
+		sim_fatal("deadlock: spinlock taken twice\n");
+	lock->locked = 1;
+}
+
+void spin_unlock(spinlock_t *lock)
+{
+	if (!lock->locked)
+		sim_fatal("spinlock released while not held\n");
+	lock->locked = 0;
+}
+
+/* Memory and reclaim */
+
+void sim_file_add(long pages)
+{
+	pages = min(pages, sim_vm_stat[NR_FREE_PAGES]);
+	sim_vm_stat[NR_FREE_PAGES] -= pages;
+	sim_vm_stat[NR_FILE_PAGES] += pages;
+	sim_vm_stat[NR_INACTIVE_FILE] += pages;
+}
+
+static long sim_file_reclaim(long pages)
+{
+	long reclaimable = sim_vm_stat[NR_FILE_PAGES] - sim_file_min_pages;
+
+	pages = min(pages, max(reclaimable, 0L));
+	sim_vm_stat[NR_FILE_PAGES] -= pages;
+	sim_vm_stat[NR_INACTIVE_FILE] -= pages;
+	sim_vm_stat[NR_FREE_PAGES] += pages;
+	return pages;
+}
+
+/* One reclaim pass over the LRU followed by shrink_slab(), as done by both
+ * kswapd (balance_pgdat) and direct reclaim (do_try_to_free_pages).
+ */
+static long sim_reclaim_pass(void)
+{
+	struct reclaim_state reclaim_state = { 0 };
+	unsigned long lru_pages;
+	long nr_reclaimed;
+
+	current->reclaim_state = &reclaim_state;
+	nr_reclaimed = sim_file_reclaim(SWAP_CLUSTER_MAX);
+	lru_pages = global_page_state(NR_ACTIVE_ANON) +
+		global_page_state(NR_INACTIVE_ANON) +
+		global_page_state(NR_ACTIVE_FILE) +
+		global_page_state(NR_INACTIVE_FILE);
+	sim_shrink_slab(SWAP_CLUSTER_MAX, lru_pages);
+	nr_reclaimed += reclaim_state.reclaimed_slab;
+	sim_stats.reclaimed_slab += reclaim_state.reclaimed_slab;
+	current->reclaim_state = NULL;
+
+	sim_advance(SIM_KSWAPD_PASS_NS);
+	return nr_reclaimed;
+}
+
+static void sim_reclaim(struct task_struct *task, unsigned long target)
+{
+	struct task_struct *saved = sim_current;
+	long free_before;
+	int pass;
+
+	sim_current = task;
+	for (pass = 0; pass < SIM_KSWAPD_PASSES; pass++) {
+		if (global_page_state(NR_FREE_PAGES) > target)
+			break;
+		free_before = global_page_state(NR_FREE_PAGES);
+		sim_reclaim_pass();
+		/* Nothing left to reclaim and nobody is exiting */
+		if (global_page_state(NR_FREE_PAGES) <= free_before &&
+		    sim_vm_stat[NR_FILE_PAGES] <= sim_file_min_pages &&
+		    pass > 64)
+			break;
+	}
+	sim_current = saved;
+}
+
+void sim_kswapd(void)
+{
+	if (global_page_state(NR_FREE_PAGES) > low_wmark_pages(&sim_zone))
+		return;
+
+	sim_stats.kswapd_runs++;
+	sim_reclaim(&sim_kswapd_task, high_wmark_pages(&sim_zone));
+}
+
+/* Last resort when reclaim cannot make room: the kernel OOM killer. The
+ * victim is the task with the largest RSS weighted by its oom_score_adj, and
+ * its memory is released right away.
+ */
+static void sim_out_of_memory(void)
+{
+	struct task_struct *p, *victim = NULL;
+	long points, victim_points = 0;
+
+	for_each_process(p) {
+		if ((p->flags & PF_KTHREAD) || !p->mm || p->sim_exit_ns ||
+		    p->signal->oom_score_adj == OOM_SCORE_ADJ_MIN)
+			continue;
+		points = p->mm->rss + (long)p->signal->oom_score_adj *
+			(long)sim_zone.present_pages / 1000;
+		if (points > victim_points) {
+			victim = p;
+			victim_points = points;
+		}
+	}
+	if (!victim)
+		sim_fatal("out of memory and no killable task\n");
+
+	sim_stats.oom_kills++;
+	victim->sim_exit_ns = sim_clock_ns;
+	sim_exit(victim);
+}
+
+/* Direct reclaim stalls the allocating task: the time it takes is PSI
+ * memory stall, accounted as the clock moves. The PSI_AVGS totals catch up
+ * with it every PSI_FREQ_NS, like the averaging work of the kernel.
+ */
+static void sim_stall(u64 ns)
+{
+	struct task_struct *task = sim_stalled_task;
+	static u64 next_avgs_ns = PSI_FREQ_NS;
+
+	if (sim_clock_ns + ns >= next_avgs_ns) {
+		memcpy(psi_system.total[PSI_AVGS], sim_psi_total,
+			sizeof(sim_psi_total));
+		next_avgs_ns = (sim_clock_ns + ns) / PSI_FREQ_NS * PSI_FREQ_NS +
+			PSI_FREQ_NS;
+	}
+
+	if (!task)
+		return;
+
+	sim_stats.stall_ns += ns;
+	sim_psi_total[PSI_MEM_SOME] += ns;
+	if (task->signal->oom_score_adj == 0)
+		sim_psi_total[PSI_MEM_FULL] += ns;
+	if (sim_psi_trigger)
+		memcpy(psi_system.total[PSI_POLL], sim_psi_total,
+			sizeof(sim_psi_total));
+}
+
+struct psi_trigger {
+	enum psi_res res;
+};
+
+struct psi_trigger *psi_trigger_create(struct psi_group *group, char *buf,
+		size_t nbytes, enum psi_res res)
+{
+	struct psi_trigger *t;
+
+	if (group != &psi_system || sim_psi_trigger)
+		return ERR_PTR(-EBUSY);
+	t = malloc(sizeof(*t));
+	if (!t)
+		return ERR_PTR(-ENOMEM);
+	t->res = res;
+	return t;
+}
+
+void psi_trigger_replace(void **trigger_ptr, struct psi_trigger *t)
+{
+	free(*trigger_ptr);
+	*trigger_ptr = t;
+	sim_psi_trigger = t;
+	if (t)
+		memcpy(psi_system.total[PSI_POLL], sim_psi_total,
+			sizeof(sim_psi_total));
+}
+
+long sim_alloc(struct task_struct *task, long pages)
+{
+	long got;
+
+	if (sim_vm_stat[NR_FREE_PAGES] - pages < (long)min_wmark_pages(&sim_zone)) {
+		sim_stats.direct_reclaims++;
+		sim_stalled_task = task;
+		sim_reclaim(task, min_wmark_pages(&sim_zone) + pages);
+		sim_stalled_task = NULL;
+		if (sim_vm_stat[NR_FREE_PAGES] < pages)
+			sim_out_of_memory();
+	}
+
+	/* The allocating task may have been killed while reclaiming */
+	if (task && !task->mm)
+		return 0;
+
+	got = min(pages, max(sim_vm_stat[NR_FREE_PAGES], 0L));
+	sim_vm_stat[NR_FREE_PAGES] -= got;
+	sim_vm_stat[NR_ACTIVE_ANON] += got;
+	if (task)
+		task->mm->rss += got;
+	sim_stats.alloc_failures += pages - got;
+
+	sim_kswapd();
+	return got;
+}
+
+static void sim_mm_free(struct mm_struct *mm, long pages)
+{
+	pages = min(pages, mm->rss);
+	mm->rss -= pages;
+	sim_vm_stat[NR_ACTIVE_ANON] -= pages;
+	sim_vm_stat[NR_FREE_PAGES] += pages;
+}
+
+void sim_free(struct task_struct *task, long pages)
+{
+	if (task->mm)
+		sim_mm_free(task->mm, pages);
+}
+
+struct mm_struct *get_task_mm(struct task_struct *task)
+{
+	if (!task->mm)
+		return NULL;
+	task->mm->mm_users.counter++;
+	return task->mm;
+}
+
+void mmput(struct mm_struct *mm)
+{
+	mm->mm_users.counter--;
+}
+
+void zap_page_range(struct vm_area_struct *vma, unsigned long address,
+		unsigned long size, struct zap_details *details)
+{
+	sim_stats.reaped += min((long)(size >> PAGE_SHIFT), vma->vm_mm->rss);
+	sim_mm_free(vma->vm_mm, size >> PAGE_SHIFT);
+}
+
+/* Memory allocation */
+
+void *kmalloc(size_t size, gfp_t flags)
+{
+	return malloc(size);
+}
+
+void *kcalloc(size_t n, size_t size, gfp_t flags)
+{
+	return calloc(n, size);
+}
+
+void kfree(const void *p)
+{
+	free((void *)p);
+}
+
+/* Workqueues */
+
+static struct workqueue_struct sim_system_wq = { .name = "events" };
+struct workqueue_struct *system_wq = &sim_system_wq;
+
+struct workqueue_struct *alloc_workqueue(const char *fmt, unsigned int flags,
+		int max_active, ...)
+{
+	struct workqueue_struct *wq;
+
+	if (sim_nr_workqueues >= SIM_MAX_WORKQUEUES)
+		sim_fatal("too many workqueues\n");
+	wq = calloc(1, sizeof(*wq));
+	if (!wq)
+		return NULL;
+	wq->name = fmt;
+	wq->flags = flags;
+	sim_workqueues[sim_nr_workqueues++] = wq;
+	return wq;
+}
+
+void destroy_workqueue(struct workqueue_struct *wq)
+{
+	int i;
+
+	flush_workqueue(wq);
+	for (i = 0; i < sim_nr_workqueues; i++) {
+		if (sim_workqueues[i] == wq) {
+			sim_workqueues[i] = sim_workqueues[--sim_nr_workqueues];
+			break;
+		}
+	}
+	free(wq);
+}
+
+bool queue_work(struct workqueue_struct *wq, struct work_struct *work)
+{
+	struct work_struct **pp;
+
+	if (work->sim_pending)
+		return false;
+
+	work->sim_pending = true;
+	work->sim_next = NULL;
+	work->sim_wq = wq;
+	for (pp = &wq->sim_list; *pp; pp = &(*pp)->sim_next)
+		;
+	*pp = work;
+	return true;
+}
+
+bool cancel_work_sync(struct work_struct *work)
+{
+	struct work_struct **pp;
+
+	if (!work->sim_pending)
+		return false;
+
+	for (pp = &work->sim_wq->sim_list; *pp; pp = &(*pp)->sim_next) {
+		if (*pp != work)
+			continue;
+		*pp = work->sim_next;
+		break;
+	}
+	work->sim_pending = false;
+	return true;
+}
+
+/* Runs the pending work of a workqueue in the context of a kworker */
+void flush_workqueue(struct workqueue_struct *wq)
+{
+	struct task_struct *saved = sim_current;
+	struct work_struct *work;
+
+	sim_current = &sim_kworker_task;
+	while ((work = wq->sim_list)) {
+		wq->sim_list = work->sim_next;
+		work->sim_pending = false;
+		work->func(work);
+	}
+	sim_current = saved;
+}
+
+bool schedule_delayed_work(struct delayed_work *dwork, unsigned long delay)
+{
+	if (dwork->sim_armed || dwork->work.sim_pending)
+		return false;
+
+	dwork->sim_expires = jiffies + delay;
+	dwork->sim_armed = true;
+	dwork->sim_next = sim_timers;
+	sim_timers = dwork;
+	return true;
+}
+
+bool cancel_delayed_work_sync(struct delayed_work *dwork)
+{
+	struct delayed_work **pp;
+	bool armed = dwork->sim_armed;
+
+	for (pp = &sim_timers; *pp; pp = &(*pp)->sim_next) {
+		if (*pp != dwork)
+			continue;
+		*pp = dwork->sim_next;
+		break;
+	}
+	dwork->sim_armed = false;
+	return cancel_work_sync(&dwork->work) || armed;
+}
+
+/* Queues the delayed work whose timer has expired */
+static void sim_run_timers(void)
+{
+	struct delayed_work **pp = &sim_timers;
+	struct delayed_work *dwork;
+
+	while ((dwork = *pp)) {
+		if (!time_after_eq(jiffies, dwork->sim_expires)) {
+			pp = &dwork->sim_next;
+			continue;
+		}
+		*pp = dwork->sim_next;
+		dwork->sim_armed = false;
+		queue_work(system_wq, &dwork->work);
+	}
+}
+
+static void sim_run_work(void)
+{
+	int i;
+
+	for (i = 0; i < sim_nr_workqueues; i++)
+		if (sim_workqueues[i]->flags & WQ_MEM_RECLAIM)
+			flush_workqueue(sim_workqueues[i]);
+
+	/* The driver sleeps with scan_mutex held: a kworker needing it would
+	 * block until the sleeper is done, so run the work after that.
+	 */
+	if (!sim_shrinker_depth && !sim_mutexes_held)
+		flush_workqueue(system_wq);
+}
+
+/* Heapsort of lib/sort.c */
+
+static void sim_generic_swap(void *a, void *b, int size)
+{
+	char t;
+
+	do {
+		t = *(char *)a;
+		*(char *)a++ = *(char *)b;
+		*(char *)b++ = t;
+	} while (--size > 0);
+}
+
+void sort(void *base, size_t num, size_t size,
+	  int (*cmp)(const void *, const void *),
+	  void (*swap)(void *, void *, int size))
+{
+	/* pre-scale counters for performance */
+	int i = (num / 2 - 1) * size, n = num * size, c, r;
+
+	if (!swap)
+		swap = sim_generic_swap;
+
+	/* heapify */
+	for (; i >= 0; i -= size) {
+		for (r = i; r * 2 + size < n; r = c) {
+			c = r * 2 + size;
+			if (c < n - size &&
+			    cmp((char *)base + c, (char *)base + c + size) < 0)
+				c += size;
+			if (cmp((char *)base + r, (char *)base + c) >= 0)
+				break;
+			swap((char *)base + r, (char *)base + c, size);
+		}
+	}
+
+	/* sort */
+	for (i = n - size; i > 0; i -= size) {
+		swap(base, (char *)base + i, size);
+		for (r = 0; r * 2 + size < i; r = c) {
+			c = r * 2 + size;
+			if (c < i - size &&
+			    cmp((char *)base + c, (char *)base + c + size) < 0)
+				c += size;
+			if (cmp((char *)base + r, (char *)base + c) >= 0)
+				break;
+			swap((char *)base + r, (char *)base + c, size);
+		}
+	}
+}
+
+/* Shrinker */
+
+void register_shrinker(struct shrinker *shrinker)
+{
+	sim_shrinker = shrinker;
+}
+
+void unregister_shrinker(struct shrinker *shrinker)
+{
+	if (sim_shrinker == shrinker)
+		sim_shrinker = NULL;
+}
+
+static int sim_do_shrink(struct shrink_control *sc, unsigned long nr_to_scan)
+{
+	u64 start = sim_host_ns();
+	int ret;
+
+	sc->nr_to_scan = nr_to_scan;
+	sim_stats.shrink_calls++;
+	if (nr_to_scan)
+		sim_stats.shrink_scans++;
+	sim_shrinker_depth++;
+	ret = sim_shrinker->shrink(sim_shrinker, sc);
+	sim_shrinker_depth--;
+	sim_stats.shrink_ns += sim_host_ns() - start;
+
+	if (sim_rcu_depth)
+		sim_fatal("shrinker returned inside an RCU read section\n");
+	return ret;
+}
+
+/* Userspace copy of shrink_slab() from the AADU 2.0 vmscan.c */
+unsigned long sim_shrink_slab(unsigned long nr_pages_scanned,
+		unsigned long lru_pages)
+{
+	struct shrink_control sc = { .gfp_mask = 0 };
+	unsigned long ret = 0;
+	unsigned long long delta;
+	long total_scan, pages_got, max_pass, batch_size;
+	int shrink_ret;
+
+	if (!sim_shrinker)
+		return 0;
+	if (nr_pages_scanned == 0)
+		nr_pages_scanned = SWAP_CLUSTER_MAX;
+	batch_size = sim_shrinker->batch ? sim_shrinker->batch : SHRINK_BATCH;
+
+	max_pass = sim_do_shrink(&sc, 0);
+	if (max_pass <= 0)
+		return 0;
+
+	total_scan = sim_shrinker->nr_in_batch;
+	sim_shrinker->nr_in_batch = 0;
+	delta = (4 * nr_pages_scanned) / sim_shrinker->seeks;
+	delta *= max_pass;
+	delta /= lru_pages + 1;
+	total_scan += delta;
+	if (total_scan < 0)
+		total_scan = max_pass;
+	if (delta < (unsigned long long)max_pass / 4)
+		total_scan = min(total_scan, max_pass / 2);
+	if (total_scan > max_pass * 2)
+		total_scan = max_pass * 2;
+
+	while (total_scan >= batch_size) {
+		int nr_before;
+
+		nr_before = sim_do_shrink(&sc, 0);
+		shrink_ret = sim_do_shrink(&sc, batch_size);
+		if (shrink_ret == -1)
+			break;
+		if (shrink_ret < nr_before) {
+			pages_got = nr_before - shrink_ret;
+			ret += pages_got;
+			total_scan -= pages_got > batch_size ?
+				pages_got : batch_size;
+		} else {
+			total_scan -= batch_size;
+		}
+	}
+
+	if (total_scan > 0)
+		sim_shrinker->nr_in_batch += total_scan;
+	return ret;
+}
+
+/* Module loading and parameters */
+
+int sim_module_load(void)
+{
+	return sim_module_init();
+}
+
+void sim_module_unload(void)
+{
+	sim_module_exit();
+}
+
+void sim_param_register(const char *name, void *value,
+		enum sim_param_type type, size_t elemsize, int *num, int max,
+		const struct kernel_param_ops *ops)
+{
+	struct sim_param *param;
+
+	if (sim_nr_params >= SIM_MAX_PARAMS)
+		sim_fatal("too many module parameters\n");
+
+	param = &sim_params[sim_nr_params++];
+	param->name = name;
+	param->value = value;
+	param->type = type;
+	param->elemsize = elemsize;
+	param->num = num;
+	param->max = max;
+	param->ops = ops;
+}
+
+static struct sim_param *sim_param_find(const char *name)
+{
+	int i;
+
+	for (i = 0; i < sim_nr_params; i++)
+		if (!strcmp(sim_params[i].name, name))
+			return &sim_params[i];
+	return NULL;
+}
+
+static void sim_param_store(struct sim_param *param, int idx, long val)
+{
+	char *elem = (char *)param->value + idx * param->elemsize;
+
+	switch (param->type) {
+	case SIM_PARAM_short:
+		*(short *)elem = val;
+		break;
+	case SIM_PARAM_long:
+		*(long *)elem = val;
+		break;
+	case SIM_PARAM_bool:
+		*(bool *)elem = val;
+		break;
+	default:
+		*(int *)elem = val;
+		break;
+	}
+}
+
+static long sim_param_load(struct sim_param *param, int idx)
+{
+	char *elem = (char *)param->value + idx * param->elemsize;
+
+	switch (param->type) {
+	case SIM_PARAM_short:
+		return *(short *)elem;
+	case SIM_PARAM_long:
+		return *(long *)elem;
+	case SIM_PARAM_bool:
+		return *(bool *)elem;
+	case SIM_PARAM_uint:
+		return *(unsigned int *)elem;
+	default:
+		return *(int *)elem;
+	}
+}
+
+int sim_param_set(const char *name, const char *val)
+{
+	struct sim_param *param = sim_param_find(name);
+	struct kernel_param kp;
+	char *end;
+	int n = 0;
+
+	if (!param)
+		return -1;
+
+	switch (param->type) {
+	case SIM_PARAM_cb:
+		if (!param->ops->set)
+			return -1;
+		kp.name = param->name;
+		kp.ops = param->ops;
+		kp.arg = param->value;
+		return param->ops->set(val, &kp);
+	case SIM_PARAM_charp:
+		strncpy(param->value, val, param->elemsize - 1);
+		return 0;
+	default:
+		break;
+	}
+
+	do {
+		if (n >= param->max)
+			return -1;
+		sim_param_store(param, n++, strtol(val, &end, 0));
+		if (end == val)
+			return -1;
+		val = end + (*end == ',');
+	} while (*end == ',');
+
+	if (param->num)
+		*param->num = n;
+	return 0;
+}
+
+int sim_param_get(const char *name, char *buf, size_t len)
+{
+	struct sim_param *param = sim_param_find(name);
+	struct kernel_param kp;
+	size_t off = 0;
+	int i, n;
+
+	if (!param)
+		return -1;
+
+	switch (param->type) {
+	case SIM_PARAM_cb:
+		if (!param->ops->get)
+			return -1;
+		kp.name = param->name;
+		kp.ops = param->ops;
+		kp.arg = param->value;
+		return param->ops->get(buf, &kp);
+	case SIM_PARAM_charp:
+		snprintf(buf, len, "%s", (char *)param->value);
+		return 0;
+	default:
+		break;
+	}
+
+	n = param->num ? *param->num : 1;
+	buf[0] = '\0';
+	for (i = 0; i < n && off < len; i++)
+		off += snprintf(buf + off, len - off, "%s%ld", i ? "," : "",
+				sim_param_load(param, i));
+	return 0;
+}
+
+/* Parses "name=value" as given on the command line of the simulators */
+int sim_param_set_arg(const char *arg)
+{
+	char name[64];
+	const char *eq = strchr(arg, '=');
+
+	if (!eq || eq - arg >= (long)sizeof(name))
+		return -1;
+	memcpy(name, arg, eq - arg);
+	name[eq - arg] = '\0';
+	return sim_param_set(name, eq + 1);
+}
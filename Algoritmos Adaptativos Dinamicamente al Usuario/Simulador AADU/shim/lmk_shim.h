@@ -0,0 +1,749 @@
+/* lmk_shim.h
+ *
+ * Minimal userspace stand-in for the kernel interfaces used by
+ * drivers/misc/lowmemorykiller.c. Every <linux/...> header included by the
+ * driver resolves to this file, so the policy code of the AADU algorithms is
+ * compiled unmodified and runs against a simulated system: a list of tasks
+ * with their RSS and oom_score_adj, a global page counter table and a
+ * simulated clock that only moves forward when the simulator (or a sleep in
+ * the driver) says so.
+ *
+ * Only what the driver needs is modelled. There is a single memory zone
+ * (ZONE_NORMAL), one thread per process, no CMA pages and no swap.
+ */
+
+#ifndef _LMK_SHIM_H
+#define _LMK_SHIM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/time.h>
+
+/* Basic types and compiler helpers */
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int32_t s32;
+typedef int64_t s64;
+typedef unsigned int gfp_t;
+
+#define __init
+#define __exit
+#define likely(x)	__builtin_expect(!!(x), 1)
+#define unlikely(x)	__builtin_expect(!!(x), 0)
+
+#define ARRAY_SIZE(arr)	(sizeof(arr) / sizeof((arr)[0]))
+
+#define container_of(ptr, type, member)	\
+	((type *)((char *)(ptr) - offsetof(type, member)))
+
+#define min(x, y) ({				\
+	typeof(x) _min1 = (x);			\
+	typeof(y) _min2 = (y);			\
+	_min1 < _min2 ? _min1 : _min2; })
+
+#define max(x, y) ({				\
+	typeof(x) _max1 = (x);			\
+	typeof(y) _max2 = (y);			\
+	_max1 > _max2 ? _max1 : _max2; })
+
+#define clamp(val, lo, hi)	min(max(val, lo), hi)
+
+#define abs(x) ({				\
+	typeof(x) _abs = (x);			\
+	_abs < 0 ? -_abs : _abs; })
+
+static inline s64 div_s64(s64 dividend, s32 divisor)
+{
+	return dividend / divisor;
+}
+
+static inline s64 div_s64_rem(s64 dividend, s32 divisor, s32 *remainder)
+{
+	*remainder = dividend % divisor;
+	return dividend / divisor;
+}
+
+/* printk */
+
+#define KBUILD_MODNAME "lowmemorykiller"
+
+#ifndef pr_fmt
+#define pr_fmt(fmt) fmt
+#endif
+
+#define pr_info(fmt, ...)	sim_printk(6, pr_fmt(fmt), ##__VA_ARGS__)
+#define pr_err(fmt, ...)	sim_printk(3, pr_fmt(fmt), ##__VA_ARGS__)
+
+void sim_printk(int level, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+/* Time */
+
+#define HZ 100
+#define NSEC_PER_USEC	1000L
+#define NSEC_PER_MSEC	1000000L
+#define NSEC_PER_SEC	1000000000L
+#define USEC_PER_SEC	1000000L
+
+extern unsigned long jiffies;
+
+#define time_after(a, b)	((long)((b) - (a)) < 0)
+#define time_before(a, b)	time_after(b, a)
+#define time_after_eq(a, b)	((long)((a) - (b)) >= 0)
+#define time_before_eq(a, b)	time_after_eq(b, a)
+
+void do_gettimeofday(struct timeval *tv);
+
+typedef s64 ktime_t;
+
+ktime_t ktime_get(void);
+
+static inline s64 ktime_to_ns(ktime_t kt)
+{
+	return kt;
+}
+
+#define ktime_sub(a, b)		((a) - (b))
+void msleep(unsigned int msecs);
+unsigned long msleep_interruptible(unsigned int msecs);
+
+static inline unsigned long msecs_to_jiffies(unsigned int m)
+{
+	return (m + (1000 / HZ) - 1) / (1000 / HZ);
+}
+
+/* Memory counters */
+
+#define PAGE_SHIFT	12
+#define PAGE_SIZE	(1UL << PAGE_SHIFT)
+
+enum zone_stat_item {
+	NR_FREE_PAGES,
+	NR_INACTIVE_ANON,
+	NR_ACTIVE_ANON,
+	NR_INACTIVE_FILE,
+	NR_ACTIVE_FILE,
+	NR_FILE_PAGES,
+	NR_SHMEM,
+	NR_FREE_CMA_PAGES,
+	NR_VM_ZONE_STAT_ITEMS
+};
+
+extern long sim_vm_stat[NR_VM_ZONE_STAT_ITEMS];
+extern unsigned long totalreserve_pages;
+extern unsigned long totalram_pages;
+
+static inline unsigned long global_page_state(enum zone_stat_item item)
+{
+	long x = sim_vm_stat[item];
+
+	return x < 0 ? 0 : x;
+}
+
+static inline unsigned long total_swapcache_pages(void)
+{
+	return 0;
+}
+
+/* Zones: a single ZONE_NORMAL holding all the memory */
+
+enum zone_type {
+	ZONE_NORMAL,
+	ZONE_MOVABLE,
+	MAX_NR_ZONES
+};
+
+enum zone_watermarks {
+	WMARK_MIN,
+	WMARK_LOW,
+	WMARK_HIGH,
+	NR_WMARK
+};
+
+struct zone {
+	unsigned long watermark[NR_WMARK];
+	unsigned long lowmem_reserve[MAX_NR_ZONES];
+	unsigned long present_pages;
+};
+
+struct zoneref {
+	struct zone *zone;
+	int zone_idx;
+};
+
+struct zonelist {
+	struct zoneref _zonerefs[MAX_NR_ZONES + 1];
+};
+
+extern struct zone sim_zone;
+extern struct zonelist sim_zonelist;
+
+#define min_wmark_pages(z)	((z)->watermark[WMARK_MIN])
+#define low_wmark_pages(z)	((z)->watermark[WMARK_LOW])
+#define high_wmark_pages(z)	((z)->watermark[WMARK_HIGH])
+
+#define KSWAPD_ZONE_BALANCE_GAP_RATIO	100
+#define SWAP_CLUSTER_MAX		32UL
+
+#define zone_page_state(zone, item)	((void)(zone), global_page_state(item))
+#define zone_idx(zone)			((void)(zone), ZONE_NORMAL)
+#define zonelist_zone_idx(zref)		((zref)->zone_idx)
+#define node_zonelist(nid, flags)	((void)(nid), (void)(flags), \
+					 &sim_zonelist)
+#define gfp_zone(flags)			((void)(flags), ZONE_NORMAL)
+
+#define for_each_zone_zonelist(zone, z, zlist, highidx)		\
+	for ((z) = &(zlist)->_zonerefs[0];				\
+	     ((zone) = (z)->zone) != NULL && (z)->zone_idx <= (highidx);\
+	     (z)++)
+
+static inline struct zoneref *first_zones_zonelist(struct zonelist *zonelist,
+		enum zone_type highest_zoneidx, void *nodes,
+		struct zone **zone)
+{
+	*zone = zonelist->_zonerefs[0].zone;
+	return &zonelist->_zonerefs[0];
+}
+
+bool zone_watermark_ok(struct zone *z, int order, unsigned long mark,
+		int classzone_idx, int alloc_flags);
+#define zone_watermark_ok_safe zone_watermark_ok
+
+/* Migrate types (CMA is never used in the simulation) */
+
+enum {
+	MIGRATE_UNMOVABLE,
+	MIGRATE_RECLAIMABLE,
+	MIGRATE_MOVABLE,
+	MIGRATE_RESERVE,
+	MIGRATE_CMA,
+	MIGRATE_TYPES
+};
+
+#define is_migrate_cma(migratetype)	((migratetype) == MIGRATE_CMA)
+#define allocflags_to_migratetype(gfp)	((void)(gfp), MIGRATE_MOVABLE)
+
+int *get_migratetype_fallbacks(int mtype);
+
+/* Tasks */
+
+#define TASK_COMM_LEN		16
+#define PF_KTHREAD		0x00200000
+
+#define TIF_MEMDIE		18
+#define TIF_MM_RELEASED		19
+
+#define SIGKILL			9
+
+#define OOM_DISABLE		(-17)
+#define OOM_ADJUST_MAX		15
+#define OOM_SCORE_ADJ_MIN	(-1000)
+#define OOM_SCORE_ADJ_MAX	1000
+
+/* Every mm has a single anonymous mapping holding all its resident pages */
+
+#define VM_SHARED	0x00000008
+#define VM_LOCKED	0x00002000
+#define VM_PFNMAP	0x00000400
+
+struct file;
+struct mm_struct;
+
+struct vm_area_struct {
+	struct mm_struct *vm_mm;
+	unsigned long vm_start;
+	unsigned long vm_end;
+	unsigned long vm_flags;
+	struct file *vm_file;
+	struct vm_area_struct *vm_next;
+};
+
+struct rw_semaphore {
+	int count;
+};
+
+/* Atomics: plain integers on a single simulated CPU, see also below */
+typedef struct {
+	int counter;
+} atomic_t;
+
+#define atomic_read(v)		((v)->counter)
+
+struct mm_struct {
+	long rss;			/* resident pages */
+	struct vm_area_struct *mmap;
+	struct rw_semaphore mmap_sem;
+	atomic_t mm_users;
+
+	/* Simulator bookkeeping */
+	struct vm_area_struct sim_vma;
+};
+
+#define is_vm_hugetlb_page(vma)	((void)(vma), 0)
+
+static inline int down_read_trylock(struct rw_semaphore *sem)
+{
+	if (sem->count < 0)
+		return 0;
+	sem->count++;
+	return 1;
+}
+
+static inline void up_read(struct rw_semaphore *sem)
+{
+	sem->count--;
+}
+
+struct zap_details;
+
+void zap_page_range(struct vm_area_struct *vma, unsigned long address,
+		unsigned long size, struct zap_details *details);
+
+struct signal_struct {
+	short oom_score_adj;
+};
+
+struct reclaim_state {
+	unsigned long reclaimed_slab;
+};
+
+struct task_struct {
+	char comm[TASK_COMM_LEN];
+	pid_t pid;
+	unsigned int flags;
+	unsigned long thread_flags;
+	struct mm_struct *mm;
+	struct signal_struct *signal;
+	struct reclaim_state *reclaim_state;
+	struct task_struct *group_leader;
+
+	/* Simulator bookkeeping */
+	struct task_struct *sim_next;
+	struct mm_struct sim_mm;
+	struct signal_struct sim_signal;
+	u64 sim_exit_ns;		/* 0 if no SIGKILL is pending */
+	void *sim_priv;
+};
+
+extern struct task_struct *sim_task_list;
+extern struct task_struct *sim_current;
+
+#define current			sim_current
+#define for_each_process(p)	\
+	for ((p) = sim_task_list; (p) != NULL; (p) = (p)->sim_next)
+#define while_each_thread(g, t)	while (0)
+
+#define thread_group_leader(p)	((p)->group_leader == (p))
+#define same_thread_group(p1, p2)	((p1)->group_leader == (p2)->group_leader)
+#define get_nr_threads(p)	((void)(p), 1)
+#define fatal_signal_pending(p)	((p)->sim_exit_ns != 0)
+
+#define task_lock(p)		((void)(p))
+#define task_unlock(p)		((void)(p))
+
+static inline int test_tsk_thread_flag(struct task_struct *tsk, int flag)
+{
+	return (tsk->thread_flags >> flag) & 1;
+}
+
+static inline void set_tsk_thread_flag(struct task_struct *tsk, int flag)
+{
+	tsk->thread_flags |= 1UL << flag;
+}
+
+static inline struct task_struct *find_lock_task_mm(struct task_struct *p)
+{
+	return p->mm ? p : NULL;
+}
+
+static inline unsigned long get_mm_rss(struct mm_struct *mm)
+{
+	return mm->rss;
+}
+
+/* Tasks are never freed during a run, so references are not counted */
+#define get_task_struct(p)	((void)(p))
+#define put_task_struct(p)	((void)(p))
+
+struct mm_struct *get_task_mm(struct task_struct *task);
+void mmput(struct mm_struct *mm);
+
+int current_is_kswapd(void);
+int send_sig(int sig, struct task_struct *p, int priv);
+
+/* Locking: the simulation is single threaded, locks only check nesting */
+
+struct mutex {
+	int locked;
+	const char *name;
+};
+
+#define DEFINE_MUTEX(mutexname) \
+	struct mutex mutexname = { 0, #mutexname }
+
+int mutex_lock_interruptible(struct mutex *lock);
+void mutex_lock(struct mutex *lock);
+void mutex_unlock(struct mutex *lock);
+
+extern int sim_rcu_depth;
+
+#define rcu_read_lock()		(sim_rcu_depth++)
+#define rcu_read_unlock()	(sim_rcu_depth--)
+
+/* Completions: waiting moves the simulated clock until the completion is
+ * signalled (by a task exiting, for instance) or the timeout expires.
+ */
+
+struct completion {
+	unsigned int done;
+};
+
+#define COMPLETION_INITIALIZER(work)	{ 0 }
+#define DECLARE_COMPLETION(work) \
+	struct completion work = COMPLETION_INITIALIZER(work)
+#define INIT_COMPLETION(x)	((x).done = 0)
+
+static inline void init_completion(struct completion *x)
+{
+	x->done = 0;
+}
+
+static inline void complete(struct completion *x)
+{
+	x->done++;
+}
+
+static inline void complete_all(struct completion *x)
+{
+	x->done = UINT32_MAX / 2;
+}
+
+static inline bool completion_done(struct completion *x)
+{
+	return x->done != 0;
+}
+
+unsigned long wait_for_completion_timeout(struct completion *x,
+		unsigned long timeout);
+
+/* Spinlocks: only nesting is checked, as for mutexes */
+
+typedef struct {
+	int locked;
+} spinlock_t;
+
+#define DEFINE_SPINLOCK(x)	spinlock_t x = { 0 }
+
+void spin_lock(spinlock_t *lock);
+void spin_unlock(spinlock_t *lock);
+
+/* There are no softirqs to keep out */
+#define spin_lock_bh(lock)	spin_lock(lock)
+#define spin_unlock_bh(lock)	spin_unlock(lock)
+
+/* Seqlocks: one CPU, so readers never see a write in progress; the
+ * sequence still moves so that read_seqretry() behaves as in the kernel.
+ */
+
+typedef struct {
+	unsigned sequence;
+} seqlock_t;
+
+#define DEFINE_SEQLOCK(x)	seqlock_t x = { 0 }
+
+static inline void write_seqlock(seqlock_t *sl)
+{
+	sl->sequence++;
+}
+
+static inline void write_sequnlock(seqlock_t *sl)
+{
+	sl->sequence++;
+}
+
+static inline unsigned read_seqbegin(const seqlock_t *sl)
+{
+	return sl->sequence & ~1u;
+}
+
+static inline unsigned read_seqretry(const seqlock_t *sl, unsigned start)
+{
+	return sl->sequence != start;
+}
+
+/* Atomics: plain integers on a single simulated CPU */
+
+#define xchg(ptr, v)	__atomic_exchange_n((ptr), (v), __ATOMIC_SEQ_CST)
+
+typedef struct {
+	long counter;
+} atomic_long_t;
+
+#define ATOMIC_LONG_INIT(i)	{ (i) }
+
+static inline long atomic_long_read(const atomic_long_t *v)
+{
+	return v->counter;
+}
+
+static inline void atomic_long_add(long i, atomic_long_t *v)
+{
+	v->counter += i;
+}
+
+static inline long atomic_long_xchg(atomic_long_t *v, long n)
+{
+	long old = v->counter;
+
+	v->counter = n;
+	return old;
+}
+
+/* Memory allocation */
+
+#define GFP_KERNEL		0x000000d0u
+#define GFP_NOWAIT		0x00000000u
+
+void *kmalloc(size_t size, gfp_t flags);
+void *kcalloc(size_t n, size_t size, gfp_t flags);
+void kfree(const void *p);
+
+/* Workqueues. Pending work on the system workqueue runs the next time the
+ * simulated clock moves outside the shrinker and with no mutex held, as a
+ * kworker would once the shrinker returns. Work on a WQ_MEM_RECLAIM queue has
+ * to make progress during reclaim, so it runs at every move of the clock and
+ * must not take the locks the shrinker holds.
+ */
+
+#define WQ_HIGHPRI		(1 << 4)
+#define WQ_MEM_RECLAIM		(1 << 3)
+
+struct work_struct;
+typedef void (*work_func_t)(struct work_struct *work);
+
+struct workqueue_struct {
+	const char *name;
+	unsigned int flags;
+	struct work_struct *sim_list;
+};
+
+struct work_struct {
+	work_func_t func;
+	bool sim_pending;
+	struct work_struct *sim_next;
+	struct workqueue_struct *sim_wq;
+};
+
+#define __WORK_INITIALIZER(n, f)	{ .func = (f) }
+#define DECLARE_WORK(n, f)	struct work_struct n = __WORK_INITIALIZER(n, f)
+#define INIT_WORK(_work, _func)	(*(_work) = (struct work_struct) \
+					__WORK_INITIALIZER(*(_work), _func))
+
+extern struct workqueue_struct *system_wq;
+
+struct workqueue_struct *alloc_workqueue(const char *fmt, unsigned int flags,
+		int max_active, ...);
+void destroy_workqueue(struct workqueue_struct *wq);
+bool queue_work(struct workqueue_struct *wq, struct work_struct *work);
+bool cancel_work_sync(struct work_struct *work);
+void flush_workqueue(struct workqueue_struct *wq);
+
+static inline bool schedule_work(struct work_struct *work)
+{
+	return queue_work(system_wq, work);
+}
+
+static inline void flush_scheduled_work(void)
+{
+	flush_workqueue(system_wq);
+}
+
+/* Delayed work is queued on the system workqueue once its timer expires,
+ * checked every time the simulated clock moves.
+ */
+struct delayed_work {
+	struct work_struct work;
+	unsigned long sim_expires;
+	bool sim_armed;
+	struct delayed_work *sim_next;
+};
+
+#define DECLARE_DELAYED_WORK(n, f) \
+	struct delayed_work n = { .work = __WORK_INITIALIZER(n.work, f) }
+
+static inline struct delayed_work *to_delayed_work(struct work_struct *work)
+{
+	return container_of(work, struct delayed_work, work);
+}
+
+bool schedule_delayed_work(struct delayed_work *dwork, unsigned long delay);
+bool cancel_delayed_work_sync(struct delayed_work *dwork);
+
+/* Pressure stall information. The simulator counts as memory stall the time
+ * spent in direct reclaim: "some" for every task, "full" for the foreground
+ * one (oom_score_adj 0), which the user is waiting for. As in the kernel the
+ * PSI_AVGS totals only catch up every PSI_FREQ_NS, and the PSI_POLL totals
+ * only move while a trigger is registered; then they see the stall at once.
+ */
+
+#define PSI_FREQ_NS	(2 * NSEC_PER_SEC)
+
+enum psi_states {
+	PSI_IO_SOME,
+	PSI_IO_FULL,
+	PSI_MEM_SOME,
+	PSI_MEM_FULL,
+	PSI_CPU_SOME,
+	PSI_NONIDLE,
+	NR_PSI_STATES,
+};
+
+enum psi_aggregators {
+	PSI_AVGS = 0,
+	PSI_POLL,
+	NR_PSI_AGGREGATORS,
+};
+
+struct psi_group {
+	u64 total[NR_PSI_AGGREGATORS][NR_PSI_STATES - 1];
+};
+
+extern struct psi_group psi_system;
+
+enum psi_res {
+	PSI_IO,
+	PSI_MEM,
+	PSI_CPU,
+	NR_PSI_RESOURCES,
+};
+
+struct psi_trigger;
+
+#define MAX_ERRNO	4095
+#define ERR_PTR(err)	((void *)(long)(err))
+#define IS_ERR(ptr)	((unsigned long)(ptr) >= (unsigned long)-MAX_ERRNO)
+
+/* Only one trigger, on psi_system; the buffer is not parsed */
+struct psi_trigger *psi_trigger_create(struct psi_group *group, char *buf,
+		size_t nbytes, enum psi_res res);
+void psi_trigger_replace(void **trigger_ptr, struct psi_trigger *t);
+
+/* Sorting */
+
+void sort(void *base, size_t num, size_t size,
+	  int (*cmp)(const void *, const void *),
+	  void (*swap)(void *, void *, int size));
+
+/* Notifiers: the task handoff chain is called when a task is freed, which
+ * in the simulation is when it exits and releases its memory.
+ */
+
+#define NOTIFY_DONE		0x0000
+#define NOTIFY_OK		0x0001
+
+struct notifier_block {
+	int (*notifier_call)(struct notifier_block *nb, unsigned long action,
+			void *data);
+	struct notifier_block *next;
+	int priority;
+};
+
+int task_handoff_register(struct notifier_block *n);
+int task_handoff_unregister(struct notifier_block *n);
+
+/* Shrinker */
+
+#define DEFAULT_SEEKS 2
+
+struct shrink_control {
+	gfp_t gfp_mask;
+	unsigned long nr_to_scan;
+};
+
+struct shrinker {
+	int (*shrink)(struct shrinker *, struct shrink_control *sc);
+	int seeks;
+	long batch;
+	long nr_in_batch;
+};
+
+void register_shrinker(struct shrinker *shrinker);
+void unregister_shrinker(struct shrinker *shrinker);
+
+/* Module parameters: registered by name so the simulator can set them */
+
+#define S_IRUGO		0444
+#define S_IWUSR		0200
+
+struct kernel_param;
+
+struct kernel_param_ops {
+	int (*set)(const char *val, const struct kernel_param *kp);
+	int (*get)(char *buffer, const struct kernel_param *kp);
+	void (*free)(void *arg);
+};
+
+struct kernel_param {
+	const char *name;
+	const struct kernel_param_ops *ops;
+	void *arg;
+};
+
+enum sim_param_type {
+	SIM_PARAM_int,
+	SIM_PARAM_uint,
+	SIM_PARAM_long,
+	SIM_PARAM_short,
+	SIM_PARAM_bool,
+	SIM_PARAM_charp,
+	SIM_PARAM_cb
+};
+
+void sim_param_register(const char *name, void *value,
+		enum sim_param_type type, size_t elemsize, int *num, int max,
+		const struct kernel_param_ops *ops);
+
+#define module_param_named(name, value, type, perm)			\
+	static void __attribute__((constructor)) __sim_param_##name(void) \
+	{								\
+		sim_param_register(#name, &(value), SIM_PARAM_##type,	\
+				   sizeof(value), NULL, 1, NULL);	\
+	}
+
+#define module_param_array_named(name, array, type, nump, perm)	\
+	static void __attribute__((constructor)) __sim_param_##name(void) \
+	{								\
+		sim_param_register(#name, (array), SIM_PARAM_##type,	\
+				   sizeof((array)[0]), (nump),		\
+				   ARRAY_SIZE(array), NULL);		\
+	}
+
+#define module_param_string(name, string, len, perm)			\
+	static void __attribute__((constructor)) __sim_param_##name(void) \
+	{								\
+		sim_param_register(#name, (string), SIM_PARAM_charp,	\
+				   (len), NULL, 1, NULL);		\
+	}
+
+#define module_param_cb(name, ops, arg, perm)				\
+	static void __attribute__((constructor)) __sim_param_##name(void) \
+	{								\
+		sim_param_register(#name, (arg), SIM_PARAM_cb, 0,	\
+				   NULL, 0, (ops));			\
+	}
+
+typedef int (*initcall_t)(void);
+typedef void (*exitcall_t)(void);
+
+#define module_init(fn)		initcall_t sim_module_init = (fn);
+#define module_exit(fn)		exitcall_t sim_module_exit = (fn);
+#define MODULE_LICENSE(license)
+
+#endif /* _LMK_SHIM_H */
@@ -0,0 +1,72 @@
+/* sim.h
+ *
+ * Interface of the simulated system behind lmk_shim.h. The simulators use
+ * it to create and destroy tasks, move the clock, allocate memory and run
+ * the page reclaim that ends up calling the lowmemorykiller shrinker.
+ *
+ * All sizes are in pages and all times in nanoseconds of simulated time.
+ */
+
+#ifndef _SIM_H
+#define _SIM_H
+
+#include <stdio.h>
+
+#include "lmk_shim.h"
+
+#define SIM_MB(x)	((long)(x) * (1024 * 1024 / (long)PAGE_SIZE))
+#define SIM_KB(pages)	((long)(pages) * (long)(PAGE_SIZE / 1024))
+
+/* Counters of one simulated run */
+struct sim_stats {
+	long shrink_calls;		/* lowmem_shrink invocations */
+	long shrink_scans;		/* ... of them with nr_to_scan > 0 */
+	long kills;			/* SIGKILLs sent by the driver */
+	long oom_kills;			/* tasks killed by the OOM killer */
+	long killed_kb;			/* RSS of the killed tasks */
+	long reclaimed_slab;		/* pages credited via reclaim_state */
+	long reaped;			/* pages unmapped before the exit */
+	long kswapd_runs;
+	long direct_reclaims;
+	long alloc_failures;		/* pages that could not be allocated */
+	u64 stall_ns;			/* time in direct reclaim */
+	u64 shrink_ns;			/* host time spent inside the shrinker */
+};
+
+extern struct sim_stats sim_stats;
+
+/* Memory model tunables, set before sim_init() */
+extern long sim_file_min_pages;		/* page cache working set floor */
+extern u64 sim_exit_latency_ns;		/* SIGKILL to exit_mm delay */
+
+/* Called whenever a SIGKILL is delivered, and when a task finally exits */
+extern void (*sim_kill_hook)(struct task_struct *victim);
+extern void (*sim_exit_hook)(struct task_struct *task);
+
+void sim_init(long totalram_pages, long file_pages);
+void sim_set_log(FILE *log);
+
+u64 sim_now(void);
+void sim_advance(u64 ns);
+
+struct task_struct *sim_spawn(const char *comm, pid_t pid, short oom_score_adj,
+		long rss_pages, unsigned int flags);
+struct task_struct *sim_find_pid(pid_t pid);
+void sim_set_oom_score_adj(struct task_struct *task, short oom_score_adj);
+void sim_exit(struct task_struct *task);
+long sim_alloc(struct task_struct *task, long pages);
+void sim_free(struct task_struct *task, long pages);
+void sim_file_add(long pages);
+
+void sim_kswapd(void);
+unsigned long sim_shrink_slab(unsigned long nr_pages_scanned,
+		unsigned long lru_pages);
+
+int sim_param_set(const char *name, const char *val);
+int sim_param_get(const char *name, char *buf, size_t len);
+int sim_param_set_arg(const char *arg);
+
+int sim_module_load(void);
+void sim_module_unload(void);
+
+#endif /* _SIM_H */